@@ -0,0 +1,127 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+
+#include "vec3.h"
+
+class affine {
+	// 3x4 affine transform: a 3x3 linear part followed by a translation. Points use the full
+	// transform, vectors only the linear part.
+public:
+	double m[3][4];
+
+	affine() : m{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0} } {}
+
+	static affine translation(const vec3& offset) {
+		affine t;
+		for (int i = 0; i < 3; i++)
+			t.m[i][3] = offset[i];
+		return t;
+	}
+
+	static affine scaling(const vec3& scale) {
+		affine t;
+		for (int i = 0; i < 3; i++)
+			t.m[i][i] = scale[i];
+		return t;
+	}
+
+	static affine rotation_y(double degrees) {
+		auto radians = degrees_to_radians(degrees);
+		auto sin_theta = sin(radians);
+		auto cos_theta = cos(radians);
+		affine t;
+		t.m[0][0] = cos_theta;  t.m[0][2] = sin_theta;
+		t.m[2][0] = -sin_theta; t.m[2][2] = cos_theta;
+		return t;
+	}
+
+	static affine rotation(const vec3& axis, double degrees) {
+		// Rotation about an arbitrary axis through the origin (Rodrigues' formula).
+		auto a = unit_vector(axis);
+		auto radians = degrees_to_radians(degrees);
+		auto s = sin(radians), c = cos(radians), k = 1 - c;
+		affine t;
+		t.m[0][0] = c + a.x() * a.x() * k;
+		t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+		t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+		t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+		t.m[1][1] = c + a.y() * a.y() * k;
+		t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+		t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+		t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+		t.m[2][2] = c + a.z() * a.z() * k;
+		return t;
+	}
+
+	point3 point(const point3& p) const {
+		return point3(
+			m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+			m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+			m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+	}
+
+	vec3 vector(const vec3& v) const {
+		return vec3(
+			m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+			m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+			m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+	}
+
+	vec3 transposed_vector(const vec3& v) const {
+		// Applies the transpose of the linear part. With the inverse transform this maps normals.
+		return vec3(
+			m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+			m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+			m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+	}
+
+	affine inverse() const {
+		// Inverts the linear part by cofactors; the translation becomes -inverse * translation.
+		affine inv;
+		auto det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+			- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+			+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+		auto inv_det = 1 / det;
+
+		inv.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+		inv.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+		inv.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+		inv.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+		inv.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+		inv.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+		inv.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+		inv.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+		inv.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+		auto t = inv.vector(vec3(m[0][3], m[1][3], m[2][3]));
+		for (int i = 0; i < 3; i++)
+			inv.m[i][3] = -t[i];
+		return inv;
+	}
+};
+
+inline affine operator*(const affine& a, const affine& b) {
+	// Composes the transforms: b is applied first, then a.
+	affine c;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 4; j++) {
+			c.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+			if (j == 3) c.m[i][j] += a.m[i][3];
+		}
+	}
+	return c;
+}
+
+inline affine lerp(const affine& a, const affine& b, double t) {
+	// Element-wise interpolation. Points transformed by the result move linearly from a to b,
+	// which is exact when only the translations differ, and keeps interpolated bounds
+	// conservative. Between different linear parts it shears and shrinks: halfway through a
+	// 90 degree turn, objects are scaled by about 0.7.
+	affine c;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 4; j++)
+			c.m[i][j] = (1 - t) * a.m[i][j] + t * b.m[i][j];
+	return c;
+}
+
+#endif
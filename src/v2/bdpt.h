@@ -0,0 +1,322 @@
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "hittable.h"
+#include "material.h"
+#include "light_bvh.h"
+#include <atomic>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+// Bidirectional path tracing (Veach 1997, in the formulation of PBRT v3). Each sample traces a
+// subpath from the camera and one from a light, and joins every prefix of the one to every
+// prefix of the other. A path of n vertices can come out of n + 1 such strategies; each
+// contribution is weighted by the power heuristic over the strategies that could have produced
+// it, from the forward and reverse area densities kept on every vertex. Joining at the camera
+// (light tracing) lands in any pixel, so those contributions are splatted into a shared buffer.
+//
+// Materials that scatter with a density (scattering_pdf > 0) are the connectible vertices;
+// specular and glossy ones, which only scatter() can sample, are treated as delta vertices.
+
+struct bdpt_vertex {
+	enum kind_t { camera, light, surface };
+
+	kind_t kind = surface;
+	hit_record rec;      // Surface vertices; the position and normal of every vertex
+	ray r_in;            // Ray that arrived at a surface vertex
+	color beta;          // Throughput of the subpath up to here, over its density
+	color attenuation;   // Of the scattering at surface vertices
+	double pdf_fwd = 0;  // Area density of this vertex from its subpath's previous vertex
+	double pdf_rev = 0;  // The same from the next vertex, had the path been traced the other way
+	bool delta = false;        // Scattered specularly, so no connection can reach it
+	bool connectible = false;  // Scattered by a density, so connections can be evaluated here
+	int source = -1;     // Light this vertex lies on, if any
+	bool two_sided = false;    // Light vertices on emitters that shine from both faces
+
+	const point3& p() const { return rec.p; }
+	const vec3& normal() const { return rec.normal; }
+
+	double area_density(double direction_pdf, const bdpt_vertex& next) const {
+		// Converts a solid angle density at this vertex into an area density at `next`. Points
+		// in media have no surface, and no cosine.
+		auto w = next.p() - p();
+		auto distance_squared = w.length_squared();
+		if (distance_squared == 0)
+			return 0;
+		auto density = direction_pdf / distance_squared;
+		if (next.normal().length_squared() > 0)
+			density *= std::fabs(dot(next.normal(), w)) / std::sqrt(distance_squared);
+		return density;
+	}
+
+	color eval(const point3& toward) const {
+		// BSDF times cosine of scattering from the subpath towards `toward`; for lights, the
+		// cosine of emitting there, which scales the radiance in beta.
+		if (kind == light) {
+			auto cos_theta = dot(rec.normal, unit_vector(toward - p()));
+			if (two_sided) cos_theta = std::fabs(cos_theta);
+			return cos_theta > 0 ? color(cos_theta, cos_theta, cos_theta) : color(0, 0, 0);
+		}
+		if (!connectible)
+			return color(0, 0, 0);
+		return attenuation * rec.mat->scattering_pdf(r_in, rec, ray(p(), toward - p(), r_in.time()));
+	}
+};
+
+struct bdpt_arena {
+	// A thread's subpath vertices, sized once for the path depth and reused for every sample.
+	std::vector<bdpt_vertex> camera_path, light_path;
+
+	void reserve(int max_depth) {
+		if (camera_path.size() < static_cast<size_t>(max_depth) + 1) camera_path.resize(max_depth + 1);
+		if (light_path.size() < static_cast<size_t>(max_depth)) light_path.resize(max_depth);
+	}
+};
+
+class splat_buffer {
+	// RGB sums that any thread may add to at any pixel, with a compare-and-swap per channel.
+	// The order of the additions varies between runs, so sums can differ in the last bits.
+public:
+	splat_buffer(int _width, int _height)
+		: width(_width), sums(static_cast<size_t>(_width) * _height * 3)
+	{
+		for (auto& s : sums) s.store(0, std::memory_order_relaxed);
+	}
+
+	void add(int i, int j, const color& c) {
+		auto out = &sums[(static_cast<size_t>(j) * width + i) * 3];
+		for (int k = 0; k < 3; k++) {
+			auto current = out[k].load(std::memory_order_relaxed);
+			while (!out[k].compare_exchange_weak(current, current + c[k], std::memory_order_relaxed)) {}
+		}
+	}
+
+	void add_to(std::vector<float>& image) const {
+		for (size_t n = 0; n < sums.size(); n++)
+			image[n] += static_cast<float>(sums[n].load(std::memory_order_relaxed));
+	}
+
+private:
+	int width;
+	std::vector<std::atomic<double>> sums;
+};
+
+class light_emitters {
+	// The lights of a light hierarchy that can place points on their surface, chosen in
+	// proportion to their power. The choice does not depend on the receiving point, so the
+	// density of a light vertex is the same for every strategy that contains it.
+public:
+	light_emitters(const light_bvh* lights) {
+		double total = 0;
+		for (size_t i = 0; lights && i < lights->size(); i++) {
+			const auto& light = lights->light(i);
+			light_shape shape;
+			hit_record probe;
+			if (!light.get_light_shape(shape) || !shape.mat || !light.sample_surface(probe))
+				continue;
+			auto le = shape.mat->emitted(0.5, 0.5, shape.center);
+			auto power = pi * shape.area * (shape.two_sided ? 2 : 1) * (0.2126 * le.x() + 0.7152 * le.y() + 0.0722 * le.z());
+			if (power <= 0)
+				continue;
+			index[&light] = static_cast<int>(sources.size());
+			sources.push_back({ &light, shape.area, shape.two_sided, power });
+			total += power;
+		}
+		for (auto& s : sources)
+			s.pmf = s.power / total;
+	}
+
+	bool empty() const { return sources.empty(); }
+
+	int find(const hittable* object) const {
+		auto found = index.find(object);
+		return found == index.end() ? -1 : found->second;
+	}
+
+	bool sample(double time, bdpt_vertex& v) const {
+		// A light vertex: a light picked by power and a uniform point on it.
+		auto u = random_double();
+		int s = 0;
+		while (s + 1 < static_cast<int>(sources.size()) && u >= sources[s].pmf)
+			u -= sources[s++].pmf;
+		if (!sources[s].light->sample_surface(v.rec))
+			return false;
+
+		v.kind = bdpt_vertex::light;
+		v.source = s;
+		v.two_sided = sources[s].two_sided;
+		v.r_in = ray(v.rec.p, v.rec.normal, time);
+		v.pdf_fwd = origin_pdf(s);
+		v.beta = v.rec.mat->emitted(v.rec.u, v.rec.v, v.rec.p) / v.pdf_fwd;
+		v.delta = false;
+		v.connectible = false;
+		return true;
+	}
+
+	vec3 sample_direction(const bdpt_vertex& v, double& pdf) const {
+		// Cosine-weighted emission about the normal, on a random side of two-sided lights.
+		auto normal = v.rec.normal;
+		if (v.two_sided && random_double() < 0.5)
+			normal = -normal;
+		auto direction = unit_vector(normal + random_unit_vector());
+		pdf = direction_pdf(v, direction);
+		return direction;
+	}
+
+	double origin_pdf(int s) const {
+		// Area density of a light vertex on light s.
+		return s < 0 ? 0 : sources[s].pmf / sources[s].area;
+	}
+
+	double direction_pdf(const bdpt_vertex& v, const vec3& direction) const {
+		// Solid angle density of sample_direction() from the light vertex v.
+		auto cos_theta = dot(v.rec.normal, unit_vector(direction));
+		if (!sources[v.source].two_sided)
+			return cos_theta > 0 ? cos_theta / pi : 0;
+		return std::fabs(cos_theta) / (2 * pi);
+	}
+
+private:
+	struct source {
+		const hittable* light;
+		double area;
+		bool two_sided;
+		double power;
+		double pmf = 0;
+	};
+
+	std::vector<source> sources;
+	std::unordered_map<const hittable*, int> index;
+};
+
+struct camera_importance {
+	// Density of the camera's rays over solid angle, for weighting light tracing against the
+	// camera's own strategies. Rays go through a point drawn uniformly on the image, which lies
+	// on the plane of focus, so a direction at angle theta from the view axis has density
+	// focus_dist^2 / (image area * cos^3 theta).
+	vec3 forward;       // View direction
+	double focus_dist;
+	double image_area;  // Of the image on the plane of focus
+
+	double pdf(const vec3& direction) const {
+		auto cos_theta = dot(unit_vector(direction), forward);
+		if (cos_theta <= 0)
+			return 0;
+		return focus_dist * focus_dist / (image_area * cos_theta * cos_theta * cos_theta);
+	}
+};
+
+inline double bdpt_pdf(const bdpt_vertex& v, const bdpt_vertex* prev, const bdpt_vertex& next,
+	const light_emitters& emitters, const camera_importance& lens) {
+	// Area density of `next` when sampled from v, which the path reached from `prev`.
+	auto direction = next.p() - v.p();
+	double direction_pdf = 0;
+	if (v.kind == bdpt_vertex::camera)
+		direction_pdf = lens.pdf(direction);
+	else if (v.kind == bdpt_vertex::light || (!prev && v.source >= 0))
+		direction_pdf = emitters.direction_pdf(v, direction);
+	else if (v.connectible && prev)
+		direction_pdf = v.rec.mat->scattering_pdf(ray(prev->p(), v.p() - prev->p(), v.r_in.time()), v.rec, ray(v.p(), direction, v.r_in.time()));
+	return v.area_density(direction_pdf, next);
+}
+
+inline double bdpt_mis_weight(bdpt_vertex* camera_path, int t, bdpt_vertex* light_path, int s,
+	const light_emitters& emitters, const camera_importance& lens) {
+	// Power heuristic weight of the strategy with s light and t camera vertices, against the
+	// others that sample the same path. The reverse densities at the joined ends are filled in
+	// for this path, then walked outwards as ratios of each neighboring strategy's density to
+	// this one's (PBRT v3, 16.3.4). Delta vertices enter with a density of one, and cannot be
+	// joined at.
+	if (s + t == 2)
+		return 1;
+
+	auto* x = t > 0 ? &camera_path[t - 1] : nullptr;
+	auto* x_prev = t > 1 ? &camera_path[t - 2] : nullptr;
+	auto* y = s > 0 ? &light_path[s - 1] : nullptr;
+	auto* y_prev = s > 1 ? &light_path[s - 2] : nullptr;
+
+	double saved[4] = { x ? x->pdf_rev : 0, x_prev ? x_prev->pdf_rev : 0, y ? y->pdf_rev : 0, y_prev ? y_prev->pdf_rev : 0 };
+	if (s == 0) {
+		// The camera path found a light by itself.
+		if (x->source < 0)
+			return 1;
+		x->pdf_rev = emitters.origin_pdf(x->source);
+		x_prev->pdf_rev = bdpt_pdf(*x, nullptr, *x_prev, emitters, lens);
+	}
+	else {
+		if (x) x->pdf_rev = bdpt_pdf(*y, y_prev, *x, emitters, lens);
+		if (x_prev) x_prev->pdf_rev = bdpt_pdf(*x, y, *x_prev, emitters, lens);
+		y->pdf_rev = bdpt_pdf(*x, x_prev, *y, emitters, lens);
+		if (y_prev) y_prev->pdf_rev = bdpt_pdf(*y, x, *y_prev, emitters, lens);
+	}
+
+	auto remap = [](double pdf) { return pdf != 0 ? pdf : 1.0; };
+	double sum = 0, ratio = 1;
+	for (int i = t - 1; i > 0; i--) {
+		ratio *= remap(camera_path[i].pdf_rev) / remap(camera_path[i].pdf_fwd);
+		if (!camera_path[i].delta && !camera_path[i - 1].delta)
+			sum += ratio * ratio;
+	}
+	ratio = 1;
+	for (int i = s - 1; i >= 0; i--) {
+		ratio *= remap(light_path[i].pdf_rev) / remap(light_path[i].pdf_fwd);
+		if (!light_path[i].delta && (i == 0 || !light_path[i - 1].delta))
+			sum += ratio * ratio;
+	}
+
+	if (x) x->pdf_rev = saved[0];
+	if (x_prev) x_prev->pdf_rev = saved[1];
+	if (y) y->pdf_rev = saved[2];
+	if (y_prev) y_prev->pdf_rev = saved[3];
+	return 1 / (1 + sum);
+}
+
+inline int bdpt_random_walk(const hittable& world, ray r, color beta, double direction_pdf, bdpt_vertex* path,
+	int max_vertices, const light_emitters& emitters, ray& escaped) {
+	// Extends a subpath whose last vertex is path[-1] along r, for up to max_vertices more
+	// vertices, and returns how many it added. `escaped` is set to the ray that left the scene,
+	// if one did, with a zero direction otherwise.
+	escaped = ray(r.origin(), vec3(0, 0, 0), r.time());
+	int count = 0;
+	while (count < max_vertices) {
+		auto& v = path[count];
+		auto& prev = path[count - 1];
+		if (!world.hit(r, interval(0.001, infinity), v.rec)) {
+			escaped = r;
+			break;
+		}
+		if (r.has_differentials)
+			v.rec.compute_differentials(r);
+
+		v.kind = bdpt_vertex::surface;
+		v.r_in = r;
+		v.beta = beta;
+		v.pdf_fwd = prev.area_density(direction_pdf, v);
+		v.pdf_rev = 0;
+		v.source = emitters.find(v.rec.object);
+		count++;
+
+		ray scattered;
+		if (!v.rec.mat->scatter(r, v.rec, v.attenuation, scattered)) {
+			v.delta = v.connectible = false;
+			break;
+		}
+
+		direction_pdf = v.rec.mat->scattering_pdf(r, v.rec, scattered);
+		v.delta = direction_pdf == 0;
+		v.connectible = !v.delta;
+		beta = beta * v.attenuation;
+
+		// The density of scattering back towards where the path came from.
+		double reverse_pdf = 0;
+		if (v.connectible)
+			reverse_pdf = v.rec.mat->scattering_pdf(ray(v.p(), scattered.direction(), r.time()), v.rec, ray(v.p(), prev.p() - v.p(), r.time()));
+		prev.pdf_rev = v.area_density(reverse_pdf, prev);
+
+		r = scattered;
+	}
+	return count;
+}
+
+#endif
@@ -17,6 +17,8 @@
 
 
 #include <algorithm>
+#include <cfloat>
+#include <cstdint>
 
 inline int random_int(int min, int max) {
     // Returns a random integer in [min,max].
@@ -59,10 +61,16 @@ public:
         }
 
         bbox = aabb(left->bounding_box(), right->bounding_box());
+
+        // Nodes over moving objects keep their bounds at shutter open and close, and test the
+        // box interpolated to the ray time instead of the union over the whole shutter.
+        if (left->has_motion() || right->has_motion())
+            set_motion_bounds(aabb(left->shutter_open_box(), right->shutter_open_box()),
+                aabb(left->shutter_close_box(), right->shutter_close_box()));
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!bbox.hit(r, ray_t))
+        if (has_motion() ? !box_at(r.time()).hit(r, ray_t) : !bbox.hit(r, ray_t))
             return false;
 
         bool hit_left = left->hit(r, ray_t, rec);
@@ -75,6 +83,14 @@ private:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
 
+    aabb box_at(double time) const {
+        auto open = shutter_open_box(), close = shutter_close_box();
+        auto lerp = [time](const interval& a, const interval& b) {
+            return interval((1 - time) * a.min + time * b.min, (1 - time) * a.max + time * b.max);
+        };
+        return aabb(lerp(open.x, close.x), lerp(open.y, close.y), lerp(open.z, close.z));
+    }
+
     static bool box_compare(
         const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
     ) {
@@ -94,5 +110,240 @@ private:
     }
 };
 
+// Flattened BVH over the primitives of a single compound hittable (triangle meshes, sphere
+// sets). Nodes are 32 bytes with float bounds, stored depth first so the left child directly
+// follows its parent. Leaves cover a contiguous range of primitives: the builder returns the
+// primitive order, and the owner stores its primitives in that order.
+
+struct flat_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset;  // Leaf: first primitive. Interior: index of the right child.
+    uint16_t count;   // Leaf: number of primitives. Interior: 0.
+    uint16_t axis;    // Interior: split axis, used to visit the nearer child first.
+};
+
+struct flat_bvh_bounds {
+    float bounds_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float bounds_max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    void grow(const flat_bvh_bounds& b) {
+        for (int a = 0; a < 3; a++) {
+            bounds_min[a] = std::min(bounds_min[a], b.bounds_min[a]);
+            bounds_max[a] = std::max(bounds_max[a], b.bounds_max[a]);
+        }
+    }
+
+    void grow(const float* p) {
+        for (int a = 0; a < 3; a++) {
+            bounds_min[a] = std::min(bounds_min[a], p[a]);
+            bounds_max[a] = std::max(bounds_max[a], p[a]);
+        }
+    }
+
+    float centroid(int a) const { return 0.5f * (bounds_min[a] + bounds_max[a]); }
+
+    float surface_area() const {
+        if (bounds_min[0] > bounds_max[0]) return 0;
+        auto dx = bounds_max[0] - bounds_min[0], dy = bounds_max[1] - bounds_min[1], dz = bounds_max[2] - bounds_min[2];
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    aabb to_aabb() const {
+        return aabb(point3(bounds_min[0], bounds_min[1], bounds_min[2]), point3(bounds_max[0], bounds_max[1], bounds_max[2])).pad();
+    }
+};
+
+class flat_bvh_builder {
+    // Top-down binned SAH builder.
+public:
+    static std::vector<flat_bvh_node> build(const std::vector<flat_bvh_bounds>& prims, int max_leaf_size,
+        std::vector<uint32_t>& order) {
+        std::vector<flat_bvh_node> nodes;
+        order.resize(prims.size());
+        for (uint32_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        if (prims.empty()) return nodes;
+
+        nodes.reserve(2 * prims.size() / std::max(1, max_leaf_size) + 1);
+        flat_bvh_builder builder(prims, order, nodes, std::max(1, std::min(max_leaf_size, 0xffff)));
+        builder.build_node(0, prims.size(), 0);
+        return nodes;
+    }
+
+private:
+    flat_bvh_builder(const std::vector<flat_bvh_bounds>& _prims, std::vector<uint32_t>& _order,
+        std::vector<flat_bvh_node>& _nodes, int _max_leaf_size)
+        : prims(_prims), order(_order), nodes(_nodes), max_leaf_size(_max_leaf_size) {}
+
+    const std::vector<flat_bvh_bounds>& prims;
+    std::vector<uint32_t>& order;
+    std::vector<flat_bvh_node>& nodes;
+    int max_leaf_size;
+
+    static const int bin_count = 12;
+    static const int max_sah_depth = 32;
+
+    void build_node(size_t start, size_t end, int depth) {
+        flat_bvh_bounds bounds, centroids;
+        for (size_t i = start; i < end; i++) {
+            bounds.grow(prims[order[i]]);
+            float c[3] = { prims[order[i]].centroid(0), prims[order[i]].centroid(1), prims[order[i]].centroid(2) };
+            centroids.grow(c);
+        }
+
+        auto index = nodes.size();
+        nodes.push_back({});
+        auto set_bounds = [&](flat_bvh_node& node) {
+            // Round outward so float bounds stay conservative.
+            for (int a = 0; a < 3; a++) {
+                node.bounds_min[a] = std::nextafter(bounds.bounds_min[a], -FLT_MAX);
+                node.bounds_max[a] = std::nextafter(bounds.bounds_max[a], FLT_MAX);
+            }
+        };
+        auto make_leaf = [&] {
+            auto& node = nodes[index];
+            set_bounds(node);
+            node.offset = static_cast<uint32_t>(start);
+            node.count = static_cast<uint16_t>(end - start);
+            node.axis = 0;
+        };
+
+        auto count = end - start;
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (centroids.bounds_max[a] - centroids.bounds_min[a] > centroids.bounds_max[axis] - centroids.bounds_min[axis])
+                axis = a;
+        auto extent = centroids.bounds_max[axis] - centroids.bounds_min[axis];
+
+        if (count <= 2 && count <= static_cast<size_t>(max_leaf_size)) {
+            make_leaf();
+            return;
+        }
+        if (!(extent > 0)) {
+            // All centroids coincide; a split cannot separate them.
+            if (count <= static_cast<size_t>(max_leaf_size)) {
+                make_leaf();
+                return;
+            }
+            build_split(index, start, start + count / 2, end, axis, bounds, depth);
+            return;
+        }
+        if (depth >= max_sah_depth) {
+            // Fall back to median splits deep in the tree so traversal stacks stay bounded.
+            auto mid = start + count / 2;
+            std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                [&](uint32_t a, uint32_t b) { return prims[a].centroid(axis) < prims[b].centroid(axis); });
+            build_split(index, start, mid, end, axis, bounds, depth);
+            return;
+        }
+
+        // Bin the centroids along the widest axis and evaluate the SAH at each bin boundary.
+        struct bin { flat_bvh_bounds bounds; size_t count = 0; };
+        bin bins[bin_count];
+        auto bin_of = [&](uint32_t prim) {
+            auto b = static_cast<int>(bin_count * (prims[prim].centroid(axis) - centroids.bounds_min[axis]) / extent);
+            return std::min(b, bin_count - 1);
+        };
+        for (size_t i = start; i < end; i++) {
+            auto& b = bins[bin_of(order[i])];
+            b.bounds.grow(prims[order[i]]);
+            b.count++;
+        }
+
+        float cost[bin_count - 1];
+        for (int split = 0; split < bin_count - 1; split++) {
+            flat_bvh_bounds left, right;
+            size_t left_count = 0, right_count = 0;
+            for (int b = 0; b <= split; b++) { left.grow(bins[b].bounds); left_count += bins[b].count; }
+            for (int b = split + 1; b < bin_count; b++) { right.grow(bins[b].bounds); right_count += bins[b].count; }
+            cost[split] = 0.125f + (left_count * left.surface_area() + right_count * right.surface_area()) / bounds.surface_area();
+        }
+
+        int best = 0;
+        for (int split = 1; split < bin_count - 1; split++)
+            if (cost[split] < cost[best]) best = split;
+
+        if (count <= static_cast<size_t>(max_leaf_size) && cost[best] >= static_cast<float>(count)) {
+            make_leaf();
+            return;
+        }
+
+        auto mid = std::partition(order.begin() + start, order.begin() + end,
+            [&](uint32_t prim) { return bin_of(prim) <= best; }) - order.begin();
+        if (mid == static_cast<std::ptrdiff_t>(start) || mid == static_cast<std::ptrdiff_t>(end))
+            mid = start + count / 2;
+
+        build_split(index, start, mid, end, axis, bounds, depth);
+    }
+
+    void build_split(size_t index, size_t start, size_t mid, size_t end, int axis, const flat_bvh_bounds& bounds, int depth) {
+        build_node(start, mid, depth + 1);
+        auto right = nodes.size();
+        build_node(mid, end, depth + 1);
+
+        auto& node = nodes[index];
+        for (int a = 0; a < 3; a++) {
+            node.bounds_min[a] = std::nextafter(bounds.bounds_min[a], -FLT_MAX);
+            node.bounds_max[a] = std::nextafter(bounds.bounds_max[a], FLT_MAX);
+        }
+        node.offset = static_cast<uint32_t>(right);
+        node.count = 0;
+        node.axis = static_cast<uint16_t>(axis);
+    }
+};
+
+template <typename leaf_function>
+bool traverse_flat_bvh(const flat_bvh_node* nodes, size_t node_count, const ray& r, interval& ray_t, leaf_function&& hit_leaf) {
+    // Visits the leaves the ray passes through, nearer child first. hit_leaf(first, count, ray_t)
+    // intersects a primitive range and, on a hit, shrinks ray_t.max to the hit distance.
+    if (node_count == 0) return false;
+
+    const auto orig = r.origin();
+    const auto dir = r.direction();
+    const double inv_dir[3] = { 1 / dir[0], 1 / dir[1], 1 / dir[2] };
+
+    auto hits_node = [&](const flat_bvh_node& node) {
+        auto t_min = ray_t.min, t_max = ray_t.max;
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (node.bounds_min[a] - orig[a]) * inv_dir[a];
+            auto t1 = (node.bounds_max[a] - orig[a]) * inv_dir[a];
+            if (inv_dir[a] < 0) std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min) return false;
+        }
+        return true;
+    };
+
+    uint32_t stack[64];
+    int stack_size = 0;
+    uint32_t current = 0;
+    bool hit_anything = false;
+
+    while (true) {
+        const auto& node = nodes[current];
+        if (hits_node(node)) {
+            if (node.count > 0) {
+                if (hit_leaf(node.offset, node.count, ray_t))
+                    hit_anything = true;
+            }
+            else if (inv_dir[node.axis] < 0) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+                continue;
+            }
+            else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+    }
+    return hit_anything;
+}
+
 
 #endif
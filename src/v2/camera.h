@@ -4,23 +4,29 @@
 #include "ray.h"
 #include "vec3.h"
 #include "hittable.h"
+#include <atomic>
 #include <fstream>
 #include<ppl.h>
 #include"material.h"
+#include "image_writer.h"
+#include "tiles.h"
+#include "light_bvh.h"
+#include "environment.h"
+#include "restir.h"
+#include "guiding.h"
+#include "photon.h"
+#include "bdpt.h"
+#include "radiance_cache.h"
+#include "lightmap.h"
+#include "framebuffer.h"
+#include "denoise.h"
 
-void write_color(std::ostream& out, vec3 pixel_color, int samples_per_pixel) {
-	//Images with data that are written without being transformed are said to be in linear space, whereas images that are transformed are said to be in gamma space.
-	auto linear_to_gamma = [](vec3 linear_component)
-	{
-		return linear_component.squared();
-	};
-	pixel_color = linear_to_gamma(pixel_color / samples_per_pixel);
-
-	out << static_cast<int>(255.999 * pixel_color.x()) << ' '
-		<< static_cast<int>(255.999 * pixel_color.y()) << ' '
-		<< static_cast<int>(255.999 * pixel_color.z()) << '\n';
-}
-
+enum class integrator_mode {
+	path_tracing,  // ray_color per sample, with next event estimation when lights are set
+	restir,        // One progressive pass per sample, with resampled direct light from the lights
+	path_guiding,  // Passes of doubling sample counts that learn where light comes from and sample it
+	bidirectional, // Camera and light subpaths joined in every way, weighted by multiple importance sampling
+};
 
 class camera {
 public:
@@ -38,6 +44,21 @@ public:
 	double defocus_angle = 0;  // Variation angle of rays through each pixel
 	double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+	int    tile_size = 32;     // Edge length of the square pixel blocks handed to render threads
+	shard_config shard;        // Part of the frame this process renders when distributed across workers
+	bool   streaming = false;  // Write completed bands of tiles to disk instead of holding the whole frame
+	shared_ptr<light_bvh> lights;  // Emitters sampled directly at diffuse bounces; null to rely on scattering alone
+	shared_ptr<environment_map> environment;  // HDR sky that replaces the background color and is sampled like a light
+	integrator_mode integrator = integrator_mode::path_tracing;
+	restir_settings restir;    // Used by integrator_mode::restir
+	guiding_settings guiding;  // Used by integrator_mode::path_guiding
+	photon_settings photons;   // Caustics from a photon map; photons.paths = 0 leaves them to path tracing
+	std::vector<aabb> caustic_casters;  // Bounds of the glass and metal objects photons are aimed at; empty for the whole scene
+	shared_ptr<radiance_cache> cache;  // Diffuse light past the first bounce, kept across renders; null to trace every bounce
+	shared_ptr<lightmap_set> lightmaps;  // Baked by bake_lightmaps(); diffuse hits on baked surfaces stop there
+	denoise_settings denoising;  // Filters the frame before writing it; denoising.passes = 0 writes it as rendered
+	std::vector<aov> aovs;       // Channels written besides the image: layers of an .exr, files next to other formats
+
 	point3 defocus_disk_sample() const {
 		// Returns a random point in the camera defocus disk.
 		auto   random_in_unit_disk = []() {
@@ -62,7 +83,10 @@ public:
 		auto ray_direction = pixel_sample - ray_origin;
 		auto ray_time = random_double();
 
-		return ray(ray_origin, ray_direction, ray_time);
+		// The differential rays pass through the same lens point and the neighboring pixels.
+		ray r(ray_origin, ray_direction, ray_time);
+		r.set_differentials(ray_origin, ray_direction + pixel_delta_u, ray_origin, ray_direction + pixel_delta_v);
+		return r;
 	}
 
 	vec3 pixel_sample_square() const {
@@ -72,34 +96,198 @@ public:
 		return (px * pixel_delta_u) + (py * pixel_delta_v);
 	}
 
-	void render(const hittable& world) {
+	bool render(const hittable& world) {
+		// False if the output could not be written.
 		initialize();
 
-		std::ofstream myfile;
-		myfile.open(file_name, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (integrator == integrator_mode::bidirectional) {
+			if (lights && !light_emitters(lights.get()).empty() && !shard.is_distributed()) {
+				return render_bidirectional(world);
+			}
+			std::clog << "Bidirectional path tracing needs area lights and a single process; rendering with path tracing.\n";
+		}
+
+		build_caustics(world);
+
+		if (integrator == integrator_mode::restir) {
+			if (lights && !lights->empty() && !shard.is_distributed()) {
+				return render_restir(world);
+			}
+			std::clog << "ReSTIR needs lights and a single process; rendering with path tracing.\n";
+		}
+		if (integrator == integrator_mode::path_guiding) {
+			if (!shard.is_distributed()) {
+				return render_guided(world);
+			}
+			std::clog << "Path guiding learns from the whole frame and needs a single process; rendering with path tracing.\n";
+		}
+
+		// Every pixel sample is seeded from its pixel and sample index, so the result does not
+		// depend on which thread or worker process traces it.
+		auto tiles = make_tiles(image_width, image_height, tile_size);
+		std::vector<size_t> owned;
+		for (size_t n = 0; n < tiles.size(); n++)
+			if (shard.owns_tile(n)) owned.push_back(n);
+
+		if ((denoising.passes > 0 || !aovs.empty()) && (shard.is_distributed() || streaming))
+			std::clog << "Denoising and AOVs need the whole frame in one process; writing the image alone.\n";
+		if (streaming && (shard.is_distributed() || image_stream::supports(file_name))) {
+			auto ok = render_streaming(world, tiles, owned);
+			report_cache();
+			return ok;
+		}
+		if (streaming)
+			std::clog << "Streaming output supports .ppm and .pfm only; rendering '" << file_name << "' in memory.\n";
+
+		bool ok = true;
+		if (shard.is_distributed()) {
+			std::vector<float> image(static_cast<size_t>(image_width) * image_height * 3, 0.0f);
+			render_tiles(world, tiles, owned, image.data(), 0);
+			partial_writer part(shard.part_file(file_name), shard, image_width, image_height, samples_per_pixel, tiles);
+			for (auto n : owned)
+				ok = ok && part.write_tile(tiles[n], image.data(), image_width, 0);
+			if (!part.close() || !ok) {
+				std::cerr << "ERROR: Could not write partial file '" << shard.part_file(file_name) << "'.\n";
+				ok = false;
+			}
+		}
+		else {
+			auto frame = make_framebuffer();
+			render_tiles(world, tiles, owned, nullptr, 0, &frame);
+			ok = write_frame(frame);
+		}
+		report_cache();
+		return ok;
+	}
+
+	void bake_lightmaps(const hittable& world, lightmap_set& maps) const {
+		// Fills the lightmaps with samples_per_pixel paths per texel. Each path leaves a random
+		// point of the texel in a cosine distributed direction, and brings back the light
+		// reflected there per unit albedo, less what light sampling at render time adds. Rows
+		// of texels from all maps are spread over the threads. Bake before setting `lightmaps`, or
+		// paths read maps that are still being filled.
+		struct job { size_t map, first, count; };
+		std::vector<job> jobs;
+		size_t texels = 0;
+		for (size_t m = 0; m < maps.size(); m++) {
+			for (size_t first = 0; first < maps[m].texel_count(); first += maps[m].width())
+				jobs.push_back({ m, first, std::min<size_t>(maps[m].width(), maps[m].texel_count() - first) });
+			texels += maps[m].texel_count();
+		}
 
-		myfile << "P3\n" << image_width << " " << image_height << "\n255\n";
-		std::vector<color> image(image_width * image_height);
+		std::vector<size_t> offsets(maps.size(), 0);
+		for (size_t m = 1; m < maps.size(); m++)
+			offsets[m] = offsets[m - 1] + maps[m - 1].texel_count();
 
-		Concurrency::parallel_for(0, image_height, [&](int j) {
-			/*std::clog << "\rScanlines remaining: " << (remine - -) << ' ' << std::flush;*/
-			for (int i = 0; i < image_width; ++i) {
-				color pixel_color(0, 0, 0);
-				for (int sample = 0; sample < samples_per_pixel; ++sample) {
-					ray r = get_ray(i, j);
-					pixel_color += ray_color(r, max_depth, world);
+		Concurrency::parallel_for(size_t(0), jobs.size(), [&](size_t n) {
+			auto& map = maps[jobs[n].map];
+			for (auto texel = jobs[n].first; texel < jobs[n].first + jobs[n].count; texel++) {
+				color sum(0, 0, 0);
+				for (int sample = 0; sample < samples_per_pixel; sample++) {
+					seed_random(hash_seed(offsets[jobs[n].map] + texel, sample));
+					hit_record rec;
+					if (!map.sample_point(texel, rec))
+						break;
+
+					auto time = random_double();
+					auto direction = rec.normal + random_unit_vector();
+					if (direction.near_zero())
+						direction = rec.normal;
+					ray arriving(rec.p + rec.normal, -rec.normal, time);
+					ray scattered(rec.p, direction, time);
+					auto here = scatter_vertex(arriving, rec, scattered);
+					here.past_diffuse = true;
+					sum += ray_color(scattered, max_depth - 1, world, here);
 				}
-				//write_color(myfile, pixel_color, samples_per_pixel);
-				image[(j * image_width + i)] = pixel_color;
+				map.store(texel, sum / samples_per_pixel);
 			}
 			});
 
-		for (int j = 0; j < image_height; j++) {
-			for (int i = 0; i < image_width; ++i) {
-				write_color(myfile, image[(j * image_width + i)], samples_per_pixel);
+		for (size_t m = 0; m < maps.size(); m++)
+			maps[m].fill_gaps();
+		std::clog << "Baked " << maps.size() << " lightmaps, " << texels << " texels\n";
+	}
+
+	// Progressive rendering, for sessions that keep the scene loaded and re-render as settings
+	// change: prepare() after changing them, then add passes of samples to a framebuffer and
+	// write it after each.
+
+	void prepare(const hittable& world) {
+		// Sets up the view, and traces the photon map the first time.
+		initialize();
+		if (!caustics)
+			build_caustics(world);
+	}
+
+	framebuffer make_framebuffer() const {
+		// With the channels in `aovs` and those the denoiser reads.
+		std::vector<aov> channels = aovs;
+		if (denoising.passes > 0)
+			channels.insert(channels.end(), std::begin(denoise_features), std::end(denoise_features));
+		return framebuffer(image_width, image_height, tile_size, channels);
+	}
+
+	bool render_samples(const hittable& world, framebuffer& frame, int first_sample, int count,
+		const std::atomic<bool>& cancel) const {
+		// Path traces samples [first_sample, first_sample + count) of every pixel into the
+		// framebuffer. Stops between rows once `cancel` is set, and then returns false.
+		auto tiles = make_tiles(image_width, image_height, tile_size);
+		Concurrency::parallel_for(size_t(0), tiles.size(), [&](size_t n) {
+			const tile& t = tiles[n];
+			for (int j = t.y0; j < t.y0 + t.height && !cancel.load(std::memory_order_relaxed); ++j)
+				for (int i = t.x0; i < t.x0 + t.width; ++i)
+					record_pixel(world, i, j, first_sample, first_sample + count, frame);
+			});
+		return !cancel.load();
+	}
+
+	bool write_frame(const framebuffer& frame) const {
+		// Writes the image, denoised first when asked to, and the channels in `aovs` that the
+		// framebuffer holds: as layers of one file for .exr, and as <name>.<channel>.pfm files
+		// next to the image for other formats. False if any file could not be written.
+		auto image = frame.layer(aov::beauty);
+		if (denoising.passes > 0)
+			image = atrous_denoiser(feature_buffers(frame), denoising).filter(image);
+
+		std::vector<aov> written;
+		std::vector<std::vector<float>> layers;
+		for (auto a : aovs) {
+			if (a != aov::beauty && frame.has(a) && std::find(written.begin(), written.end(), a) == written.end()) {
+				written.push_back(a);
+				layers.push_back(frame.layer(a));
 			}
 		}
+
+		if (format_from_file_name(file_name) == image_format::exr) {
+			std::vector<image_layer> file_layers{ { "", "RGB", image.data() } };
+			for (size_t n = 0; n < written.size(); n++)
+				file_layers.push_back({ aov_name(written[n]), aov_channels(written[n]), layers[n].data() });
+			if (!write_exr(file_name, image_width, image_height, file_layers)) {
+				std::cerr << "ERROR: Could not write output file '" << file_name << "'.\n";
+				return false;
+			}
+			return true;
+		}
+
+		auto ok = write_image(file_name, image, image_width, image_height, 1);
+		auto extension = file_name.find_last_of('.');
+		auto base = file_name.substr(0, extension == std::string::npos ? file_name.size() : extension);
+		for (size_t n = 0; n < written.size(); n++) {
+			// PFM holds RGB, so single channels are repeated three times.
+			auto components = aov_components(written[n]);
+			std::vector<float> rgb(static_cast<size_t>(image_width) * image_height * 3);
+			for (size_t k = 0; k < rgb.size(); k++)
+				rgb[k] = layers[n][k / 3 * components + (components == 3 ? k % 3 : 0)];
+			auto name = base + "." + aov_name(written[n]) + ".pfm";
+			if (!write_pfm(name, rgb.data(), image_width, image_height)) {
+				std::cerr << "ERROR: Could not write output file '" << name << "'.\n";
+				ok = false;
+			}
+		}
+		return ok;
 	}
+
+
 	color  background = color(0.70, 0.80, 1.00);;               // Scene background color
 private:
 	int    image_height;   // Rendered image height
@@ -112,6 +300,665 @@ private:
 
 	vec3   defocus_disk_u;  // Defocus disk horizontal radius
 	vec3   defocus_disk_v;  // Defocus disk vertical radius
+	path_guide* guide = nullptr;  // Set while rendering with integrator_mode::path_guiding
+	shared_ptr<photon_map> caustics;  // Built by render() when photons.paths > 0
+	bool   guide_learning = false;  // Record the light paths find into the guide
+
+	void build_caustics(const hittable& world) {
+		// Every process traces the same photons, since their seeds depend only on the path.
+		caustics = nullptr;
+		if (photons.paths <= 0)
+			return;
+
+		caustic_photon_tracer tracer(world, lights.get(), environment.get(), background, caustic_casters, photons);
+		caustics = tracer.trace();
+		std::clog << "Caustics: " << caustics->size() << " photons from " << caustics->paths() << " paths, "
+			<< caustics->memory_bytes() / 1048576.0 << " MB";
+		if (caustics->paths() < static_cast<size_t>(photons.paths))
+			std::clog << " (photon cap reached)";
+		std::clog << '\n';
+	}
+
+	bool write_frame(const hittable& world, const std::vector<float>& sums) const {
+		// For integrators that render only the color, from sums over samples_per_pixel samples.
+		// First-hit channels, and the ones the denoiser needs, come from a pass of their own.
+		std::vector<aov> channels;
+		bool missing = false;
+		for (auto a : aovs) {
+			if (first_hit_channel(a) || a == aov::sample_count)
+				channels.push_back(a);
+			else
+				missing = missing || a != aov::beauty;
+		}
+		if (missing)
+			std::clog << "Only path tracing records the direct, indirect and variance channels.\n";
+		if (denoising.passes > 0)
+			channels.insert(channels.end(), std::begin(denoise_features), std::end(denoise_features));
+
+		framebuffer frame(image_width, image_height, tile_size, channels);
+		frame.add_image(sums, samples_per_pixel);
+		if (std::any_of(channels.begin(), channels.end(), first_hit_channel)) {
+			Concurrency::parallel_for(0, image_height, [&](int j) {
+				for (int i = 0; i < image_width; i++)
+					record_pixel(world, i, j, 0, samples_per_pixel, frame, false);
+				});
+		}
+		return write_frame(frame);
+	}
+
+	static bool first_hit_channel(aov a) {
+		return a == aov::albedo || a == aov::normal || a == aov::depth || a == aov::emission || a == aov::primitive_id;
+	}
+
+	void record_pixel(const hittable& world, int i, int j, int sample_begin, int sample_end, framebuffer& frame,
+		bool trace_color = true) const {
+		// Traces a pixel's samples, seeded by pixel and sample index, and adds them to every
+		// channel the framebuffer keeps. The first-hit channels trace after the color does, so the color is
+		// the same whichever channels are recorded. Without `trace_color`, only the first-hit
+		// channels are traced.
+		auto pixel_index = static_cast<size_t>(j) * image_width + i;
+		bool split = trace_color && frame.has(aov::direct);
+		bool first_hit = false;
+		for (auto a : all_aovs)
+			first_hit = first_hit || (first_hit_channel(a) && frame.has(a));
+
+		color beauty(0, 0, 0), direct_sum(0, 0, 0), albedo_sum(0, 0, 0), emission_sum(0, 0, 0);
+		vec3 normal_sum(0, 0, 0);
+		double depth_sum = 0, squares = 0;
+		uint32_t id = 0;
+		for (int sample = sample_begin; sample < sample_end; ++sample) {
+			seed_random(hash_seed(pixel_index, sample));
+			ray r = get_ray(i, j);
+			if (trace_color) {
+				color direct;
+				auto pixel_color = ray_color(r, max_depth, world, path_vertex(), split ? &direct : nullptr);
+				beauty += pixel_color;
+				direct_sum += direct;
+				squares += luminance(pixel_color) * luminance(pixel_color);
+			}
+			if (first_hit) {
+				auto f = ray_features(r, world);
+				albedo_sum += f.albedo;
+				normal_sum += f.normal;
+				depth_sum += f.depth;
+				emission_sum += f.emission;
+				if (sample == 0)
+					id = primitive_hash(f.object);
+			}
+		}
+
+		auto store = [&](aov a, const vec3& value) {
+			if (!frame.has(a))
+				return;
+			auto out = frame.at(a, i, j);
+			for (int c = 0; c < aov_components(a); c++)
+				out[c] += static_cast<float>(value[c]);
+		};
+		if (trace_color) {
+			store(aov::beauty, beauty);
+			store(aov::direct, direct_sum);
+			store(aov::sample_count, vec3(sample_end - sample_begin, 0, 0));
+			store(aov::variance, vec3(squares, 0, 0));
+		}
+		if (first_hit) {
+			store(aov::albedo, albedo_sum);
+			store(aov::normal, normal_sum);
+			store(aov::depth, vec3(depth_sum, 0, 0));
+			store(aov::emission, emission_sum);
+			if (sample_begin == 0)
+				store(aov::primitive_id, vec3(id, 0, 0));
+		}
+	}
+
+	struct surface_features {
+		color albedo;
+		vec3 normal;
+		double depth = 0;
+		color emission;
+		const hittable* object = nullptr;  // First hit
+	};
+
+	surface_features ray_features(ray r, const hittable& world) const {
+		// Depth of a camera ray's first hit, and the albedo and normal of the first surface that
+		// does not reflect or refract specularly, a few bounces in at most, tinted by the bounces
+		// before it. Emission is what ray_color adds from lights and sky along those bounces.
+		// Misses give a white albedo, and zero normal and depth at the first hit.
+		surface_features f;
+		color tint(1, 1, 1);
+		f.albedo = tint;
+		path_vertex from;
+		for (int bounce = 0; bounce < 4; bounce++) {
+			hit_record rec;
+			if (!world.hit(r, interval(0.001, infinity), rec)) {
+				f.albedo = tint;
+				f.emission += tint * (environment ? sky_color(r, from) : background);
+				return f;
+			}
+			rec.compute_differentials(r);
+			if (bounce == 0) {
+				f.depth = dot(rec.p - center, -w);
+				f.object = rec.object;
+			}
+			f.albedo = tint * rec.mat->base_color(rec);
+			f.normal = rec.normal;
+			f.emission += tint * rec.mat->emitted(rec.u, rec.v, rec.p);
+
+			ray scattered;
+			color attenuation;
+			if (!rec.mat->scatter(r, rec, attenuation, scattered) || rec.mat->scattering_pdf(r, rec, scattered) > 0)
+				return f;
+			from = scatter_vertex(r, rec, scattered);
+			tint = tint * attenuation;
+			r = scattered;
+		}
+		return f;
+	}
+
+	void report_cache() const {
+		if (!cache)
+			return;
+		size_t used, converged;
+		cache->statistics(used, converged);
+		std::clog << "Radiance cache: " << used << " records, " << converged << " converged\n";
+	}
+
+	void render_tiles(const hittable& world, const std::vector<tile>& tiles, const std::vector<size_t>& indices,
+		float* sums, int buffer_y0, framebuffer* frame = nullptr) const {
+		// Renders the listed tiles in parallel, into the framebuffer's channels when given one and
+		// otherwise into an RGB sum buffer one image wide whose first row is image row `buffer_y0`.
+		int sample_begin, sample_end;
+		shard.sample_range(samples_per_pixel, sample_begin, sample_end);
+
+		Concurrency::parallel_for(size_t(0), indices.size(), [&](size_t n) {
+			const tile& t = tiles[indices[n]];
+			for (int j = t.y0; j < t.y0 + t.height; ++j) {
+				for (int i = t.x0; i < t.x0 + t.width; ++i) {
+					if (frame) {
+						record_pixel(world, i, j, sample_begin, sample_end, *frame);
+						continue;
+					}
+					auto pixel_index = static_cast<size_t>(j) * image_width + i;
+					color pixel_color(0, 0, 0);
+					for (int sample = sample_begin; sample < sample_end; ++sample) {
+						seed_random(hash_seed(pixel_index, sample));
+						ray r = get_ray(i, j);
+						pixel_color += ray_color(r, max_depth, world);
+					}
+					auto out = sums + (static_cast<size_t>(j - buffer_y0) * image_width + i) * 3;
+					out[0] = static_cast<float>(pixel_color.x());
+					out[1] = static_cast<float>(pixel_color.y());
+					out[2] = static_cast<float>(pixel_color.z());
+				}
+			}
+			});
+	}
+
+	bool render_streaming(const hittable& world, const std::vector<tile>& tiles, const std::vector<size_t>& owned) const {
+		// Renders one band of tile rows at a time and hands it to the output file before starting
+		// the next, so peak memory is one band rather than the whole frame.
+		std::unique_ptr<image_stream> image;
+		std::unique_ptr<partial_writer> part;
+		if (shard.is_distributed())
+			part = std::make_unique<partial_writer>(shard.part_file(file_name), shard, image_width, image_height, samples_per_pixel, tiles);
+		else
+			image = std::make_unique<image_stream>(file_name, image_width, image_height, samples_per_pixel);
+
+		std::vector<float> band(static_cast<size_t>(image_width) * tile_size * 3);
+		std::vector<size_t> band_tiles;
+
+		for (int y0 = 0; y0 < image_height; y0 += tile_size) {
+			int band_height = std::min(tile_size, image_height - y0);
+
+			band_tiles.clear();
+			for (auto n : owned)
+				if (tiles[n].y0 == y0) band_tiles.push_back(n);
+			if (band_tiles.empty()) continue;
+
+			std::fill(band.begin(), band.end(), 0.0f);
+			render_tiles(world, tiles, band_tiles, band.data(), y0);
+
+			if (part) {
+				for (auto n : band_tiles) {
+					if (!part->write_tile(tiles[n], band.data(), image_width, y0)) {
+						std::cerr << "ERROR: Could not write partial file '" << shard.part_file(file_name) << "'.\n";
+						return false;
+					}
+				}
+			}
+			else if (!image->write_rows(band.data(), y0, band_height)) {
+				std::cerr << "ERROR: Could not write output file '" << file_name << "'.\n";
+				return false;
+			}
+		}
+
+		auto closed = part ? part->close() : image->close();
+		if (!closed)
+			std::cerr << "ERROR: Could not write '" << (part ? shard.part_file(file_name) : file_name) << "'.\n";
+		return closed;
+	}
+
+	bool render_guided(const hittable& world) {
+		// Renders passes of 2, 4, 8, ... samples per pixel while the guide learns, until the
+		// training share of the samples is spent, then one last pass with the rest. Passes are
+		// averaged weighted by the inverse variance of their pixels, so the early passes add
+		// to the image without their noise dominating it. What the guide learns depends on the
+		// order threads record into it, so unlike path tracing the image varies between runs.
+		if (streaming)
+			std::clog << "Path guiding keeps whole frames in memory; ignoring streaming.\n";
+
+		path_guide learned(world.bounding_box(), guiding);
+		guide = &learned;
+
+		auto tiles = make_tiles(image_width, image_height, tile_size);
+		auto pixels = static_cast<size_t>(image_width) * image_height;
+		std::vector<float> sums(pixels * 3);
+		std::vector<double> combined(pixels * 3, 0.0);
+		double total_weight = 0, first_variance = 0, variance = 0;
+		auto training = static_cast<int>(samples_per_pixel * guiding.training_fraction);
+
+		int done = 0;
+		for (int pass = 0; done < samples_per_pixel; pass++) {
+			int count = 2 << pass;
+			guide_learning = done + count <= training;
+			if (!guide_learning)
+				count = samples_per_pixel - done;
+
+			std::fill(sums.begin(), sums.end(), 0.0f);
+			auto pass_variance = render_guided_pass(world, tiles, done, count, sums.data());
+
+			std::clog << "Guiding pass " << pass + 1 << ": " << count << " samples per pixel, ";
+			if (count > 1) {
+				variance = pass_variance;
+				std::clog << "variance " << variance;
+				if (pass == 0)
+					first_variance = variance;
+				else if (first_variance > 0)
+					std::clog << " (" << 100 * variance / first_variance << "% of the unguided pass)";
+			}
+			else {
+				std::clog << "variance unknown";
+			}
+			std::clog << ", " << learned.region_count() << " regions\n";
+
+			auto weight = variance > 0 ? count / variance : count;
+			for (size_t n = 0; n < sums.size(); n++)
+				combined[n] += weight * sums[n] / count;
+			total_weight += weight;
+
+			done += count;
+			if (guide_learning)
+				learned.refine(count);
+		}
+		guide = nullptr;
+		guide_learning = false;
+
+		// write_frame expects sums over samples_per_pixel samples.
+		for (size_t n = 0; n < sums.size(); n++)
+			sums[n] = static_cast<float>(combined[n] / total_weight * samples_per_pixel);
+		return write_frame(world, sums);
+	}
+
+	double render_guided_pass(const hittable& world, const std::vector<tile>& tiles, int first_sample, int count,
+		float* sums) const {
+		// Renders samples [first_sample, first_sample + count) of every pixel into the sum buffer
+		// and returns the variance of a sample's luminance, averaged over the pixels.
+		std::vector<double> tile_variance(tiles.size(), 0.0);
+		Concurrency::parallel_for(size_t(0), tiles.size(), [&](size_t n) {
+			const tile& t = tiles[n];
+			for (int j = t.y0; j < t.y0 + t.height; ++j) {
+				for (int i = t.x0; i < t.x0 + t.width; ++i) {
+					auto pixel_index = static_cast<size_t>(j) * image_width + i;
+					color pixel_color(0, 0, 0);
+					double sum = 0, sum_squares = 0;
+					for (int sample = first_sample; sample < first_sample + count; ++sample) {
+						seed_random(hash_seed(pixel_index, sample));
+						auto c = ray_color(get_ray(i, j), max_depth, world);
+						pixel_color += c;
+						sum += luminance(c);
+						sum_squares += luminance(c) * luminance(c);
+					}
+					auto out = sums + pixel_index * 3;
+					out[0] = static_cast<float>(pixel_color.x());
+					out[1] = static_cast<float>(pixel_color.y());
+					out[2] = static_cast<float>(pixel_color.z());
+					if (count > 1)
+						tile_variance[n] += (sum_squares - sum * sum / count) / (count - 1);
+				}
+			}
+			});
+
+		double total = 0;
+		for (auto v : tile_variance)
+			total += v;
+		return total / (static_cast<double>(image_width) * image_height);
+	}
+
+	bool render_restir(const hittable& world) const {
+		// Renders samples_per_pixel progressive passes of one sample per pixel. Each pass traces
+		// the first hits and draws light candidates into a reservoir per pixel, merges it with
+		// the previous pass's reservoir at the pixel, then with reservoirs of nearby pixels, and
+		// shades with the surviving light sample. Indirect light is path traced as usual.
+		if (streaming)
+			std::clog << "ReSTIR keeps whole frames in memory; ignoring streaming.\n";
+
+		auto pixels = static_cast<size_t>(image_width) * image_height;
+		std::vector<float> image(pixels * 3, 0.0f);
+		std::vector<color> radiance(pixels);  // Everything but the resampled direct light
+		std::vector<restir_surface> surfaces(pixels), previous_surfaces(pixels);
+		std::vector<reservoir> temporal(pixels), reservoirs(pixels), previous(pixels);
+
+		for (int pass = 0; pass < samples_per_pixel; pass++) {
+			std::clog << "\rReSTIR pass " << pass + 1 << " of " << samples_per_pixel << ' ' << std::flush;
+
+			auto visible = [&](const restir_surface& surface, const light_sample& y) { return light_visible(surface, y, world); };
+
+			Concurrency::parallel_for(0, image_height, [&](int j) {
+				for (int i = 0; i < image_width; i++) {
+					auto n = static_cast<size_t>(j) * image_width + i;
+					seed_random(hash_seed(n, 2 * static_cast<uint64_t>(pass)));
+
+					auto& surface = surfaces[n];
+					reservoir initial;
+					radiance[n] = trace_restir_primary(get_ray(i, j), world, surface, initial);
+					if (!surface.valid) {
+						temporal[n] = reservoir();
+						continue;
+					}
+
+					// Temporal reuse: the previous pass's final reservoir at the same pixel.
+					temporal[n] = initial;
+					if (pass > 0 && surface.similar(previous_surfaces[n])) {
+						const auto& prev = previous[n];
+						reservoir_merge merged(surface);
+						merged.add(initial, surface, initial.M);
+						merged.add(prev, previous_surfaces[n], std::min(prev.M, restir.temporal_history * initial.M));
+						temporal[n] = restir.unbiased ? merged.result(visible) : merged.result();
+
+						// Neighbors merge this reservoir next, and need its sample visible from here.
+						if (restir.unbiased && temporal[n].W > 0 && !light_visible(surface, temporal[n].y, world))
+							temporal[n].W = 0;
+					}
+				}
+				});
+
+			Concurrency::parallel_for(0, image_height, [&](int j) {
+				for (int i = 0; i < image_width; i++) {
+					auto n = static_cast<size_t>(j) * image_width + i;
+					seed_random(hash_seed(n, 2 * static_cast<uint64_t>(pass) + 1));
+
+					const auto& surface = surfaces[n];
+					color pixel_color = radiance[n];
+					reservoirs[n] = reservoir();
+					if (surface.valid) {
+						// Spatial reuse: reservoirs of random pixels within the radius.
+						reservoir_merge merging(surface);
+						merging.add(temporal[n], surface, temporal[n].M);
+						for (int k = 0; k < restir.spatial_neighbors; k++) {
+							auto radius = restir.spatial_radius * std::sqrt(random_double());
+							auto angle = 2 * pi * random_double();
+							auto x = i + static_cast<int>(std::lround(radius * std::cos(angle)));
+							auto y = j + static_cast<int>(std::lround(radius * std::sin(angle)));
+							if (x < 0 || y < 0 || x >= image_width || y >= image_height || (x == i && y == j))
+								continue;
+							auto m = static_cast<size_t>(y) * image_width + x;
+							if (surface.similar(surfaces[m]))
+								merging.add(temporal[m], surfaces[m], temporal[m].M);
+						}
+						auto merged = restir.unbiased ? merging.result(visible) : merging.result();
+
+						// An occluded sample contributes nothing here, and is not passed on either.
+						if (merged.W > 0 && light_visible(surface, merged.y, world))
+							pixel_color += merged.W * surface.contribution(merged.y);
+						else
+							merged.W = 0;
+						reservoirs[n] = merged;
+					}
+
+					auto out = &image[n * 3];
+					out[0] += static_cast<float>(pixel_color.x());
+					out[1] += static_cast<float>(pixel_color.y());
+					out[2] += static_cast<float>(pixel_color.z());
+				}
+				});
+
+			std::swap(surfaces, previous_surfaces);
+			std::swap(reservoirs, previous);
+		}
+		std::clog << '\n';
+
+		return write_frame(world, image);
+	}
+
+	bool render_bidirectional(const hittable& world) const {
+		// Every pixel sample traces one camera and one light subpath. Light tracing adds to
+		// whichever pixel the light vertex projects to, through the splat buffer; everything
+		// else goes to the sample's own pixel. Threads keep their subpaths in an arena each.
+		if (streaming)
+			std::clog << "Bidirectional path tracing keeps whole frames in memory; ignoring streaming.\n";
+
+		light_emitters emitters(lights.get());
+		auto image_area = image_width * image_height * pixel_delta_u.length() * pixel_delta_v.length();
+		camera_importance lens{ -w, focus_dist, image_area };
+
+		std::vector<float> image(static_cast<size_t>(image_width) * image_height * 3, 0.0f);
+		splat_buffer splats(image_width, image_height);
+		Concurrency::combinable<bdpt_arena> arenas;
+
+		auto tiles = make_tiles(image_width, image_height, tile_size);
+		Concurrency::parallel_for(size_t(0), tiles.size(), [&](size_t n) {
+			auto& arena = arenas.local();
+			arena.reserve(max_depth);
+			const tile& t = tiles[n];
+			for (int j = t.y0; j < t.y0 + t.height; ++j) {
+				for (int i = t.x0; i < t.x0 + t.width; ++i) {
+					auto pixel_index = static_cast<size_t>(j) * image_width + i;
+					color pixel_color(0, 0, 0);
+					for (int sample = 0; sample < samples_per_pixel; ++sample) {
+						seed_random(hash_seed(pixel_index, sample));
+						pixel_color += bidirectional_sample(get_ray(i, j), world, emitters, lens, arena, splats);
+					}
+					auto out = &image[pixel_index * 3];
+					out[0] = static_cast<float>(pixel_color.x());
+					out[1] = static_cast<float>(pixel_color.y());
+					out[2] = static_cast<float>(pixel_color.z());
+				}
+			}
+			});
+
+		// Each light subpath estimates the whole image, and there are as many as pixel samples.
+		splats.add_to(image);
+		return write_frame(world, image);
+	}
+
+	color bidirectional_sample(const ray& r, const hittable& world, const light_emitters& emitters,
+		const camera_importance& lens, bdpt_arena& arena, splat_buffer& splats) const {
+		// Returns the radiance for the sample's pixel and splats the light tracing strategies.
+		// Paths have at most max_depth segments, as in ray_color. Light from the sky is left to
+		// the camera subpath: it escapes into the sky or samples the environment at each vertex.
+		auto camera_path = arena.camera_path.data();
+		auto light_path = arena.light_path.data();
+
+		auto& x0 = camera_path[0];
+		x0.kind = bdpt_vertex::camera;
+		x0.rec.p = r.origin();
+		x0.rec.normal = vec3(0, 0, 0);
+		x0.r_in = r;
+		x0.beta = color(1, 1, 1);
+		x0.delta = x0.connectible = false;
+		x0.source = -1;
+
+		ray escaped;
+		int camera_count = 1 + bdpt_random_walk(world, r, color(1, 1, 1), lens.pdf(r.direction()), camera_path + 1,
+			max_depth, emitters, escaped);
+
+		int light_count = 0;
+		if (emitters.sample(r.time(), light_path[0])) {
+			light_count = 1;
+			double pdf;
+			auto direction = emitters.sample_direction(light_path[0], pdf);
+			if (pdf > 0) {
+				auto beta = light_path[0].beta * light_path[0].eval(light_path[0].p() + direction) / pdf;
+				ray lost;
+				light_count += bdpt_random_walk(world, ray(light_path[0].p(), direction, r.time()), beta, pdf,
+					light_path + 1, max_depth - 1, emitters, lost);
+			}
+		}
+
+		color result(0, 0, 0);
+		for (int k = 1; k < camera_count; k++) {
+			const auto& x = camera_path[k];
+			if (environment && x.connectible && k < max_depth)
+				result += x.beta * sample_environment(x.r_in, x.rec, x.attenuation, world);
+		}
+		if (escaped.direction().length_squared() > 0) {
+			const auto& last = camera_path[camera_count - 1];
+			auto from = camera_count > 1 ? scatter_vertex(last.r_in, last.rec, escaped) : path_vertex();
+			auto beta = camera_count > 1 ? last.beta * last.attenuation : color(1, 1, 1);
+			result += beta * (environment ? sky_color(escaped, from) : background);
+		}
+
+		for (int t = 1; t <= camera_count; t++) {
+			for (int s = 0; s <= light_count; s++) {
+				if ((s == 1 && t == 1) || s + t - 1 > max_depth)
+					continue;
+				if (t == 1)
+					splat_light_vertex(light_path, s, world, emitters, lens, splats);
+				else
+					result += connect_subpaths(camera_path, t, light_path, s, world, emitters, lens);
+			}
+		}
+		return result;
+	}
+
+	color connect_subpaths(bdpt_vertex* camera_path, int t, bdpt_vertex* light_path, int s, const hittable& world,
+		const light_emitters& emitters, const camera_importance& lens) const {
+		// The weighted contribution of the first t camera and s light vertices.
+		const auto& x = camera_path[t - 1];
+		color contribution;
+		if (s == 0) {
+			contribution = x.beta * x.rec.mat->emitted(x.rec.u, x.rec.v, x.rec.p);
+		}
+		else {
+			const auto& y = light_path[s - 1];
+			if (!x.connectible || !(y.connectible || y.kind == bdpt_vertex::light))
+				return color(0, 0, 0);
+			auto distance_squared = (y.p() - x.p()).length_squared();
+			contribution = x.beta * x.eval(y.p()) * y.eval(x.p()) * y.beta / distance_squared;
+			if (contribution.length_squared() == 0 || !unoccluded(x.p(), y.p(), x.r_in.time(), world))
+				return color(0, 0, 0);
+		}
+		if (contribution.length_squared() == 0)
+			return color(0, 0, 0);
+		return bdpt_mis_weight(camera_path, t, light_path, s, emitters, lens) * contribution;
+	}
+
+	void splat_light_vertex(bdpt_vertex* light_path, int s, const hittable& world, const light_emitters& emitters,
+		const camera_importance& lens, splat_buffer& splats) const {
+		// Light tracing: joins light vertex s - 1 to a point on the lens and adds it to the pixel
+		// the joining ray passes through.
+		const auto& y = light_path[s - 1];
+		if (!y.connectible)
+			return;
+
+		bdpt_vertex lens_point;
+		lens_point.kind = bdpt_vertex::camera;
+		lens_point.rec.p = (defocus_angle <= 0) ? center : defocus_disk_sample();
+		lens_point.rec.normal = vec3(0, 0, 0);
+
+		// Where the ray from the lens point crosses the plane of focus, which holds the image.
+		auto direction = y.p() - lens_point.p();
+		auto depth = dot(direction, -w);
+		if (depth <= 0)
+			return;
+		auto on_image = lens_point.p() + direction * (focus_dist / depth) - (pixel00_loc - 0.5 * (pixel_delta_u + pixel_delta_v));
+		auto px = dot(on_image, pixel_delta_u) / pixel_delta_u.length_squared();
+		auto py = dot(on_image, pixel_delta_v) / pixel_delta_v.length_squared();
+		if (px < 0 || py < 0 || px >= image_width || py >= image_height)
+			return;
+
+		auto contribution = y.beta * y.eval(lens_point.p()) * (lens.pdf(direction) / direction.length_squared());
+		if (contribution.length_squared() == 0 || !unoccluded(lens_point.p(), y.p(), y.r_in.time(), world))
+			return;
+		auto weight = bdpt_mis_weight(&lens_point, 1, light_path, s, emitters, lens);
+		splats.add(static_cast<int>(px), static_cast<int>(py), weight * contribution);
+	}
+
+	static bool unoccluded(const point3& a, const point3& b, double time, const hittable& world) {
+		hit_record shadow;
+		return !world.hit(ray(a, b - a, time), interval(0.001, 0.999), shadow);
+	}
+
+	color trace_restir_primary(const ray& r, const hittable& world, restir_surface& surface, reservoir& initial) const {
+		// Traces a camera ray for ReSTIR: returns the emitted, environment and indirect light at
+		// the first hit, and for diffuse hits fills in the surface and its initial reservoir.
+		surface.valid = false;
+
+		hit_record rec;
+		if (!world.hit(r, interval(0.001, infinity), rec))
+			return environment ? sky_color(r, path_vertex()) : background;
+		rec.compute_differentials(r);
+
+		ray scattered;
+		color attenuation;
+		color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+		if (!rec.mat->scatter(r, rec, attenuation, scattered))
+			return color_from_emission;
+
+		auto here = scatter_vertex(r, rec, scattered);
+		color color_from_lights(0, 0, 0);
+		if (here.scattering_pdf > 0) {
+			surface.valid = true;
+			surface.rec = rec;
+			surface.r_in = r;
+			surface.attenuation = attenuation;
+			surface.depth = rec.t * r.direction().length();
+
+			// Resampled importance sampling by the unshadowed contribution, over candidates from
+			// the light hierarchy and the one from the scattered ray. Each weight uses the
+			// combined density of both strategies (balance heuristic), so the scattered ray
+			// covers light near grazing angles and close to the surface.
+			double count = restir.candidates + 1;
+			auto weight = [&](const light_sample& y, double light_pdf) {
+				auto pdf = restir.candidates * light_pdf + scattering_point_pdf(surface, y);
+				return pdf > 0 ? count * surface.target(y) / pdf : 0.0;
+			};
+
+			for (int k = 0; k < restir.candidates; k++) {
+				light_sample candidate;
+				double area_pdf;
+				if (sample_light_point(*lights, surface, candidate, area_pdf))
+					initial.update(candidate, weight(candidate, area_pdf), 1);
+				else
+					initial.update(candidate, 0, 1);
+			}
+
+			hit_record on_light;
+			if (world.hit(scattered, interval(0.001, infinity), on_light) && lights->contains(on_light.object)) {
+				light_sample candidate{ on_light.object, on_light.p, on_light.normal, on_light.mat->emitted(on_light.u, on_light.v, on_light.p) };
+				initial.update(candidate, weight(candidate, light_point_pdf(*lights, surface, candidate)), 1);
+			}
+			else {
+				initial.update(light_sample(), 0, 1);
+			}
+			initial.finalize(surface.target(initial.y));
+			if (initial.W > 0 && !light_visible(surface, initial.y, world))
+				initial.W = 0;
+
+			here.lights_resampled = true;
+			if (environment)
+				color_from_lights = sample_environment(r, rec, attenuation, world, nullptr, max_depth > 1);
+		}
+
+		color color_from_scatter = attenuation * ray_color(scattered, max_depth - 1, world, here);
+		return color_from_emission + color_from_lights + color_from_scatter;
+	}
+
+	bool light_visible(const restir_surface& surface, const light_sample& s, const hittable& world) const {
+		// The ray runs from the surface to the light point at t = 1.
+		hit_record shadow;
+		ray to_light(surface.rec.p, s.p - surface.rec.p, surface.r_in.time());
+		return world.hit(to_light, interval(0.001, infinity), shadow) && shadow.object == s.light && shadow.t > 0.999;
+	}
 
 	void initialize() {
 		image_height = static_cast<int>(image_width / aspect_ratio);
@@ -148,8 +995,40 @@ private:
 		defocus_disk_v = v * defocus_radius;
 	}
 
+	struct path_vertex {
+		// The point a ray was scattered from, kept to weight the emission the ray finds against
+		// light sampling at that point.
+		point3 p;
+		vec3 normal;
+		double scattering_pdf = 0;  // Zero for camera rays and specular bounces, which light sampling cannot produce
+		vec3 mirror;                // Mirror direction of a glossy reflection
+		double spread = 0;          // and the half angle of its lobe, zero for other bounces
+		bool lights_resampled = false;  // Direct light from `lights` came from a ReSTIR reservoir instead
+		bool past_diffuse = false;      // The path has scattered off a diffuse surface before
+		bool caustic = false;           // Since the last diffuse vertex, which read the photon map, the path only bounced specularly
+		bool aimed = false;             // A specular vertex of such a path that the photon map covers
+	};
+
+	static double luminance(const color& c) {
+		return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+	}
+
+	static double power_heuristic(double pdf, double other_pdf) {
+		auto p2 = pdf * pdf;
+		return p2 / (p2 + other_pdf * other_pdf);
+	}
+
 	color ray_color(const ray& r, int max_depth, const hittable& world) const {
+		return ray_color(r, max_depth, world, path_vertex());
+	}
+
+	color ray_color(const ray& r, int max_depth, const hittable& world, const path_vertex& from,
+		color* direct = nullptr, color* emitted = nullptr) const {
+		// With `direct`, also reports the part of the result that left a light or the sky at
+		// most one bounce before reaching r's origin; with `emitted`, the part this hit emits.
 		hit_record rec;
+		if (direct) *direct = color(0, 0, 0);
+		if (emitted) *emitted = color(0, 0, 0);
 
 		// If we've exceeded the ray bounce limit, no more light is gathered.
 		if (max_depth <= 0) {
@@ -157,20 +1036,211 @@ private:
 		}
 
 
-		// If the ray hits nothing, return the background color.
-		if (!world.hit(r, interval(0.001, infinity), rec))
-			return background;
+		// If the ray hits nothing, return the background color. Sky reached through specular
+		// bounces from a surface that read the photon map is already in its caustics, when the
+		// map covers the last of those bounces.
+		if (!world.hit(r, interval(0.001, infinity), rec)) {
+			if (from.caustic && from.scattering_pdf == 0) {
+				if (from.aimed)
+					return color(0, 0, 0);
+				caustics->note_uncovered();
+			}
+			auto sky = environment ? sky_color(r, from) : background;
+			if (direct) *direct = sky;
+			if (emitted) *emitted = sky;
+			return sky;
+		}
+		rec.compute_differentials(r);
 
 		ray scattered;
 		color attenuation;
 		color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
 
+		// Emission reached by scattering is also covered by light sampling at the previous
+		// vertex, so the two estimates are combined with multiple importance sampling. After a
+		// ReSTIR vertex the reservoir has already accounted for the lights.
+		if (lights && from.scattering_pdf > 0 && color_from_emission.length_squared() > 0) {
+			if (from.lights_resampled && lights->contains(rec.object)) {
+				color_from_emission = color(0, 0, 0);
+			}
+			else {
+				auto light_pdf = lights->pmf(from.p, from.normal, rec.object);
+				if (light_pdf > 0)
+					light_pdf *= rec.object->pdf_value(from.p, r.direction());
+				color_from_emission = power_heuristic(from.scattering_pdf, light_pdf) * color_from_emission;
+			}
+		}
+		if (from.caustic && from.scattering_pdf == 0 && lights && lights->contains(rec.object)) {
+			if (from.aimed)
+				color_from_emission = color(0, 0, 0);
+			else
+				caustics->note_uncovered();
+		}
+		if (direct) *direct = color_from_emission;
+		if (emitted) *emitted = color_from_emission;
+
 		if (!rec.mat->scatter(r, rec, attenuation, scattered))
 			return color_from_emission;
 
-		color color_from_scatter = attenuation * ray_color(scattered, max_depth - 1, world);
+		auto here = scatter_vertex(r, rec, scattered);
+
+		// Baked surfaces only add the light that light sampling finds; the lightmap holds the rest.
+		color baked;
+		if (lightmaps && here.scattering_pdf > 0 && lightmaps->value(rec, baked)) {
+			color color_from_lights(0, 0, 0);
+			if (lights)
+				color_from_lights += sample_light(r, rec, attenuation, world);
+			if (environment)
+				color_from_lights += sample_environment(r, rec, attenuation, world);
+			if (direct) *direct += color_from_lights;
+			return color_from_emission + color_from_lights + attenuation * baked;
+		}
+
+		// The first diffuse surface of a path reads its caustics from the photon map, and the
+		// paths from it that reach a light through specular bounces are dropped. Photons only
+		// left the lights towards the casters, so that holds when the bounce nearest the light
+		// lies within one of them.
+		color color_from_caustics(0, 0, 0);
+		here.past_diffuse = from.past_diffuse || here.scattering_pdf > 0;
+		if (here.scattering_pdf == 0) {
+			here.caustic = from.caustic;
+			here.aimed = from.caustic && caustics->covers(rec.p);
+		}
+		else if (caustics && !from.past_diffuse && rec.normal.length_squared() > 0) {
+			color_from_caustics = attenuation * caustics->irradiance(rec.p, rec.normal) / pi;
+			here.caustic = true;
+		}
+
+		// Past the first diffuse bounce, a converged cache record ends the path. Otherwise the
+		// path goes on and adds the light it finds, per unit albedo, to the record.
+		radiance_cache::record* cached = nullptr;
+		if (cache && from.past_diffuse && here.scattering_pdf > 0 && rec.normal.length_squared() > 0) {
+			cached = cache->find(rec.p, rec.normal);
+			color reflected;
+			if (cached && cache->lookup(*cached, reflected))
+				return color_from_emission + attenuation * reflected;
+		}
+		auto albedo = attenuation;
+		if (cached)
+			attenuation = color(1, 1, 1);
+
+		// With a guide, diffuse bounces draw their direction from either the material or the
+		// distribution learned for this region, and are weighted by the combined density.
+		path_guide::region* region = nullptr;
+		const direction_tree* guided = nullptr;
+		double scatter_weight = 1;
+		if (guide && here.scattering_pdf > 0) {
+			region = &guide->find(rec.p);
+			if (region->sampling.total() > 0) {
+				guided = &region->sampling;
+				if (random_double() < guiding.guided_fraction)
+					scattered = ray(rec.p, guided->sample(rec.normal), r.time());
+				auto material_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+				here.scattering_pdf = scatter_density(r, rec, scattered, guided);
+				scatter_weight = here.scattering_pdf > 0 ? material_pdf / here.scattering_pdf : 0;
+			}
+		}
+
+		// On the last bounce the scattered ray ends before it can reach a light, so light
+		// sampling carries the direct light alone.
+		color color_from_lights(0, 0, 0);
+		if (lights && here.scattering_pdf > 0)
+			color_from_lights += sample_light(r, rec, attenuation, world, guided, max_depth > 1);
+		if (environment && here.scattering_pdf > 0)
+			color_from_lights += sample_environment(r, rec, attenuation, world, guided, max_depth > 1);
+
+		color color_from_scatter(0, 0, 0), emitted_next(0, 0, 0);
+		if (scatter_weight > 0) {
+			auto incoming = ray_color(scattered, max_depth - 1, world, here, nullptr, direct ? &emitted_next : nullptr);
+			color_from_scatter = scatter_weight * attenuation * incoming;
+
+			// Light sampling covers the direct light, so the guide learns what scattering finds.
+			if (region && guide_learning)
+				guide->record(*region, scattered.direction(), luminance(incoming) / here.scattering_pdf);
+		}
+
+		if (direct)
+			*direct += (cached ? albedo : color(1, 1, 1)) * (color_from_lights + scatter_weight * attenuation * emitted_next);
+		if (cached) {
+			cache->add(*cached, color_from_lights + color_from_scatter);
+			return color_from_emission + albedo * (color_from_lights + color_from_scatter);
+		}
+		return color_from_emission + color_from_caustics + color_from_lights + color_from_scatter;
+	}
+
+	path_vertex scatter_vertex(const ray& r, const hit_record& rec, const ray& scattered) const {
+		auto spread = rec.mat->reflection_spread();
+		return path_vertex{ rec.p, rec.normal, rec.mat->scattering_pdf(r, rec, scattered),
+			spread > 0 ? reflect(unit_vector(r.direction()), rec.normal) : vec3(), spread };
+	}
+
+	double scatter_density(const ray& r, const hit_record& rec, const ray& scattered, const direction_tree* guided) const {
+		// Density of scattering towards `scattered`: the material's, mixed with the guide's when
+		// the bounce is guided.
+		auto material_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+		if (!guided)
+			return material_pdf;
+		return guiding.guided_fraction * guided->pdf(scattered.direction(), rec.normal) + (1 - guiding.guided_fraction) * material_pdf;
+	}
+
+	color sample_light(const ray& r, const hit_record& rec, const color& attenuation, const hittable& world,
+		const direction_tree* guided = nullptr, bool weighted = true) const {
+		// Next event estimation: picks a light from the hierarchy, samples a direction towards
+		// it and adds its emission if nothing blocks the way. Diffuse materials have a direction
+		// independent attenuation, so attenuation * scattering_pdf evaluates them towards the light.
+		// Unless `weighted`, the result is not shared with scattering by MIS.
+		const hittable* light;
+		double pmf;
+		if (!lights->sample(rec.p, rec.normal, random_double(), light, pmf))
+			return color(0, 0, 0);
+
+		ray to_light(rec.p, light->random(rec.p), r.time());
+		auto light_pdf = pmf * light->pdf_value(rec.p, to_light.direction());
+		auto scattering_pdf = rec.mat->scattering_pdf(r, rec, to_light);
+		if (light_pdf <= 0 || scattering_pdf <= 0)
+			return color(0, 0, 0);
+
+		hit_record shadow;
+		if (!world.hit(to_light, interval(0.001, infinity), shadow) || shadow.object != light)
+			return color(0, 0, 0);
+
+		auto emitted = shadow.mat->emitted(shadow.u, shadow.v, shadow.p);
+		auto mis = weighted ? power_heuristic(light_pdf, scatter_density(r, rec, to_light, guided)) : 1.0;
+		return (mis * scattering_pdf / light_pdf) * attenuation * emitted;
+	}
+
+	color sample_environment(const ray& r, const hit_record& rec, const color& attenuation, const hittable& world,
+		const direction_tree* guided = nullptr, bool weighted = true) const {
+		// Next event estimation towards the sky, with directions drawn by its brightness.
+		vec3 direction;
+		double sky_pdf;
+		if (!environment->sample(random_double(), random_double(), direction, sky_pdf))
+			return color(0, 0, 0);
+
+		ray to_sky(rec.p, direction, r.time());
+		auto scattering_pdf = rec.mat->scattering_pdf(r, rec, to_sky);
+		if (scattering_pdf <= 0)
+			return color(0, 0, 0);
+
+		hit_record shadow;
+		if (world.hit(to_sky, interval(0.001, infinity), shadow))
+			return color(0, 0, 0);
+
+		auto mis = weighted ? power_heuristic(sky_pdf, scatter_density(r, rec, to_sky, guided)) : 1.0;
+		return (mis * scattering_pdf / sky_pdf) * attenuation * environment->value(direction);
+	}
+
+	color sky_color(const ray& r, const path_vertex& from) const {
+		// Rays leaving a glossy reflection read the prefiltered sky around the mirror direction,
+		// which converges at once where averaging over the lobe would take many samples. Rays
+		// from diffuse bounces are weighted against sample_environment.
+		if (from.spread > 0)
+			return environment->filtered(from.mirror, from.spread);
 
-		return color_from_emission + color_from_scatter;
+		auto sky = environment->value(r.direction());
+		if (from.scattering_pdf > 0)
+			sky = power_heuristic(from.scattering_pdf, environment->pdf(r.direction())) * sky;
+		return sky;
 	}
 };
 
@@ -0,0 +1,202 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "vec3.h"
+#include "framebuffer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <ppl.h>
+#include <vector>
+
+// Feature guided denoising of low sample count renders, with the edge-avoiding a-trous wavelet
+// filter (Dammertz et al. 2010) and the variance guided edge stopping of SVGF (Schied et al.
+// 2017). Light seen straight from emitters and the sky is taken out of the image first, since it
+// has no noise to remove, and the rest is divided by the albedo of the surfaces seen, so the
+// filter blurs lighting and not texture. Each pass is a sparse 5x5 blur whose taps are twice as
+// far apart as the last pass's, with each tap weighted down where its normal, depth or lighting
+// differs from the center pixel's. Differences in lighting count relative to the noise expected
+// there, estimated from the pixel's neighbors and filtered along with the image.
+
+struct denoise_settings {
+	int    passes = 0;           // A-trous passes, each reaching twice as far; 0 writes the noisy image
+	double color_sigma = 4;      // Lighting differences tolerated, in standard deviations of the noise
+	double normal_power = 128;   // Exponent on the cosine between neighboring normals
+	double depth_sigma = 1;      // Depth differences tolerated, relative to the local depth slope
+};
+
+// The framebuffer channels the filter reads.
+const aov denoise_features[] = { aov::albedo, aov::normal, aov::depth, aov::emission };
+
+struct feature_buffers {
+	// The per-pixel values of the framebuffer's feature channels.
+	int width = 0, height = 0;
+	std::vector<float> albedo;    // RGB
+	std::vector<float> normal;    // World space xyz, zero where every ray missed
+	std::vector<float> depth;     // Zero for misses
+	std::vector<float> emission;  // RGB
+
+	explicit feature_buffers(const framebuffer& frame)
+		: width(frame.image_width()), height(frame.image_height()), albedo(frame.layer(aov::albedo)),
+		normal(frame.layer(aov::normal)), depth(frame.layer(aov::depth)), emission(frame.layer(aov::emission)) {}
+};
+
+class atrous_denoiser {
+	// Holds what every pass reads of a frame's features: unit normals, depth slopes, and which
+	// pixels show a surface with an albedo to divide by.
+public:
+	atrous_denoiser(const feature_buffers& _features, const denoise_settings& _settings)
+		: features(_features), settings(_settings), normal(_features.normal), slope(_features.depth.size(), 0.0f),
+		reflects(_features.depth.size())
+	{
+		for (size_t n = 0; n < slope.size(); n++) {
+			reflects[n] = luminance(&features.albedo[n * 3]) > min_albedo;
+			auto p = &normal[n * 3];
+			auto length = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+			if (length > 0)
+				for (int c = 0; c < 3; c++) p[c] /= length;
+		}
+
+		const auto& depth = features.depth;
+		for (int y = 0; y < features.height; y++) {
+			for (int x = 0; x < features.width; x++) {
+				auto n = static_cast<size_t>(y) * features.width + x;
+				if (depth[n] == 0)
+					continue;
+				auto at = [&](int xi, int yi) {
+					xi = std::clamp(xi, 0, features.width - 1);
+					yi = std::clamp(yi, 0, features.height - 1);
+					auto d = depth[static_cast<size_t>(yi) * features.width + xi];
+					return d == 0 ? depth[n] : d;
+				};
+				slope[n] = std::max(std::fabs(at(x + 1, y) - at(x - 1, y)), std::fabs(at(x, y + 1) - at(x, y - 1))) / 2;
+			}
+		}
+	}
+
+	std::vector<float> filter(const std::vector<float>& pixels) const {
+		// Filters an image of linear RGB pixels, not sums, of the size of the features.
+		int width = features.width, height = features.height;
+		auto count = static_cast<size_t>(width) * height;
+		if (settings.passes <= 0 || pixels.size() != count * 3)
+			return pixels;
+
+		// Take out the emission and divide out the albedo, leaving the light arriving at each
+		// surface. Pixels without an albedo, such as lights and black surfaces, keep their color.
+		std::vector<float> divisor(count * 3), light(count * 3);
+		for (size_t k = 0; k < count * 3; k++) {
+			divisor[k] = reflects[k / 3] && features.albedo[k] > min_albedo ? features.albedo[k] : 1.0f;
+			light[k] = (pixels[k] - features.emission[k]) / divisor[k];
+		}
+
+		// Initial noise estimate: the luminance variance over the 3x3 neighbors on the same surface.
+		std::vector<float> variance(count), next_variance(count);
+		Concurrency::parallel_for(0, height, [&](int y) {
+			for (int x = 0; x < width; x++) {
+				auto p = static_cast<size_t>(y) * width + x;
+				float sum_w = 0, sum_l = 0, sum_l2 = 0;
+				for (int dy = -1; dy <= 1; dy++) {
+					for (int dx = -1; dx <= 1; dx++) {
+						int qx = x + dx, qy = y + dy;
+						if (qx < 0 || qy < 0 || qx >= width || qy >= height)
+							continue;
+						auto q = static_cast<size_t>(qy) * width + qx;
+						auto w = geometry_weight(p, q, 1);
+						auto l = luminance(&light[q * 3]);
+						sum_w += w;
+						sum_l += w * l;
+						sum_l2 += w * l * l;
+					}
+				}
+				auto mean = sum_l / sum_w;
+				variance[p] = std::max(0.0f, sum_l2 / sum_w - mean * mean);
+			}
+			});
+
+		std::vector<float> next(count * 3);
+		for (int pass = 0; pass < settings.passes; pass++) {
+			int step = 1 << pass;
+			Concurrency::parallel_for(0, height, [&](int y) {
+				for (int x = 0; x < width; x++) {
+					auto p = static_cast<size_t>(y) * width + x;
+					auto l_p = luminance(&light[p * 3]);
+
+					// Blur the variance a little before trusting it, as SVGF does.
+					float blurred = 0, blurred_w = 0;
+					for (int dy = -1; dy <= 1; dy++) {
+						for (int dx = -1; dx <= 1; dx++) {
+							int qx = x + dx, qy = y + dy;
+							if (qx < 0 || qy < 0 || qx >= width || qy >= height)
+								continue;
+							auto w = kernel[dx + 2] * kernel[dy + 2];
+							blurred += w * variance[static_cast<size_t>(qy) * width + qx];
+							blurred_w += w;
+						}
+					}
+					auto sigma_l = static_cast<float>(settings.color_sigma) * std::sqrt(blurred / blurred_w) + 1e-4f;
+
+					float sum[3] = { 0, 0, 0 }, sum_w = 0, sum_variance = 0;
+					for (int dy = -2; dy <= 2; dy++) {
+						for (int dx = -2; dx <= 2; dx++) {
+							int qx = x + dx * step, qy = y + dy * step;
+							if (qx < 0 || qy < 0 || qx >= width || qy >= height)
+								continue;
+							auto q = static_cast<size_t>(qy) * width + qx;
+							auto distance = step * std::sqrt(static_cast<float>(dx * dx + dy * dy));
+							auto w = kernel[dx + 2] * kernel[dy + 2] * geometry_weight(p, q, distance)
+								* std::exp(-std::fabs(l_p - luminance(&light[q * 3])) / sigma_l);
+							for (int c = 0; c < 3; c++)
+								sum[c] += w * light[q * 3 + c];
+							sum_w += w;
+							sum_variance += w * w * variance[q];
+						}
+					}
+					// The center tap always has full weight, so sum_w is never zero.
+					for (int c = 0; c < 3; c++)
+						next[p * 3 + c] = sum[c] / sum_w;
+					next_variance[p] = sum_variance / (sum_w * sum_w);
+				}
+				});
+			std::swap(light, next);
+			std::swap(variance, next_variance);
+		}
+
+		for (size_t k = 0; k < count * 3; k++)
+			light[k] = light[k] * divisor[k] + features.emission[k];
+		return light;
+	}
+
+private:
+	static constexpr float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+	static constexpr float min_albedo = 0.01f;
+
+	const feature_buffers& features;
+	denoise_settings settings;
+	std::vector<float> normal;  // Unit length, or zero where every ray missed
+	std::vector<float> slope;   // Largest change of depth to a neighboring pixel
+	std::vector<uint8_t> reflects;  // Whether the pixel's color was divided by its albedo
+
+	static float luminance(const float* c) {
+		return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+	}
+
+	float geometry_weight(size_t p, size_t q, float distance) const {
+		// How much pixel q is taken to show the same surface as pixel p, `distance` pixels away.
+		// Light arriving at a surface and light leaving one are never mixed.
+		if (reflects[p] != reflects[q])
+			return 0;
+		auto np = &normal[p * 3], nq = &normal[q * 3];
+		bool p_empty = np[0] == 0 && np[1] == 0 && np[2] == 0;
+		bool q_empty = nq[0] == 0 && nq[1] == 0 && nq[2] == 0;
+		if (p_empty || q_empty)
+			return p_empty && q_empty ? 1.0f : 0.0f;
+
+		auto cosine = std::max(0.0f, np[0] * nq[0] + np[1] * nq[1] + np[2] * nq[2]);
+		auto w_normal = std::pow(cosine, static_cast<float>(settings.normal_power));
+		auto dp = features.depth[p], dq = features.depth[q];
+		auto scale = static_cast<float>(settings.depth_sigma) * slope[p] * distance + 1e-3f * dp + 1e-6f;
+		return w_normal * std::exp(-std::fabs(dp - dq) / scale);
+	}
+};
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "rtw_image.h"
+#include "vec3.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+class environment_map {
+	// Distant lighting from a lat-long (equirectangular) HDR image surrounding the scene. Row 0
+	// is straight up and the columns run once around the vertical axis, in the orientation
+	// sphere::get_sphere_uv uses for textures.
+	//
+	// Directions can be sampled in proportion to the luminance of the map, through a
+	// piecewise-constant 2D distribution: a marginal CDF over rows and a conditional CDF over the
+	// pixels of each row, both weighted by sin(theta) for the area of the row on the sphere.
+	// A box-filtered mip chain of the map approximates the environment blurred over a cone, for
+	// glossy reflections that would otherwise need many samples to converge.
+public:
+	environment_map(const char* filename, double scale = 1) {
+		rtw_image image(filename, true);
+		if (image.width() == 0) {
+			// rtw_image has reported the error; a magenta sky makes the problem visible.
+			build(1, 1, { 1, 0, 1 }, scale);
+			return;
+		}
+
+		std::vector<float> rgb(static_cast<size_t>(image.width()) * image.height() * 3);
+		for (int y = 0; y < image.height(); y++) {
+			for (int x = 0; x < image.width(); x++) {
+				auto pixel = image.float_pixel_data(x, y);
+				std::copy(pixel, pixel + 3, &rgb[(static_cast<size_t>(y) * image.width() + x) * 3]);
+			}
+		}
+		build(image.width(), image.height(), std::move(rgb), scale);
+	}
+
+	environment_map(int width, int height, std::vector<float> rgb, double scale = 1) {
+		// Map from linear RGB pixels in rows, top row first.
+		build(width, height, std::move(rgb), scale);
+	}
+
+	int width() const { return levels[0].width; }
+	int height() const { return levels[0].height; }
+
+	double average_luminance() const {
+		// Mean over the sphere: each pixel covers (2 pi / width) (pi / height) sin(theta).
+		return total * pi / (2.0 * width() * height());
+	}
+
+	color value(const vec3& direction) const {
+		// Radiance arriving from `direction`, bilinearly filtered.
+		double u, v;
+		direction_to_uv(direction, u, v);
+		return lookup(levels[0], u, v);
+	}
+
+	color filtered(const vec3& direction, double spread) const {
+		// Radiance averaged over a cone of half angle `spread` (radians) around `direction`,
+		// approximated by the mip level whose pixels cover about that angle, blended with the
+		// next finer level.
+		double u, v;
+		direction_to_uv(direction, u, v);
+
+		auto level = std::log2(std::max(spread * height() / pi, 1.0));
+		auto fine = std::min(static_cast<int>(level), static_cast<int>(levels.size()) - 1);
+		auto coarse = std::min(fine + 1, static_cast<int>(levels.size()) - 1);
+		auto t = std::min(level - fine, 1.0);
+		return (1 - t) * lookup(levels[fine], u, v) + t * lookup(levels[coarse], u, v);
+	}
+
+	bool sample(double u1, double u2, vec3& direction, double& pdf) const {
+		// Picks a direction in proportion to the map's luminance, with its solid angle density.
+		// Returns false for a black map.
+		if (total == 0)
+			return false;
+
+		auto row = pick(marginal.data(), height(), u1);
+		auto col = pick(&conditional[static_cast<size_t>(row) * (width() + 1)], width(), u2);
+
+		// Place the direction uniformly within the chosen pixel.
+		auto u = (col + random_double()) / width();
+		auto v = (row + random_double()) / height();
+		auto theta = v * pi;
+		auto phi = u * 2 * pi - pi;
+		direction = vec3(std::cos(phi) * std::sin(theta), std::cos(theta), -std::sin(phi) * std::sin(theta));
+
+		pdf = pixel_pdf(row, col, std::sin(theta));
+		return pdf > 0;
+	}
+
+	double pdf(const vec3& direction) const {
+		// Solid angle density of sample() producing `direction`.
+		if (total == 0)
+			return 0;
+
+		double u, v;
+		direction_to_uv(direction, u, v);
+		auto col = std::min(static_cast<int>(u * width()), width() - 1);
+		auto row = std::min(static_cast<int>(v * height()), height() - 1);
+		return pixel_pdf(row, col, std::sin(v * pi));
+	}
+
+private:
+	struct level {
+		int width, height;
+		std::vector<float> rgb;
+	};
+
+	std::vector<level> levels;       // levels[0] is the full map, each next one half the size
+	std::vector<float> weights;      // Luminance times sin(theta) per pixel
+	std::vector<double> marginal;    // CDF over rows, height + 1 entries
+	std::vector<double> conditional; // CDF over each row's pixels, width + 1 entries per row
+	double total = 0;                // Sum of the weights
+
+	void build(int width, int height, std::vector<float> rgb, double scale) {
+		for (auto& value : rgb)
+			value = static_cast<float>(value * scale);
+		levels.push_back({ width, height, std::move(rgb) });
+
+		// Halve the map until it is one pixel high, averaging 2x2 blocks. Odd edges repeat
+		// the last pixel.
+		while (levels.back().height > 1) {
+			const auto& src = levels.back();
+			level dst{ std::max(src.width / 2, 1), src.height / 2, {} };
+			dst.rgb.resize(static_cast<size_t>(dst.width) * dst.height * 3);
+			for (int y = 0; y < dst.height; y++) {
+				for (int x = 0; x < dst.width; x++) {
+					for (int c = 0; c < 3; c++) {
+						float sum = 0;
+						for (int dy = 0; dy < 2; dy++)
+							for (int dx = 0; dx < 2; dx++)
+								sum += texel(src, std::min(2 * x + dx, src.width - 1), std::min(2 * y + dy, src.height - 1))[c];
+						dst.rgb[(static_cast<size_t>(y) * dst.width + x) * 3 + c] = sum / 4;
+					}
+				}
+			}
+			levels.push_back(std::move(dst));
+		}
+
+		const auto& map = levels[0];
+		weights.resize(static_cast<size_t>(width) * height);
+		marginal.assign(height + 1, 0.0);
+		conditional.assign(static_cast<size_t>(height) * (width + 1), 0.0);
+		for (int y = 0; y < height; y++) {
+			auto sin_theta = std::sin((y + 0.5) / height * pi);
+			auto row_cdf = &conditional[static_cast<size_t>(y) * (width + 1)];
+			for (int x = 0; x < width; x++) {
+				auto p = texel(map, x, y);
+				auto w = static_cast<float>((0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2]) * sin_theta);
+				weights[static_cast<size_t>(y) * width + x] = w;
+				row_cdf[x + 1] = row_cdf[x] + w;
+			}
+			marginal[y + 1] = marginal[y] + row_cdf[width];
+		}
+		total = marginal[height];
+	}
+
+	static const float* texel(const level& l, int x, int y) {
+		return &l.rgb[(static_cast<size_t>(y) * l.width + x) * 3];
+	}
+
+	static int pick(const double* cdf, int n, double u) {
+		// Index of the interval of an unnormalized CDF with n + 1 entries that u falls into,
+		// skipping zero-weight intervals.
+		auto target = u * cdf[n];
+		auto found = std::upper_bound(cdf + 1, cdf + n + 1, target) - (cdf + 1);
+		return std::min(static_cast<int>(found), n - 1);
+	}
+
+	double pixel_pdf(int row, int col, double sin_theta) const {
+		// The pixel's share of the weights, spread over its area in (u, v), then over solid
+		// angle: d(omega) = 2 pi^2 sin(theta) du dv.
+		if (sin_theta <= 0)
+			return 0;
+		auto share = weights[static_cast<size_t>(row) * width() + col] / total;
+		return share * width() * height() / (2 * pi * pi * sin_theta);
+	}
+
+	static void direction_to_uv(const vec3& direction, double& u, double& v) {
+		auto d = unit_vector(direction);
+		u = (std::atan2(-d.z(), d.x()) + pi) / (2 * pi);
+		v = std::acos(std::clamp(d.y(), -1.0, 1.0)) / pi;
+	}
+
+	static color lookup(const level& l, double u, double v) {
+		// Bilinear filtering that wraps around horizontally and clamps at the poles.
+		auto x = u * l.width - 0.5;
+		auto y = std::clamp(v * l.height - 0.5, 0.0, l.height - 1.0);
+		auto x0 = static_cast<int>(std::floor(x));
+		auto y0 = static_cast<int>(y);
+		auto fx = x - x0, fy = y - y0;
+		auto y1 = std::min(y0 + 1, l.height - 1);
+		auto x_wrap = [&](int xi) { return ((xi % l.width) + l.width) % l.width; };
+
+		color result(0, 0, 0);
+		const int xs[2] = { x_wrap(x0), x_wrap(x0 + 1) };
+		const int ys[2] = { y0, y1 };
+		for (int j = 0; j < 2; j++) {
+			for (int i = 0; i < 2; i++) {
+				auto w = (i ? fx : 1 - fx) * (j ? fy : 1 - fy);
+				auto p = texel(l, xs[i], ys[j]);
+				result += w * color(p[0], p[1], p[2]);
+			}
+		}
+		return result;
+	}
+};
+
+#endif
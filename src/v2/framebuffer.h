@@ -0,0 +1,190 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Arbitrary output variables: channels recorded alongside the image in the same pass, so
+// compositing and debugging need no extra renders. Each job lists the channels it wants, and
+// the framebuffer keeps those and whatever they are derived from.
+
+enum class aov {
+	beauty,        // The rendered color
+	albedo,        // First-hit albedo, taken past mirror and glass bounces
+	normal,        // World space normal of the same surface, averaged over the pixel
+	depth,         // Distance along the view axis to the first hit, zero for misses
+	emission,      // Light from emitters and sky seen directly or through mirror and glass
+	direct,        // Light that reached the camera after at most one bounce
+	indirect,      // The rest of the beauty
+	sample_count,  // Samples taken
+	variance,      // Variance of the pixel's mean luminance, from the spread of its samples
+	primitive_id,  // Hash of the object the pixel's first sample hit first, zero for none
+};
+
+const aov all_aovs[] = { aov::beauty, aov::albedo, aov::normal, aov::depth, aov::emission, aov::direct,
+	aov::indirect, aov::sample_count, aov::variance, aov::primitive_id };
+
+inline const char* aov_name(aov a) {
+	switch (a) {
+	case aov::beauty: return "beauty";
+	case aov::albedo: return "albedo";
+	case aov::normal: return "normal";
+	case aov::depth: return "depth";
+	case aov::emission: return "emission";
+	case aov::direct: return "direct";
+	case aov::indirect: return "indirect";
+	case aov::sample_count: return "sample_count";
+	case aov::variance: return "variance";
+	case aov::primitive_id: return "primitive_id";
+	}
+	return "";
+}
+
+inline const char* aov_channels(aov a) {
+	// Channel letters in multi-layer files, which also give the components per pixel.
+	switch (a) {
+	case aov::normal: return "XYZ";
+	case aov::depth: return "Z";
+	case aov::sample_count:
+	case aov::variance:
+	case aov::primitive_id: return "Y";
+	default: return "RGB";
+	}
+}
+
+inline int aov_components(aov a) {
+	return static_cast<int>(std::char_traits<char>::length(aov_channels(a)));
+}
+
+inline bool aov_from_name(const std::string& name, aov& a) {
+	for (auto candidate : all_aovs) {
+		if (name == aov_name(candidate)) {
+			a = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline uint32_t primitive_hash(const void* object) {
+	// 24 bits, which a float channel holds exactly; zero only for no object.
+	if (!object)
+		return 0;
+	auto h = (reinterpret_cast<uintptr_t>(object) >> 3) * 0x9e3779b97f4a7c15ULL;
+	return std::max<uint32_t>(static_cast<uint32_t>(h >> 40), 1);
+}
+
+class framebuffer {
+	// Per-pixel sums in tiles of tile_size square pixels, matching the render's tiles. A tile's
+	// channels follow each other in one block, each holding the tile's pixels in rows, so the
+	// thread rendering a tile writes one stretch of memory. Sums become per-pixel values, in
+	// image rows, when a layer is read out.
+public:
+	framebuffer(int _width, int _height, int _tile_size, const std::vector<aov>& requested)
+		: width(_width), height(_height), tile_size(_tile_size), tiles_x((_width + _tile_size - 1) / _tile_size)
+	{
+		std::fill(std::begin(offset), std::end(offset), -1);
+		for (auto a : requested)
+			keep(a);
+		keep(aov::beauty);
+		keep(aov::sample_count);
+
+		auto tiles_y = (height + tile_size - 1) / tile_size;
+		data.assign(static_cast<size_t>(tiles_x) * tiles_y * tile_floats, 0.0f);
+	}
+
+	int image_width() const { return width; }
+	int image_height() const { return height; }
+
+	bool has(aov a) const { return offset[static_cast<int>(a)] >= 0; }
+
+	float* at(aov a, int x, int y) {
+		// The sums of channel a at pixel (x, y), aov_components(a) floats. Variance keeps the
+		// sum of squared luminances. Indirect light is derived from the beauty and the direct
+		// light, and has no storage of its own.
+		auto tile_index = static_cast<size_t>(y / tile_size) * tiles_x + x / tile_size;
+		auto in_tile = static_cast<size_t>(y % tile_size) * tile_size + x % tile_size;
+		return &data[tile_index * tile_floats + static_cast<size_t>(offset[static_cast<int>(a)]) * tile_size * tile_size
+			+ in_tile * aov_components(a)];
+	}
+
+	const float* at(aov a, int x, int y) const {
+		return const_cast<framebuffer*>(this)->at(a, x, y);
+	}
+
+	void add_image(const std::vector<float>& sums, int samples_per_pixel) {
+		// Takes the RGB sums of an image rendered without the framebuffer, in rows.
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				auto source = &sums[(static_cast<size_t>(y) * width + x) * 3];
+				std::copy(source, source + 3, at(aov::beauty, x, y));
+				*at(aov::sample_count, x, y) = static_cast<float>(samples_per_pixel);
+			}
+		}
+	}
+
+	std::vector<float> layer(aov a) const {
+		// Per-pixel values of channel a in image rows, averaged over each pixel's samples.
+		auto components = aov_components(a);
+		std::vector<float> pixels(static_cast<size_t>(width) * height * components, 0.0f);
+		if (!has(a))
+			return pixels;
+
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				auto out = &pixels[(static_cast<size_t>(y) * width + x) * components];
+				auto n = *at(aov::sample_count, x, y);
+				if (a == aov::sample_count || a == aov::primitive_id) {
+					out[0] = *at(a, x, y);
+				}
+				else if (n <= 0) {
+					continue;
+				}
+				else if (a == aov::variance) {
+					// Sample variance of the luminance over n, from its sum and sum of squares.
+					auto b = at(aov::beauty, x, y);
+					auto mean = (0.2126f * b[0] + 0.7152f * b[1] + 0.0722f * b[2]) / n;
+					out[0] = n > 1 ? std::max(0.0f, *at(a, x, y) / n - mean * mean) / (n - 1) : 0.0f;
+				}
+				else if (a == aov::indirect) {
+					auto b = at(aov::beauty, x, y), d = at(aov::direct, x, y);
+					for (int c = 0; c < 3; c++)
+						out[c] = (b[c] - d[c]) / n;
+				}
+				else {
+					auto sums = at(a, x, y);
+					for (int c = 0; c < components; c++)
+						out[c] = sums[c] / n;
+				}
+			}
+		}
+		return pixels;
+	}
+
+private:
+	int width, height, tile_size, tiles_x;
+	int offset[std::size(all_aovs)];  // Of each kept channel within a tile, in floats per pixel; -1 if not kept
+	size_t tile_floats = 0;
+	int pixel_floats = 0;
+	std::vector<float> data;
+
+	void keep(aov a) {
+		if (a == aov::indirect)
+			keep(aov::direct);
+		if (a == aov::variance)
+			keep(aov::beauty);
+		auto& slot = offset[static_cast<int>(a)];
+		if (slot >= 0)
+			return;
+		slot = pixel_floats;
+		if (a != aov::indirect)
+			pixel_floats += aov_components(a);
+		tile_floats = static_cast<size_t>(pixel_floats) * tile_size * tile_size;
+	}
+};
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "hittable.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Online path guiding with an SD-tree (Mueller et al. 2017, "Practical Path Guiding for
+// Efficient Light-Transport Simulation"). A binary tree over space holds, per region, a
+// quadtree over directions that learns where light arrives from. Rendering runs in passes of
+// doubling sample counts: each pass records the radiance its paths find into one set of
+// quadtrees while sampling from the set learned in the previous pass, and in between the trees
+// are refined where they received the most samples and energy. Threads record concurrently,
+// so guided renders are not reproducible bit for bit; see direction_tree.
+
+struct guiding_settings {
+	double training_fraction = 0.5;     // Share of samples_per_pixel spent in learning passes
+	double guided_fraction = 0.5;       // Probability of sampling the learned distribution rather than the material
+	double spatial_threshold = 12000;   // Samples that split a region, times sqrt(samples per pixel of the pass)
+	double energy_threshold = 0.01;     // Share of a region's energy that subdivides a direction cell
+	int max_direction_depth = 20;
+};
+
+inline void atomic_add(std::atomic<float>& target, float value) {
+	auto current = target.load(std::memory_order_relaxed);
+	while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+}
+
+class direction_tree {
+	// Distribution over the sphere as a quadtree over the unit square, mapped to directions by
+	// (cos theta, phi), which preserves area: a cell's solid angle density is its share of the
+	// energy over its area. Recording adds to every node on the way down with relaxed atomic
+	// adds, so threads never wait for each other; the topology only changes between passes.
+	// Threads reach the sums in a different order on every run, and float additions round
+	// differently in another order, so the learned distributions, the directions sampled from
+	// them and hence guided renders are not reproducible bit for bit.
+public:
+	direction_tree() : nodes(1) {}
+
+	double total() const {
+		double sum = 0;
+		for (const auto& s : nodes[0].sum)
+			sum += s.load(std::memory_order_relaxed);
+		return sum;
+	}
+
+	size_t size() const { return nodes.size(); }
+
+	void record(const vec3& direction, float value) {
+		double x, y;
+		to_square(direction, x, y);
+		uint32_t index = 0;
+		while (true) {
+			auto q = quadrant(x, y);
+			atomic_add(nodes[index].sum[q], value);
+			if (!nodes[index].child[q])
+				return;
+			index = nodes[index].child[q];
+		}
+	}
+
+	vec3 sample(const vec3& normal) const {
+		// Directions drawn on the side of a surface facing away from `normal` are mirrored onto
+		// the other side, so none are lost to it. A zero normal keeps the whole sphere.
+		auto direction = sample();
+		auto d = dot(direction, normal);
+		return d < 0 ? direction - 2 * d * normal : direction;
+	}
+
+	double pdf(const vec3& direction, const vec3& normal) const {
+		// Solid angle density of sample(normal) producing `direction`.
+		if (normal.length_squared() == 0)
+			return pdf(direction);
+		auto d = dot(direction, normal);
+		if (d < 0)
+			return 0;
+		return pdf(direction) + pdf(direction - 2 * d * normal);
+	}
+
+	double pdf(const vec3& direction) const {
+		// Solid angle density of sample() producing `direction`.
+		double x, y;
+		to_square(direction, x, y);
+		double density = 1;
+		uint32_t index = 0;
+		while (true) {
+			const auto& n = nodes[index];
+			auto q = quadrant(x, y);
+			auto sum = n.total();
+			if (sum > 0)
+				density *= 4 * n.sum[q].load(std::memory_order_relaxed) / sum;
+			if (!n.child[q] || density == 0)
+				break;
+			index = n.child[q];
+		}
+		return density / (4 * pi);
+	}
+
+	vec3 sample() const {
+		// Descends by energy, then picks a point uniformly within the leaf cell.
+		double x = 0, y = 0, size = 1;
+		uint32_t index = 0;
+		while (true) {
+			const auto& n = nodes[index];
+			auto sum = n.total();
+			int q = 0;
+			if (sum > 0) {
+				auto u = random_double() * sum;
+				while (q < 3 && u >= n.sum[q].load(std::memory_order_relaxed))
+					u -= n.sum[q++].load(std::memory_order_relaxed);
+			}
+			else {
+				q = static_cast<int>(random_double() * 4);
+			}
+
+			size /= 2;
+			x += (q & 1) * size;
+			y += (q >> 1) * size;
+			if (!n.child[q])
+				break;
+			index = n.child[q];
+		}
+		return from_square(x + random_double() * size, y + random_double() * size);
+	}
+
+	direction_tree refined(double threshold, int max_depth) const {
+		// An empty tree whose cells are subdivided where this tree holds more than `threshold`
+		// of the energy, and merged where it holds less.
+		direction_tree result;
+		auto sum = total();
+		if (sum <= 0)
+			return result;
+
+		double energy[4];
+		for (int q = 0; q < 4; q++)
+			energy[q] = nodes[0].sum[q].load(std::memory_order_relaxed);
+		refine_node(result, 0, 0, energy, 1, sum * threshold, max_depth);
+		return result;
+	}
+
+private:
+	struct node {
+		std::atomic<float> sum[4];
+		uint32_t child[4] = { 0, 0, 0, 0 };  // Zero for leaf cells, since the root is nobody's child
+
+		node() {
+			for (auto& s : sum) s.store(0, std::memory_order_relaxed);
+		}
+		node(const node& other) { *this = other; }
+		node& operator=(const node& other) {
+			for (int q = 0; q < 4; q++) {
+				sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+				child[q] = other.child[q];
+			}
+			return *this;
+		}
+
+		double total() const {
+			double result = 0;
+			for (const auto& s : sum)
+				result += s.load(std::memory_order_relaxed);
+			return result;
+		}
+	};
+
+	std::vector<node> nodes;
+
+	void refine_node(direction_tree& result, uint32_t target, int64_t source, const double* energy, int depth,
+		double split_energy, int max_depth) const {
+		// Builds the children of result's node `target` from this tree's node `source` (-1 when
+		// this tree has no node there and the energy is assumed evenly spread).
+		for (int q = 0; q < 4; q++) {
+			if (energy[q] <= split_energy || depth >= max_depth)
+				continue;
+
+			double child_energy[4];
+			int64_t child_source = -1;
+			if (source >= 0 && nodes[source].child[q]) {
+				child_source = nodes[source].child[q];
+				for (int k = 0; k < 4; k++)
+					child_energy[k] = nodes[child_source].sum[k].load(std::memory_order_relaxed);
+			}
+			else {
+				for (int k = 0; k < 4; k++)
+					child_energy[k] = energy[q] / 4;
+			}
+
+			auto child = static_cast<uint32_t>(result.nodes.size());
+			result.nodes.emplace_back();
+			result.nodes[target].child[q] = child;
+			refine_node(result, child, child_source, child_energy, depth + 1, split_energy, max_depth);
+		}
+	}
+
+	static int quadrant(double& x, double& y) {
+		// Quadrant of (x, y), which is then rescaled to the quadrant's own unit square.
+		int qx = x >= 0.5, qy = y >= 0.5;
+		x = 2 * x - qx;
+		y = 2 * y - qy;
+		return qx + 2 * qy;
+	}
+
+	static void to_square(const vec3& direction, double& x, double& y) {
+		auto d = unit_vector(direction);
+		x = std::clamp((d.z() + 1) / 2, 0.0, 1.0);
+		auto phi = std::atan2(d.y(), d.x());
+		y = std::clamp((phi < 0 ? phi + 2 * pi : phi) / (2 * pi), 0.0, 1.0);
+	}
+
+	static vec3 from_square(double x, double y) {
+		auto cos_theta = 2 * x - 1;
+		auto sin_theta = std::sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+		auto phi = 2 * pi * y;
+		return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+	}
+};
+
+class path_guide {
+	// The spatial half of the SD-tree: a binary tree over the scene bounds that halves regions
+	// along x, y and z in turn. Each leaf region samples from the distribution learned in the
+	// previous pass and records into a fresh one. Regions that record many samples are split,
+	// so the tree follows where paths actually go.
+public:
+	struct region {
+		direction_tree sampling;  // Learned in the previous pass, read only during a pass
+		direction_tree building;  // Recorded into during a pass
+		std::atomic<uint32_t> samples{ 0 };
+	};
+
+	path_guide(const aabb& scene, const guiding_settings& _settings) : settings(_settings) {
+		for (int a = 0; a < 3; a++) {
+			lo[a] = scene.axis(a).min;
+			hi[a] = scene.axis(a).max;
+		}
+		nodes.push_back({ 0, 0 });
+		regions.push_back(std::make_unique<region>());
+	}
+
+	region& find(const point3& p) const {
+		uint32_t index = 0;
+		double box_lo[3] = { lo[0], lo[1], lo[2] }, box_hi[3] = { hi[0], hi[1], hi[2] };
+		for (int depth = 0; nodes[index].child; depth++) {
+			auto axis = depth % 3;
+			auto mid = (box_lo[axis] + box_hi[axis]) / 2;
+			if (p[axis] < mid) {
+				index = nodes[index].child;
+				box_hi[axis] = mid;
+			}
+			else {
+				index = nodes[index].child + 1;
+				box_lo[axis] = mid;
+			}
+		}
+		return *regions[nodes[index].region];
+	}
+
+	void record(region& r, const vec3& direction, double radiance) {
+		// Radiance estimates arrive divided by the density of their direction, which makes the
+		// sums estimates of the light arriving over each cell.
+		if (radiance > 0 && std::isfinite(radiance))
+			r.building.record(direction, static_cast<float>(radiance));
+		r.samples.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void refine(int pass_samples_per_pixel) {
+		// Called between passes: splits the regions that recorded more samples than the
+		// threshold (children inherit the parent's distribution and half its samples), then
+		// moves what each region recorded into its sampling distribution and starts a refined
+		// empty one for recording.
+		auto threshold = settings.spatial_threshold * std::sqrt(static_cast<double>(pass_samples_per_pixel));
+		for (size_t index = 0; index < nodes.size(); index++) {
+			if (nodes[index].child)
+				continue;
+			auto& parent = *regions[nodes[index].region];
+			auto samples = parent.samples.load(std::memory_order_relaxed);
+			if (samples <= threshold)
+				continue;
+
+			auto child = static_cast<uint32_t>(nodes.size());
+			auto second = std::make_unique<region>();
+			second->building = parent.building;
+			second->samples = samples / 2;
+			parent.samples = samples / 2;
+			nodes[index].child = child;
+			nodes.push_back({ 0, nodes[index].region });
+			nodes.push_back({ 0, static_cast<uint32_t>(regions.size()) });
+			regions.push_back(std::move(second));
+		}
+
+		for (auto& r : regions) {
+			r->sampling = r->building;
+			r->building = r->sampling.refined(settings.energy_threshold, settings.max_direction_depth);
+			r->samples = 0;
+		}
+	}
+
+	size_t region_count() const { return regions.size(); }
+
+	size_t direction_node_count() const {
+		size_t count = 0;
+		for (const auto& r : regions)
+			count += r->sampling.size() + r->building.size();
+		return count;
+	}
+
+private:
+	struct node {
+		uint32_t child;   // Index of the lower half; the upper half follows it. Zero for leaves.
+		uint32_t region;  // Leaves only
+	};
+
+	guiding_settings settings;
+	double lo[3], hi[3];
+	std::vector<node> nodes;
+	std::vector<std::unique_ptr<region>> regions;
+};
+
+#endif
@@ -6,12 +6,27 @@
 #include "ray.h"
 #include "interval.h"
 #include "aabb.h"
+#include "affine.h"
 
 
 using std::shared_ptr;
 using std::make_shared;
 
 class material;
+class hittable;
+
+struct light_shape {
+	// Geometry of a shape used as a light: its bounding box, surface area, the cone of its
+	// surface normals (axis and cosine of the half angle) and whether it emits from both sides.
+	// `center` and `mat` let the light hierarchy look up the emitted radiance.
+	aabb bounds;
+	double area = 0;
+	vec3 axis = vec3(0, 0, 1);
+	double cos_theta_o = 1;
+	bool two_sided = false;
+	point3 center;
+	const material* mat = nullptr;
+};
 
 class hit_record {
 public:
@@ -22,8 +37,14 @@ public:
 	double u;
 	double v;
 
+	vec3 dpdu, dpdv;  // Partial derivatives of the hit point with respect to u and v
+
+	// Screen-space derivatives of the texture coordinates, zero when the ray carries no differentials.
+	double dudx = 0, dvdx = 0, dudy = 0, dvdy = 0;
+
 	bool front_face;
 	std::shared_ptr<material> mat;
+	const hittable* object = nullptr;  // Primitive that was hit, matched against the scene lights
 
 	void set_face_normal(const ray& r, const vec3& outward_normal) {
 		// Sets the hit record normal vector.
@@ -31,18 +52,89 @@ public:
 		front_face = dot(r.direction(), outward_normal) < 0;
 		normal = front_face ? outward_normal : -outward_normal;
 	}
+
+	void compute_differentials(const ray& r) {
+		// Intersects the offset rays of `r` with the tangent plane at the hit point, then solves
+		// the least-squares system dp = dpdu * du + dpdv * dv for the texture coordinate deltas.
+		dudx = dvdx = dudy = dvdy = 0;
+		if (!r.has_differentials)
+			return;
+
+		auto d = dot(normal, p);
+		auto tx = (d - dot(normal, r.rx_origin)) / dot(normal, r.rx_direction);
+		auto ty = (d - dot(normal, r.ry_origin)) / dot(normal, r.ry_direction);
+		if (!std::isfinite(tx) || !std::isfinite(ty))
+			return;
+
+		auto dpdx = r.rx_origin + tx * r.rx_direction - p;
+		auto dpdy = r.ry_origin + ty * r.ry_direction - p;
+
+		auto ata00 = dot(dpdu, dpdu);
+		auto ata01 = dot(dpdu, dpdv);
+		auto ata11 = dot(dpdv, dpdv);
+		auto inv_det = 1 / (ata00 * ata11 - ata01 * ata01);
+		if (!std::isfinite(inv_det))
+			return;
+
+		auto atb0x = dot(dpdu, dpdx), atb1x = dot(dpdv, dpdx);
+		auto atb0y = dot(dpdu, dpdy), atb1y = dot(dpdv, dpdy);
+
+		dudx = (ata11 * atb0x - ata01 * atb1x) * inv_det;
+		dvdx = (ata00 * atb1x - ata01 * atb0x) * inv_det;
+		dudy = (ata11 * atb0y - ata01 * atb1y) * inv_det;
+		dvdy = (ata00 * atb1y - ata01 * atb0y) * inv_det;
+	}
 };
 
 class hittable {
 protected:
-	aabb bbox;
+	aabb bbox;  // Bounds over the whole shutter interval
+
+	void set_motion_bounds(const aabb& open, const aabb& close) {
+		// For objects that move during the shutter: bounds at time 0 and time 1.
+		moving = true;
+		box_open = open;
+		box_close = close;
+		bbox = aabb(open, close);
+	}
 
 public:
 	virtual ~hittable() = default;
 
 	aabb bounding_box() const { return bbox; }
 
+	// Bounds at shutter open and close. For moving objects, interpolating the two by ray time
+	// bounds the object at that time; static objects return their single box for both.
+	bool has_motion() const { return moving; }
+	aabb shutter_open_box() const { return moving ? box_open : bbox; }
+	aabb shutter_close_box() const { return moving ? box_close : bbox; }
+
 	virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+	// Light sampling, for shapes that can carry an emissive material: the solid angle density of
+	// sampling `direction` from `origin`, and a random vector from `origin` towards the shape.
+	virtual double pdf_value(const point3& origin, const vec3& direction) const {
+		return 0.0;
+	}
+
+	virtual vec3 random(const point3& origin) const {
+		return vec3(1, 0, 0);
+	}
+
+	// Describes this shape as a light; false for shapes that cannot be sampled.
+	virtual bool get_light_shape(light_shape& out) const {
+		return false;
+	}
+
+	// A uniformly distributed point on the surface, with its outward normal and texture
+	// coordinates, for emitting photons from lights.
+	virtual bool sample_surface(hit_record& rec) const {
+		return false;
+	}
+
+private:
+	bool moving = false;
+	aabb box_open, box_close;
 };
 
 class hittable_list : public hittable {
@@ -78,12 +170,23 @@ public:
 
 class sphere : public hittable {
 public:
-	sphere(point3 _center, double _radius, std::shared_ptr<material> _material) : center(_center), radius(_radius), mat(_material) {
+	// Stationary Sphere
+	sphere(point3 _center, double _radius, std::shared_ptr<material> _material) : center1(_center), radius(_radius), mat(_material) {
+		auto rvec = vec3(radius, radius, radius);
+		bbox = aabb(center1 - rvec, center1 + rvec);
+	}
+
+	// Moving Sphere, at _center1 when the shutter opens and _center2 when it closes
+	sphere(point3 _center1, point3 _center2, double _radius, std::shared_ptr<material> _material)
+		: center1(_center1), radius(_radius), mat(_material), is_moving(true)
+	{
 		auto rvec = vec3(radius, radius, radius);
-		bbox = aabb(center - rvec, center + rvec);
+		center_vec = _center2 - _center1;
+		set_motion_bounds(aabb(_center1 - rvec, _center1 + rvec), aabb(_center2 - rvec, _center2 + rvec));
 	}
 
 	bool hit(const ray& r, interval ray_t, hit_record& rec)  const override {
+		point3 center = is_moving ? sphere_center(r.time()) : center1;
 		vec3 oc = r.origin() - center;
 		auto a = r.direction().length_squared();
 		auto half_b = dot(oc, r.direction());
@@ -106,13 +209,90 @@ public:
 		rec.t = root;
 		rec.p = r.at(rec.t);
 		rec.mat = mat;
+		rec.object = this;
 
 		vec3 outward_normal = (rec.p - center) / radius;
 		rec.set_face_normal(r, outward_normal);
 		get_sphere_uv(outward_normal, rec.u, rec.v);
+		get_sphere_derivatives(outward_normal, radius, rec.dpdu, rec.dpdv);
+		return true;
+	}
+
+	double pdf_value(const point3& origin, const vec3& direction) const override {
+		// Density of sampling the cone of directions subtended by the sphere; stationary only.
+		auto distance_squared = (center1 - origin).length_squared();
+		if (distance_squared <= radius * radius)
+			return 0;
+
+		hit_record rec;
+		if (!this->hit(ray(origin, direction, 0.0), interval(0.001, infinity), rec))
+			return 0;
+
+		auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+		auto solid_angle = 2 * pi * (1 - cos_theta_max);
+		return 1 / solid_angle;
+	}
+
+	vec3 random(const point3& origin) const override {
+		// Uniform direction within the cone subtended by the sphere, in a frame around the axis
+		// from `origin` to the center.
+		vec3 direction = center1 - origin;
+		auto distance_squared = direction.length_squared();
+		if (distance_squared <= radius * radius)
+			return direction;
+
+		auto w = unit_vector(direction);
+		auto a = (fabs(w.x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+		auto v = unit_vector(cross(w, a));
+		auto u = cross(w, v);
+
+		auto r1 = random_double();
+		auto r2 = random_double();
+		auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
+		auto phi = 2 * pi * r1;
+		auto sin_theta = sqrt(1 - z * z);
+		return cos(phi) * sin_theta * u + sin(phi) * sin_theta * v + z * w;
+	}
+
+	bool get_light_shape(light_shape& out) const override {
+		if (is_moving)
+			return false;
+		out.bounds = bbox;
+		out.area = 4 * pi * radius * radius;
+		out.cos_theta_o = -1;  // Normals point every way
+		out.two_sided = false;
+		out.center = center1;
+		out.mat = mat.get();
+		return true;
+	}
+
+	bool sample_surface(hit_record& rec) const override {
+		if (is_moving)
+			return false;
+		auto outward_normal = random_unit_vector();
+		rec.p = center1 + radius * outward_normal;
+		rec.normal = outward_normal;
+		rec.front_face = true;
+		rec.mat = mat;
+		rec.object = this;
+		get_sphere_uv(outward_normal, rec.u, rec.v);
 		return true;
 	}
 
+	static void get_sphere_derivatives(const point3& p, double radius, vec3& dpdu, vec3& dpdv) {
+		// Partial derivatives of the surface point for the (u,v) mapping of get_sphere_uv,
+		// with p a point on the unit sphere.
+		auto sin_theta = std::sqrt(p.x() * p.x() + p.z() * p.z());
+		dpdu = 2 * pi * radius * vec3(p.z(), 0, -p.x());
+
+		// At the poles the v direction is undefined; pick any tangent.
+		if (sin_theta < 1e-8) {
+			dpdv = pi * radius * vec3(1, 0, 0);
+			return;
+		}
+		dpdv = pi * radius * vec3(-p.x() * p.y() / sin_theta, sin_theta, -p.y() * p.z() / sin_theta);
+	}
+
 	static void get_sphere_uv(const point3& p, double& u, double& v) {
 		// p: a given point on the sphere of radius one, centered at the origin.
 		// u: returned value [0,1] of angle around the Y axis from X=-1.
@@ -129,9 +309,17 @@ public:
 	}
 
 private:
-	point3 center;
+	point3 center1;
 	double radius;
 	std::shared_ptr<material> mat;
+	bool is_moving = false;
+	vec3 center_vec;
+
+	point3 sphere_center(double time) const {
+		// Linearly interpolate from center1 to center2 according to time, where t=0 yields
+		// center1, and t=1 yields center2.
+		return center1 + time * center_vec;
+	}
 };
 
 
@@ -147,6 +335,8 @@ public:
 		normal = unit_vector(n);
 		D = dot(normal, Q);
 		w = n / dot(n, n);
+
+		area = n.length();
 	}
 
 	virtual void set_bounding_box() {
@@ -178,10 +368,60 @@ public:
 		rec.p = intersection;
 		rec.mat = mat;
 		rec.set_face_normal(r, normal);
+		rec.dpdu = u;
+		rec.dpdv = v;
+		rec.object = this;
 
 		return true;
 	}
 
+	double pdf_value(const point3& origin, const vec3& direction) const override {
+		// Converts the uniform area density 1/area to solid angle at `origin`.
+		hit_record rec;
+		if (!this->hit(ray(origin, direction, 0.0), interval(0.001, infinity), rec))
+			return 0;
+
+		auto distance_squared = rec.t * rec.t * direction.length_squared();
+		auto cosine = fabs(dot(direction, rec.normal) / direction.length());
+
+		return distance_squared / (cosine * area);
+	}
+
+	vec3 random(const point3& origin) const override {
+		auto p = Q + (random_double() * u) + (random_double() * v);
+		return p - origin;
+	}
+
+	bool get_light_shape(light_shape& out) const override {
+		// diffuse_light emits from both faces of a quad.
+		out.bounds = bbox;
+		out.area = area;
+		out.axis = normal;
+		out.cos_theta_o = 1;
+		out.two_sided = true;
+		out.center = Q + 0.5 * (u + v);
+		out.mat = mat.get();
+		return true;
+	}
+
+	bool sample_surface(hit_record& rec) const override {
+		surface_point(random_double(), random_double(), rec);
+		return true;
+	}
+
+	void surface_point(double a, double b, hit_record& rec) const {
+		// The point at plane coordinates (a, b), as seen from the side the normal faces.
+		rec.u = a;
+		rec.v = b;
+		rec.p = Q + a * u + b * v;
+		rec.normal = normal;
+		rec.front_face = true;
+		rec.dpdu = u;
+		rec.dpdv = v;
+		rec.mat = mat;
+		rec.object = this;
+	}
+
 private:
 	point3 Q;
 	vec3 u, v;
@@ -190,6 +430,7 @@ private:
 	vec3 normal;
 	double D;
 	vec3 w;
+	double area;
 
 	bool is_interior(double a, double b, hit_record& rec) const {
 		// Given the hit point in plane coordinates, return false if it is outside the
@@ -204,13 +445,114 @@ private:
 	}
 };
 
-shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat)
-{
-	// Returns the 3D box (six sides) that contains the two opposite vertices a & b.
+class oriented_box : public hittable {
+	// Box spanned by a corner Q and three mutually orthogonal edge vectors u, v, w. Rays are
+	// moved into the box's unit-cube coordinates and intersected with a single slab test;
+	// normals, UVs and surface derivatives of the hit face follow from the slab that was hit.
+	// Face UVs match the six quads that box() used to build.
+public:
+	oriented_box(const point3& _Q, const vec3& _u, const vec3& _v, const vec3& _w, shared_ptr<material> m)
+		: Q(_Q), mat(m)
+	{
+		edges[0] = _u;
+		edges[1] = _v;
+		edges[2] = _w;
+		for (int a = 0; a < 3; a++) {
+			dual[a] = edges[a] / edges[a].length_squared();
+			normals[a] = unit_vector(edges[a]);
+		}
 
-	auto sides = make_shared<hittable_list>();
+		point3 min(infinity, infinity, infinity);
+		point3 max(-infinity, -infinity, -infinity);
+		for (int k = 0; k < 8; k++) {
+			auto corner = Q + (k & 1) * edges[0] + ((k >> 1) & 1) * edges[1] + ((k >> 2) & 1) * edges[2];
+			for (int c = 0; c < 3; c++) {
+				min[c] = fmin(min[c], corner[c]);
+				max[c] = fmax(max[c], corner[c]);
+			}
+		}
+		bbox = aabb(min, max).pad();
+	}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+		// Slab test in box coordinates, where the box is [0,1] on each axis.
+		auto origin = r.origin() - Q;
+		double t_near = -infinity, t_far = infinity;
+		int near_face = 0, far_face = 0;
+
+		for (int a = 0; a < 3; a++) {
+			auto o = dot(origin, dual[a]);
+			auto d = dot(r.direction(), dual[a]);
+			if (fabs(d) < 1e-12) {
+				if (o < 0 || o > 1) return false;
+				continue;
+			}
+
+			// Faces are numbered 2 * axis, plus one for the face at 1.
+			auto t0 = -o / d, t1 = (1 - o) / d;
+			int f0 = 2 * a, f1 = 2 * a + 1;
+			if (t0 > t1) {
+				std::swap(t0, t1);
+				std::swap(f0, f1);
+			}
+			if (t0 > t_near) { t_near = t0; near_face = f0; }
+			if (t1 < t_far) { t_far = t1; far_face = f1; }
+			if (t_far < t_near) return false;
+		}
+
+		// Take the entry point, or the exit point for rays starting inside the box.
+		auto t = t_near;
+		auto face = near_face;
+		if (!ray_t.surrounds(t)) {
+			t = t_far;
+			face = far_face;
+			if (!ray_t.surrounds(t))
+				return false;
+		}
+
+		rec.t = t;
+		rec.p = r.at(t);
+		rec.mat = mat;
+		rec.object = this;
+
+		auto axis = face / 2;
+		bool positive = face & 1;
+		rec.set_face_normal(r, positive ? normals[axis] : -normals[axis]);
+		set_face_uv(axis, positive, rec);
+		return true;
+	}
+
+private:
+	point3 Q;
+	vec3 edges[3];
+	vec3 dual[3];     // edges[a] / |edges[a]|^2, mapping offsets from Q to box coordinates
+	vec3 normals[3];  // Unit edge directions
+	shared_ptr<material> mat;
+
+	void set_face_uv(int axis, bool positive, hit_record& rec) const {
+		auto offset = rec.p - Q;
+		double s[3];
+		for (int a = 0; a < 3; a++)
+			s[a] = fmin(fmax(dot(offset, dual[a]), 0.0), 1.0);
+
+		// Each face runs u along one edge and v along another, flipped so faces read the same
+		// way from outside: front/back are +-w, right/left +-u, top/bottom +-v.
+		int u_axis = (axis == 0) ? 2 : 0;
+		int v_axis = (axis == 1) ? 2 : 1;
+		bool u_flip = (axis == 0) ? positive : (axis == 2 && !positive);
+		bool v_flip = (axis == 1 && positive);
+
+		rec.u = u_flip ? 1 - s[u_axis] : s[u_axis];
+		rec.v = v_flip ? 1 - s[v_axis] : s[v_axis];
+		rec.dpdu = u_flip ? -edges[u_axis] : edges[u_axis];
+		rec.dpdv = v_flip ? -edges[v_axis] : edges[v_axis];
+	}
+};
+
+shared_ptr<oriented_box> box(const point3& a, const point3& b, shared_ptr<material> mat)
+{
+	// Returns the axis-aligned 3D box that contains the two opposite vertices a & b.
 
-	// Construct the two opposite vertices with the minimum and maximum coordinates.
 	auto min = point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
 	auto max = point3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z()));
 
@@ -218,116 +560,143 @@ shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<mater
 	auto dy = vec3(0, max.y() - min.y(), 0);
 	auto dz = vec3(0, 0, max.z() - min.z());
 
-	sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()), dx, dy, mat)); // front
-	sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()), -dz, dy, mat)); // right
-	sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()), -dx, dy, mat)); // back
-	sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dz, dy, mat)); // left
-	sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()), dx, -dz, mat)); // top
-	sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dx, dz, mat)); // bottom
+	return make_shared<oriented_box>(min, dx, dy, dz, mat);
+}
+
+shared_ptr<oriented_box> box(const point3& a, const point3& b, shared_ptr<material> mat, double y_rotation, const vec3& offset)
+{
+	// Returns the box of box(a, b, mat) rotated about the y axis by `y_rotation` degrees and then
+	// moved by `offset`, the same placement as translate(rotate_y(box(a, b, mat))) without the
+	// wrapper objects.
+
+	auto placement = affine::translation(offset) * affine::rotation_y(y_rotation);
+
+	auto min = point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
+	auto max = point3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z()));
 
-	return sides;
+	return make_shared<oriented_box>(placement.point(min), placement.vector(vec3(max.x() - min.x(), 0, 0)),
+		placement.vector(vec3(0, max.y() - min.y(), 0)), placement.vector(vec3(0, 0, max.z() - min.z())), mat);
 }
 
-class translate : public hittable {
+class transform : public hittable {
+	// Instance of an object under an affine transform. Rays are moved into object space with the
+	// precomputed inverse, which costs one point and one vector transform per test; hits are
+	// moved back with the forward transform and normals with the inverse transpose. A transform
+	// of a transform is folded into one node when it is built, so chains of wrappers never nest.
+	// Moving transforms interpolate between the transforms at shutter open and close, and
+	// invert the interpolated transform per ray. Only translations move: interpolating rotation
+	// matrices element by element would shear and shrink the object mid-shutter.
 public:
-	translate(shared_ptr<hittable> p, const vec3& displacement)
-		: object(p), offset(displacement)
+	transform(shared_ptr<hittable> p, const affine& to_world_transform)
+		: transform(p, to_world_transform, to_world_transform, false)
+	{}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+		if (moving) {
+			auto to_world = lerp(world_open, world_close, r.time());
+			return hit_transformed(r, ray_t, rec, to_world, to_world.inverse());
+		}
+		return hit_transformed(r, ray_t, rec, world_open, object_open);
+	}
+
+protected:
+	// For translate's moving form: the two transforms differ only in their translation.
+	transform(shared_ptr<hittable> p, const affine& open_transform, const affine& close_transform)
+		: transform(p, open_transform, close_transform, true)
+	{}
+
+private:
+	shared_ptr<hittable> object;
+	affine world_open, world_close;  // Object to world at shutter open and close
+	affine object_open;              // Inverse of world_open, used when the transform is static
+	bool moving;
+
+	transform(shared_ptr<hittable> p, const affine& open_transform, const affine& close_transform, bool is_moving)
+		: object(p), world_open(open_transform), world_close(close_transform), moving(is_moving)
 	{
-		bbox = object->bounding_box() + offset;
+		// Folding is exact unless both transforms move: a product of two interpolations is not
+		// the interpolation of the products.
+		auto inner = std::dynamic_pointer_cast<transform>(p);
+		if (inner && !(moving && inner->moving)) {
+			object = inner->object;
+			world_open = open_transform * inner->world_open;
+			world_close = close_transform * inner->world_close;
+			moving = moving || inner->moving;
+		}
+		object_open = world_open.inverse();
+
+		if (moving && object->has_motion()) {
+			// Motion on motion is not linear, so fall back to a static box over the shutter.
+			bbox = aabb(transform_box(world_open, object->bounding_box()), transform_box(world_close, object->bounding_box()));
+		}
+		else if (moving) {
+			set_motion_bounds(transform_box(world_open, object->bounding_box()), transform_box(world_close, object->bounding_box()));
+		}
+		else if (object->has_motion()) {
+			set_motion_bounds(transform_box(world_open, object->shutter_open_box()), transform_box(world_open, object->shutter_close_box()));
+		}
+		else {
+			bbox = transform_box(world_open, object->bounding_box());
+		}
 	}
 
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-		// Move the ray backwards by the offset
-		ray offset_r(r.origin() - offset, r.direction(), r.time());
+	bool hit_transformed(const ray& r, interval ray_t, hit_record& rec, const affine& to_world, const affine& to_object) const {
+		// The object space direction is not renormalized, so t is the same in both spaces.
+		ray object_r(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
 
-		// Determine where (if any) an intersection occurs along the offset ray
-		if (!object->hit(offset_r, ray_t, rec))
+		if (!object->hit(object_r, ray_t, rec))
 			return false;
 
-		// Move the intersection point forwards by the offset
-		rec.p += offset;
+		rec.p = to_world.point(rec.p);
+		rec.normal = unit_vector(to_object.transposed_vector(rec.normal));
+		rec.dpdu = to_world.vector(rec.dpdu);
+		rec.dpdv = to_world.vector(rec.dpdv);
 
 		return true;
 	}
 
-private:
-	shared_ptr<hittable> object;
-	vec3 offset;
-	aabb bbox;
-};
-
-class rotate_y : public hittable {
-public:
-	rotate_y(shared_ptr<hittable> p, double angle) : object(p) {
-		auto radians = degrees_to_radians(angle);
-		sin_theta = sin(radians);
-		cos_theta = cos(radians);
-		bbox = object->bounding_box();
-
+	static aabb transform_box(const affine& m, const aabb& box) {
+		// Bounds the transformed corners of the box.
 		point3 min(infinity, infinity, infinity);
 		point3 max(-infinity, -infinity, -infinity);
 
 		for (int i = 0; i < 2; i++) {
 			for (int j = 0; j < 2; j++) {
 				for (int k = 0; k < 2; k++) {
-					auto x = i * bbox.x.max + (1 - i) * bbox.x.min;
-					auto y = j * bbox.y.max + (1 - j) * bbox.y.min;
-					auto z = k * bbox.z.max + (1 - k) * bbox.z.min;
-
-					auto newx = cos_theta * x + sin_theta * z;
-					auto newz = -sin_theta * x + cos_theta * z;
-
-					vec3 tester(newx, y, newz);
+					auto corner = m.point(point3(
+						i * box.x.max + (1 - i) * box.x.min,
+						j * box.y.max + (1 - j) * box.y.min,
+						k * box.z.max + (1 - k) * box.z.min));
 
 					for (int c = 0; c < 3; c++) {
-						min[c] = fmin(min[c], tester[c]);
-						max[c] = fmax(max[c], tester[c]);
+						min[c] = fmin(min[c], corner[c]);
+						max[c] = fmax(max[c], corner[c]);
 					}
 				}
 			}
 		}
 
-		bbox = aabb(min, max);
+		return aabb(min, max);
 	}
+};
 
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-		// Change the ray from world space to object space
-		auto origin = r.origin();
-		auto direction = r.direction();
-
-		origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-		origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
-
-		direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-		direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-
-		ray rotated_r(origin, direction, r.time());
-
-		// Determine where (if any) an intersection occurs in object space
-		if (!object->hit(rotated_r, ray_t, rec))
-			return false;
-
-		// Change the intersection point from object space to world space
-		auto p = rec.p;
-		p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
-		p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
-
-		// Change the normal from object space to world space
-		auto normal = rec.normal;
-		normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
-		normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
-
-		rec.p = p;
-		rec.normal = normal;
+class translate : public transform {
+public:
+	translate(shared_ptr<hittable> p, const vec3& displacement)
+		: transform(p, affine::translation(displacement))
+	{}
 
-		return true;
-	}
+	// Moving translation, from displacement_open at shutter open to displacement_close at close
+	translate(shared_ptr<hittable> p, const vec3& displacement_open, const vec3& displacement_close)
+		: transform(p, affine::translation(displacement_open), affine::translation(displacement_close))
+	{}
+};
 
-private:
-	shared_ptr<hittable> object;
-	double sin_theta;
-	double cos_theta;
-	aabb bbox;
+class rotate_y : public transform {
+public:
+	rotate_y(shared_ptr<hittable> p, double angle)
+		: transform(p, affine::rotation_y(angle))
+	{}
 };
 
 #endif
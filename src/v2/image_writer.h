@@ -0,0 +1,311 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+// Disable strict warnings for this header from the Microsoft Visual C++ compiler.
+#ifdef _MSC_VER
+#pragma warning (push, 0)
+#endif
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "external/stb_image_write.h"
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif
+
+#include "texel_format.h"
+#include "vec3.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <ppl.h>
+#include <string>
+#include <vector>
+
+enum class image_format {
+	ppm,  // Binary 8-bit PPM (P6)
+	png,  // 8-bit PNG
+	pfm,  // Linear 32-bit float Portable Float Map
+	hdr,  // Linear Radiance RGBE
+	exr   // Linear 32-bit float OpenEXR, with any number of layers
+};
+
+image_format format_from_file_name(const std::string& file_name) {
+	// Picks the output format from the file extension, defaulting to binary PPM.
+	auto dot = file_name.find_last_of('.');
+	auto ext = (dot == std::string::npos) ? std::string() : file_name.substr(dot + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+
+	if (ext == "png") return image_format::png;
+	if (ext == "pfm") return image_format::pfm;
+	if (ext == "hdr") return image_format::hdr;
+	if (ext == "exr") return image_format::exr;
+	return image_format::ppm;
+}
+
+inline unsigned char quantize_component(float linear_component) {
+	// Encodes with the sRGB transfer function, the inverse of the decode applied to sRGB textures.
+	return linear_to_srgb8(linear_component);
+}
+
+void quantize(const float* sums, int image_width, int rows, int samples_per_pixel, unsigned char* pixels) {
+	// Averages, sRGB-encodes and quantizes RGB sample sums to 8 bits, one scanline per task.
+	auto samples = static_cast<float>(samples_per_pixel);
+	auto row_size = static_cast<size_t>(image_width) * 3;
+
+	Concurrency::parallel_for(0, rows, [&](int j) {
+		for (size_t k = j * row_size; k < (j + 1) * row_size; k++)
+			pixels[k] = quantize_component(sums[k] / samples);
+		});
+}
+
+void normalize(const float* sums, int image_width, int rows, int samples_per_pixel, float* pixels) {
+	// Averages RGB sample sums into linear radiance, one scanline per task. Dividing rather than
+	// scaling by the reciprocal rounds like framebuffer::layer, so merged tile shards match it.
+	auto samples = static_cast<float>(samples_per_pixel);
+	auto row_size = static_cast<size_t>(image_width) * 3;
+
+	Concurrency::parallel_for(0, rows, [&](int j) {
+		for (size_t k = j * row_size; k < (j + 1) * row_size; k++)
+			pixels[k] = sums[k] / samples;
+		});
+}
+
+std::vector<unsigned char> quantize(const std::vector<float>& sums, int image_width, int image_height, int samples_per_pixel) {
+	std::vector<unsigned char> pixels(static_cast<size_t>(image_width) * image_height * 3);
+	quantize(sums.data(), image_width, image_height, samples_per_pixel, pixels.data());
+	return pixels;
+}
+
+std::vector<float> normalize(const std::vector<float>& sums, int image_width, int image_height, int samples_per_pixel) {
+	std::vector<float> pixels(static_cast<size_t>(image_width) * image_height * 3);
+	normalize(sums.data(), image_width, image_height, samples_per_pixel, pixels.data());
+	return pixels;
+}
+
+bool write_ppm(const std::string& file_name, const unsigned char* pixels, int image_width, int image_height) {
+	auto file = fopen(file_name.c_str(), "wb");
+	if (!file) return false;
+
+	fprintf(file, "P6\n%d %d\n255\n", image_width, image_height);
+	auto size = static_cast<size_t>(image_width) * image_height * 3;
+	bool ok = fwrite(pixels, 1, size, file) == size;
+	return (fclose(file) == 0) && ok;
+}
+
+bool write_pfm(const std::string& file_name, const float* pixels, int image_width, int image_height) {
+	// PFM stores scanlines bottom to top; a negative scale marks little-endian data.
+	auto file = fopen(file_name.c_str(), "wb");
+	if (!file) return false;
+
+	fprintf(file, "PF\n%d %d\n-1.0\n", image_width, image_height);
+	bool ok = true;
+	for (int j = image_height - 1; j >= 0 && ok; j--) {
+		auto row = pixels + static_cast<size_t>(j) * image_width * 3;
+		ok = fwrite(row, sizeof(float) * 3, image_width, file) == static_cast<size_t>(image_width);
+	}
+	return (fclose(file) == 0) && ok;
+}
+
+struct image_layer {
+	// Pixels of one layer of a multi-layer image, `channels.size()` floats per pixel in rows.
+	std::string name;      // Empty for the default layer
+	std::string channels;  // One letter per channel, e.g. "RGB", "XYZ" or "Z"
+	const float* pixels;
+};
+
+bool write_exr(const std::string& file_name, int image_width, int image_height, const std::vector<image_layer>& layers) {
+	// Uncompressed scanline OpenEXR with 32-bit float channels named <layer>.<letter>, which
+	// compositing tools show as layers. The format wants channels sorted by name, and each
+	// scanline to hold every channel's row in that order.
+	struct channel { std::string name; const float* pixels; int stride; };
+	std::vector<channel> channels;
+	for (const auto& layer : layers) {
+		for (size_t c = 0; c < layer.channels.size(); c++) {
+			auto name = layer.name.empty() ? std::string(1, layer.channels[c]) : layer.name + "." + layer.channels[c];
+			channels.push_back({ name, layer.pixels + c, static_cast<int>(layer.channels.size()) });
+		}
+	}
+	std::sort(channels.begin(), channels.end(), [](const channel& a, const channel& b) { return a.name < b.name; });
+
+	std::vector<unsigned char> header;
+	auto put = [&](const void* data, size_t size) {
+		auto bytes = static_cast<const unsigned char*>(data);
+		header.insert(header.end(), bytes, bytes + size);
+	};
+	auto put_int = [&](int32_t value) { put(&value, 4); };
+	auto put_attribute = [&](const char* name, const char* type, int32_t size) {
+		put(name, strlen(name) + 1);
+		put(type, strlen(type) + 1);
+		put_int(size);
+	};
+
+	const unsigned char magic[8] = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+	put(magic, 8);
+
+	int32_t list_size = 1;
+	for (const auto& c : channels)
+		list_size += static_cast<int32_t>(c.name.size()) + 1 + 16;
+	put_attribute("channels", "chlist", list_size);
+	for (const auto& c : channels) {
+		put(c.name.c_str(), c.name.size() + 1);
+		const int32_t description[4] = { 2, 0, 1, 1 };  // FLOAT, not linear and reserved bytes, x and y sampling
+		put(description, 16);
+	}
+	header.push_back(0);
+
+	put_attribute("compression", "compression", 1);
+	header.push_back(0);
+	const int32_t window[4] = { 0, 0, image_width - 1, image_height - 1 };
+	put_attribute("dataWindow", "box2i", 16);
+	put(window, 16);
+	put_attribute("displayWindow", "box2i", 16);
+	put(window, 16);
+	put_attribute("lineOrder", "lineOrder", 1);
+	header.push_back(0);
+	const float aspect = 1, center[2] = { 0, 0 }, width = 1;
+	put_attribute("pixelAspectRatio", "float", 4);
+	put(&aspect, 4);
+	put_attribute("screenWindowCenter", "v2f", 8);
+	put(center, 8);
+	put_attribute("screenWindowWidth", "float", 4);
+	put(&width, 4);
+	header.push_back(0);
+
+	// One chunk per scanline, located by a table of file offsets after the header.
+	auto row_bytes = static_cast<int32_t>(channels.size() * image_width * sizeof(float));
+	auto first_chunk = static_cast<uint64_t>(header.size()) + 8ull * image_height;
+	for (int y = 0; y < image_height; y++) {
+		uint64_t offset = first_chunk + static_cast<uint64_t>(y) * (8 + row_bytes);
+		put(&offset, 8);
+	}
+
+	auto file = fopen(file_name.c_str(), "wb");
+	if (!file) return false;
+	bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+
+	std::vector<float> row(channels.size() * image_width);
+	for (int y = 0; y < image_height && ok; y++) {
+		for (size_t c = 0; c < channels.size(); c++) {
+			auto source = channels[c].pixels + static_cast<size_t>(y) * image_width * channels[c].stride;
+			for (int x = 0; x < image_width; x++)
+				row[c * image_width + x] = source[static_cast<size_t>(x) * channels[c].stride];
+		}
+		const int32_t chunk[2] = { y, row_bytes };
+		ok = fwrite(chunk, 4, 2, file) == 2 && fwrite(row.data(), sizeof(float), row.size(), file) == row.size();
+	}
+	return (fclose(file) == 0) && ok;
+}
+
+bool write_image(const std::string& file_name, const std::vector<float>& sums, int image_width, int image_height, int samples_per_pixel) {
+	// Writes a buffer of per-pixel RGB sample sums in the format implied by the file extension.
+	bool ok = false;
+
+	switch (format_from_file_name(file_name)) {
+	case image_format::ppm:
+		ok = write_ppm(file_name, quantize(sums, image_width, image_height, samples_per_pixel).data(), image_width, image_height);
+		break;
+	case image_format::png:
+		ok = stbi_write_png(file_name.c_str(), image_width, image_height, 3,
+			quantize(sums, image_width, image_height, samples_per_pixel).data(), image_width * 3) != 0;
+		break;
+	case image_format::pfm:
+		ok = write_pfm(file_name, normalize(sums, image_width, image_height, samples_per_pixel).data(), image_width, image_height);
+		break;
+	case image_format::hdr:
+		ok = stbi_write_hdr(file_name.c_str(), image_width, image_height, 3,
+			normalize(sums, image_width, image_height, samples_per_pixel).data()) != 0;
+		break;
+	case image_format::exr:
+		ok = write_exr(file_name, image_width, image_height,
+			{ { "", "RGB", normalize(sums, image_width, image_height, samples_per_pixel).data() } });
+		break;
+	}
+
+	if (!ok)
+		std::cerr << "ERROR: Could not write output file '" << file_name << "'.\n";
+	return ok;
+}
+
+inline int seek_file(FILE* file, long long offset) {
+	// Seeks with 64-bit offsets, since streamed frames can exceed 2 GB.
+#ifdef _MSC_VER
+	return _fseeki64(file, offset, SEEK_SET);
+#else
+	return fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+}
+
+class image_stream {
+	// Writes an image band by band as rows are completed, so the whole frame never has to be in
+	// memory. Only formats with a fixed row layout can be streamed: binary PPM and PFM.
+public:
+	image_stream(const std::string& file_name, int image_width, int image_height, int samples_per_pixel)
+		: format(format_from_file_name(file_name)), width(image_width), height(image_height), spp(samples_per_pixel)
+	{
+		file = supports(file_name) ? fopen(file_name.c_str(), "wb") : nullptr;
+		if (!file) {
+			std::cerr << "ERROR: Could not open output file '" << file_name << "' for streaming.\n";
+			return;
+		}
+
+		if (format == image_format::ppm)
+			fprintf(file, "P6\n%d %d\n255\n", width, height);
+		else
+			fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+		data_offset = ftell(file);
+	}
+
+	~image_stream() { close(); }
+
+	static bool supports(const std::string& file_name) {
+		auto format = format_from_file_name(file_name);
+		return format == image_format::ppm || format == image_format::pfm;
+	}
+
+	bool is_open() const { return file != nullptr; }
+
+	bool write_rows(const float* sums, int first_row, int row_count) {
+		// Appends `row_count` completed scanlines of RGB sample sums starting at image row `first_row`.
+		if (!file) return false;
+		auto row_size = static_cast<size_t>(width) * 3;
+
+		if (format == image_format::ppm) {
+			bytes.resize(row_size * row_count);
+			quantize(sums, width, row_count, spp, bytes.data());
+			ok = ok && fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+			return ok;
+		}
+
+		// PFM scanlines run bottom to top, so each row is placed at its final offset.
+		floats.resize(row_size * row_count);
+		normalize(sums, width, row_count, spp, floats.data());
+		for (int j = 0; j < row_count && ok; j++) {
+			auto offset = data_offset + static_cast<long long>(height - 1 - (first_row + j)) * row_size * sizeof(float);
+			ok = seek_file(file, offset) == 0
+				&& fwrite(&floats[j * row_size], sizeof(float), row_size, file) == row_size;
+		}
+		return ok;
+	}
+
+	bool close() {
+		if (file) {
+			ok = (fclose(file) == 0) && ok;
+			file = nullptr;
+		}
+		return ok;
+	}
+
+private:
+	image_format format;
+	int width, height, spp;
+	FILE* file;
+	long long data_offset = 0;
+	bool ok = true;
+	std::vector<unsigned char> bytes;  // Scratch space for one quantized band
+	std::vector<float> floats;         // Scratch space for one normalized band
+};
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include "hittable.h"
+#include "material.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+struct light_bounds {
+	// Bounds of one light or a cluster of lights: total emitted power, bounding box, and the
+	// cone of emitter normals (axis and cosine of its half angle theta_o). Two-sided emitters
+	// shine on both sides of the cone.
+	aabb bounds;
+	double phi = 0;
+	vec3 axis = vec3(0, 0, 1);
+	double cos_theta_o = 1;
+	bool two_sided = false;
+
+	point3 centroid() const {
+		return point3((bounds.x.min + bounds.x.max) / 2, (bounds.y.min + bounds.y.max) / 2, (bounds.z.min + bounds.z.max) / 2);
+	}
+
+	double importance(const point3& p, const vec3& n) const {
+		// Conservative estimate of the light reaching p from this cluster (Conty Estevez and
+		// Kulla 2018, in the form used by PBRT v4): power over squared distance, scaled by the
+		// smallest possible angle between the cone and the direction to p, and by the smallest
+		// possible angle to the receiving normal n. A zero n skips the receiver term.
+		auto cos_sub_clamped = [](double sin_a, double cos_a, double sin_b, double cos_b) {
+			return (cos_a > cos_b) ? 1.0 : cos_a * cos_b + sin_a * sin_b;
+		};
+		auto sin_sub_clamped = [](double sin_a, double cos_a, double sin_b, double cos_b) {
+			return (cos_a > cos_b) ? 0.0 : sin_a * cos_b - cos_a * sin_b;
+		};
+		auto sin_from_cos = [](double c) { return std::sqrt(std::max(0.0, 1 - c * c)); };
+
+		auto pc = centroid();
+		auto diagonal = vec3(bounds.x.size(), bounds.y.size(), bounds.z.size()).length();
+		auto distance_squared = (p - pc).length_squared();
+		auto d2 = std::max(distance_squared, diagonal / 2);
+
+		// Angle between the cone axis and the direction to p, less the cone spread.
+		auto wi = (distance_squared > 0) ? (p - pc) / std::sqrt(distance_squared) : vec3(0, 0, 0);
+		auto cos_theta_w = dot(axis, wi);
+		if (two_sided) cos_theta_w = std::fabs(cos_theta_w);
+		auto sin_theta_w = sin_from_cos(cos_theta_w);
+
+		// Angle subtended by the bounds' sphere as seen from p.
+		auto radius_squared = diagonal * diagonal / 4;
+		auto cos_theta_b = (distance_squared < radius_squared) ? -1.0 : std::sqrt(1 - radius_squared / distance_squared);
+		auto sin_theta_b = sin_from_cos(cos_theta_b);
+
+		auto cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_from_cos(cos_theta_o), cos_theta_o);
+		auto sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_from_cos(cos_theta_o), cos_theta_o);
+		auto cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+
+		// Diffuse emitters send nothing past 90 degrees from their normal.
+		if (cos_theta_p <= 0)
+			return 0;
+
+		auto result = phi * cos_theta_p / d2;
+		if (n.length_squared() > 0) {
+			auto cos_theta_i = std::fabs(dot(wi, n));
+			result *= cos_sub_clamped(sin_from_cos(cos_theta_i), cos_theta_i, sin_theta_b, cos_theta_b);
+		}
+		return std::max(result, 0.0);
+	}
+};
+
+inline light_bounds union_bounds(const light_bounds& a, const light_bounds& b) {
+	// Merges boxes, powers and normal cones.
+	if (a.phi == 0) return b;
+	if (b.phi == 0) return a;
+
+	light_bounds u;
+	u.bounds = aabb(a.bounds, b.bounds);
+	u.phi = a.phi + b.phi;
+	u.two_sided = a.two_sided || b.two_sided;
+
+	// Smallest cone around both cones, or the whole sphere.
+	auto theta_a = std::acos(std::clamp(a.cos_theta_o, -1.0, 1.0));
+	auto theta_b = std::acos(std::clamp(b.cos_theta_o, -1.0, 1.0));
+	auto theta_d = std::acos(std::clamp(dot(a.axis, b.axis), -1.0, 1.0));
+
+	if (std::min(theta_d + theta_b, pi) <= theta_a) {
+		u.axis = a.axis;
+		u.cos_theta_o = a.cos_theta_o;
+		return u;
+	}
+	if (std::min(theta_d + theta_a, pi) <= theta_b) {
+		u.axis = b.axis;
+		u.cos_theta_o = b.cos_theta_o;
+		return u;
+	}
+
+	auto theta_o = (theta_a + theta_d + theta_b) / 2;
+	auto rotation_axis = cross(a.axis, b.axis);
+	if (theta_o >= pi || rotation_axis.length_squared() == 0) {
+		u.axis = a.axis;
+		u.cos_theta_o = -1;
+		return u;
+	}
+
+	// Rotate a's axis towards b's by theta_o - theta_a (Rodrigues' formula).
+	auto k = unit_vector(rotation_axis);
+	auto theta_r = theta_o - theta_a;
+	u.axis = unit_vector(a.axis * std::cos(theta_r) + cross(k, a.axis) * std::sin(theta_r)
+		+ k * dot(k, a.axis) * (1 - std::cos(theta_r)));
+	u.cos_theta_o = std::cos(theta_o);
+	return u;
+}
+
+class light_bvh {
+	// Hierarchy over the emitters of a scene for many-light sampling. Each node bounds the
+	// position, emitter orientation and power of the lights below it, and sampling walks from
+	// the root choosing children in proportion to their importance at the shading point. A
+	// light is chosen in O(log n), with a probability that roughly follows its contribution, and
+	// the probability of any given light is recovered by replaying its path from the root.
+public:
+	light_bvh(const hittable_list& candidates) {
+		// Keeps the objects that describe themselves as lights and emit something.
+		std::vector<entry> entries;
+		for (const auto& object : candidates.objects) {
+			light_shape shape;
+			if (!object->get_light_shape(shape) || !shape.mat)
+				continue;
+
+			auto le = shape.mat->emitted(0.5, 0.5, shape.center);
+			auto luminance = 0.2126 * le.x() + 0.7152 * le.y() + 0.0722 * le.z();
+			if (luminance <= 0)
+				continue;
+
+			light_bounds b;
+			b.bounds = shape.bounds;
+			b.phi = pi * shape.area * luminance * (shape.two_sided ? 2 : 1);
+			b.axis = shape.axis;
+			b.cos_theta_o = shape.cos_theta_o;
+			b.two_sided = shape.two_sided;
+
+			entries.push_back({ b, static_cast<uint32_t>(lights.size()) });
+			lights.push_back(object);
+		}
+
+		if (!entries.empty())
+			build(entries, 0, entries.size(), 0, 0);
+	}
+
+	size_t size() const { return lights.size(); }
+	bool empty() const { return lights.empty(); }
+	bool contains(const hittable* light) const { return trails.count(light) != 0; }
+	const hittable& light(size_t i) const { return *lights[i]; }
+
+	bool sample(const point3& p, const vec3& n, double u, const hittable*& light, double& pmf) const {
+		// Picks a light for the shading point p with normal n (zero inside media) using the
+		// uniform number u. Returns false if no light can contribute.
+		if (nodes.empty())
+			return false;
+
+		uint32_t index = 0;
+		pmf = 1;
+		while (!nodes[index].leaf) {
+			auto left = index + 1, right = nodes[index].child_or_light;
+			auto c0 = nodes[left].bounds.importance(p, n);
+			auto c1 = nodes[right].bounds.importance(p, n);
+			if (c0 == 0 && c1 == 0)
+				return false;
+
+			auto p0 = c0 / (c0 + c1);
+			if (u < p0) {
+				index = left;
+				u = std::min(u / p0, 1 - 1e-12);
+				pmf *= p0;
+			}
+			else {
+				index = right;
+				u = std::min((u - p0) / (1 - p0), 1 - 1e-12);
+				pmf *= 1 - p0;
+			}
+		}
+
+		if (index == 0 && nodes[0].bounds.importance(p, n) == 0)
+			return false;
+		light = lights[nodes[index].child_or_light].get();
+		return true;
+	}
+
+	double pmf(const point3& p, const vec3& n, const hittable* light) const {
+		// Probability that sample() picks `light` at p; zero for objects that are not lights.
+		auto found = trails.find(light);
+		if (found == trails.end())
+			return 0;
+
+		auto trail = found->second;
+		uint32_t index = 0;
+		double result = 1;
+		while (!nodes[index].leaf) {
+			auto left = index + 1, right = nodes[index].child_or_light;
+			auto c0 = nodes[left].bounds.importance(p, n);
+			auto c1 = nodes[right].bounds.importance(p, n);
+			if (c0 == 0 && c1 == 0)
+				return 0;
+
+			bool go_right = trail & 1;
+			result *= (go_right ? c1 : c0) / (c0 + c1);
+			index = go_right ? right : left;
+			trail >>= 1;
+		}
+
+		if (index == 0 && nodes[0].bounds.importance(p, n) == 0)
+			return 0;
+		return result;
+	}
+
+private:
+	struct entry {
+		light_bounds bounds;
+		uint32_t light;
+	};
+
+	struct node {
+		light_bounds bounds;
+		uint32_t child_or_light;  // Interior: index of the right child (the left follows the node). Leaf: light index.
+		bool leaf;
+	};
+
+	std::vector<shared_ptr<hittable>> lights;
+	std::vector<node> nodes;
+	std::unordered_map<const hittable*, uint64_t> trails;  // Per light, the right turns from the root as bits
+
+	uint32_t build(std::vector<entry>& entries, size_t begin, size_t end, uint64_t trail, int depth) {
+		// Splits at the median centroid along the widest axis, depth first. Median splits keep
+		// the depth at log2 of the light count, well within the 64 turns a trail can hold.
+		auto index = static_cast<uint32_t>(nodes.size());
+		nodes.push_back({});
+
+		if (end - begin == 1) {
+			nodes[index] = { entries[begin].bounds, entries[begin].light, true };
+			trails[lights[entries[begin].light].get()] = trail;
+			return index;
+		}
+
+		light_bounds merged;
+		aabb centroids;
+		for (size_t i = begin; i < end; i++) {
+			merged = union_bounds(merged, entries[i].bounds);
+			auto c = entries[i].bounds.centroid();
+			centroids = aabb(centroids, aabb(c, c));
+		}
+
+		int axis = 0;
+		for (int a = 1; a < 3; a++)
+			if (centroids.axis(a).size() > centroids.axis(axis).size()) axis = a;
+
+		auto mid = begin + (end - begin) / 2;
+		std::nth_element(entries.begin() + begin, entries.begin() + mid, entries.begin() + end,
+			[axis](const entry& a, const entry& b) { return a.bounds.centroid()[axis] < b.bounds.centroid()[axis]; });
+
+		build(entries, begin, mid, trail, depth + 1);
+		auto right = build(entries, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+		nodes[index] = { merged, right, false };
+		return index;
+	}
+};
+
+#endif
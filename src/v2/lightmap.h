@@ -0,0 +1,243 @@
+#ifndef LIGHTMAP_H
+#define LIGHTMAP_H
+
+#include "hittable.h"
+#include "material.h"
+#include "mesh.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Baked lighting for static scenes rendered from many views. A lightmap covers the (u, v) square
+// of a quad or of a mesh's texture coordinates with texels that hold the light the surface
+// reflects per unit albedo, less the share that next event estimation adds when rendering. A
+// view render that hits a baked diffuse surface samples the lights there for sharp shadows and
+// takes everything else from the lightmap instead of tracing further bounces.
+
+class lightmap {
+	// Texels in rows of increasing v, one layer per side: quads are baked on both faces, meshes
+	// on the side their geometric normals face. Mesh texels are assigned the triangle their
+	// center falls in, in uv space; texels no triangle covers take their neighbors' values so
+	// filtering along chart edges does not fetch black.
+public:
+	lightmap(const quad* _plane, int _width, int _height)
+		: plane(_plane), w(_width), h(_height), side_count(2),
+		rgb(static_cast<size_t>(_width) * _height * 2 * 3, 0.0f), covered(static_cast<size_t>(_width) * _height * 2, 1) {}
+
+	lightmap(const triangle_mesh* _mesh, int _width, int _height)
+		: mesh(_mesh), w(_width), h(_height), side_count(1),
+		rgb(static_cast<size_t>(_width) * _height * 3, 0.0f), covered(static_cast<size_t>(_width) * _height, 0),
+		triangle(static_cast<size_t>(_width) * _height, -1)
+	{
+		for (uint32_t tri = 0; tri < mesh->triangle_count(); tri++) {
+			double uv[3][2];
+			mesh->triangle_uvs(tri, uv);
+			auto x0 = std::max(0, static_cast<int>(std::floor(std::min({ uv[0][0], uv[1][0], uv[2][0] }) * w)));
+			auto x1 = std::min(w - 1, static_cast<int>(std::floor(std::max({ uv[0][0], uv[1][0], uv[2][0] }) * w)));
+			auto y0 = std::max(0, static_cast<int>(std::floor(std::min({ uv[0][1], uv[1][1], uv[2][1] }) * h)));
+			auto y1 = std::min(h - 1, static_cast<int>(std::floor(std::max({ uv[0][1], uv[1][1], uv[2][1] }) * h)));
+			for (int y = y0; y <= y1; y++) {
+				for (int x = x0; x <= x1; x++) {
+					double b1, b2;
+					if (barycentric(uv, (x + 0.5) / w, (y + 0.5) / h, b1, b2)) {
+						auto n = static_cast<size_t>(y) * w + x;
+						triangle[n] = static_cast<int32_t>(tri);
+						covered[n] = 1;
+					}
+				}
+			}
+		}
+	}
+
+	int width() const { return w; }
+	int height() const { return h; }
+	size_t texel_count() const { return static_cast<size_t>(w) * h * side_count; }
+
+	bool sample_point(size_t texel, hit_record& rec) const {
+		// A random point within the texel, facing the texel's side. False for texels no
+		// triangle covers.
+		auto side = static_cast<int>(texel / (static_cast<size_t>(w) * h));
+		auto n = texel % (static_cast<size_t>(w) * h);
+		auto u = (n % w + random_double()) / w;
+		auto v = (n / w + random_double()) / h;
+
+		if (plane) {
+			plane->surface_point(u, v, rec);
+		}
+		else {
+			auto tri = triangle[n];
+			if (tri < 0)
+				return false;
+			double uv[3][2], b1 = 1.0 / 3, b2 = 1.0 / 3;
+			mesh->triangle_uvs(tri, uv);
+			if (!barycentric(uv, u, v, b1, b2))
+				barycentric(uv, (n % w + 0.5) / w, (n / w + 0.5) / h, b1, b2);
+			mesh->surface_point(tri, b1, b2, rec);
+		}
+
+		if (side == 1) {
+			rec.normal = -rec.normal;
+			rec.front_face = false;
+		}
+		return true;
+	}
+
+	void store(size_t texel, const color& reflected) {
+		for (int c = 0; c < 3; c++)
+			rgb[texel * 3 + c] = static_cast<float>(reflected[c]);
+	}
+
+	void fill_gaps(int passes = 2) {
+		// Gives uncovered texels next to covered ones the average of those neighbors, `passes`
+		// texels deep.
+		for (int pass = 0; pass < passes; pass++) {
+			auto was_covered = covered;
+			for (int y = 0; y < h; y++) {
+				for (int x = 0; x < w; x++) {
+					auto n = static_cast<size_t>(y) * w + x;
+					if (was_covered[n])
+						continue;
+					color sum(0, 0, 0);
+					int count = 0;
+					for (int dy = -1; dy <= 1; dy++) {
+						for (int dx = -1; dx <= 1; dx++) {
+							int nx = x + dx, ny = y + dy;
+							if (nx < 0 || ny < 0 || nx >= w || ny >= h || !was_covered[static_cast<size_t>(ny) * w + nx])
+								continue;
+							auto t = &rgb[(static_cast<size_t>(ny) * w + nx) * 3];
+							sum += color(t[0], t[1], t[2]);
+							count++;
+						}
+					}
+					if (count > 0) {
+						store(n, sum / count);
+						covered[n] = 1;
+					}
+				}
+			}
+		}
+	}
+
+	bool value(const hit_record& rec, color& reflected) const {
+		// Bilinearly filtered at the hit's (u, v), on the side the ray arrived from.
+		auto side = rec.front_face ? 0 : 1;
+		if (side >= side_count)
+			return false;
+
+		auto x = std::clamp(rec.u * w - 0.5, 0.0, w - 1.0);
+		auto y = std::clamp(rec.v * h - 0.5, 0.0, h - 1.0);
+		auto x0 = static_cast<int>(x), y0 = static_cast<int>(y);
+		auto x1 = std::min(x0 + 1, w - 1), y1 = std::min(y0 + 1, h - 1);
+		auto fx = x - x0, fy = y - y0;
+		auto layer = static_cast<size_t>(side) * w * h;
+		auto texel = [&](int tx, int ty) {
+			auto t = &rgb[(layer + static_cast<size_t>(ty) * w + tx) * 3];
+			return color(t[0], t[1], t[2]);
+		};
+		reflected = (1 - fy) * ((1 - fx) * texel(x0, y0) + fx * texel(x1, y0)) + fy * ((1 - fx) * texel(x0, y1) + fx * texel(x1, y1));
+		return true;
+	}
+
+private:
+	const quad* plane = nullptr;
+	const triangle_mesh* mesh = nullptr;
+	int w, h, side_count;
+	std::vector<float> rgb;
+	std::vector<uint8_t> covered;    // Per texel of the first layer, for meshes
+	std::vector<int32_t> triangle;   // Per texel of meshes, -1 where none
+
+	static bool barycentric(const double uv[3][2], double u, double v, double& b1, double& b2) {
+		auto e1u = uv[1][0] - uv[0][0], e1v = uv[1][1] - uv[0][1];
+		auto e2u = uv[2][0] - uv[0][0], e2v = uv[2][1] - uv[0][1];
+		auto det = e1u * e2v - e1v * e2u;
+		if (det == 0)
+			return false;
+		auto pu = u - uv[0][0], pv = v - uv[0][1];
+		b1 = (pu * e2v - pv * e2u) / det;
+		b2 = (e1u * pv - e1v * pu) / det;
+		return b1 >= 0 && b2 >= 0 && b1 + b2 <= 1;
+	}
+};
+
+class lightmap_set {
+	// The lightmaps of a scene, found by the primitive a ray hit.
+public:
+	bool add(const shared_ptr<quad>& q, double texels_per_unit) {
+		hit_record corner, u_end, v_end;
+		q->surface_point(0, 0, corner);
+		q->surface_point(1, 0, u_end);
+		q->surface_point(0, 1, v_end);
+		if (!diffuse(corner))
+			return false;
+		return insert(q, lightmap(q.get(), resolution((u_end.p - corner.p).length() * texels_per_unit),
+			resolution((v_end.p - corner.p).length() * texels_per_unit)));
+	}
+
+	bool add(const shared_ptr<triangle_mesh>& m, double texels_per_unit) {
+		// Needs texture coordinates that lay the mesh out without overlaps.
+		if (!m->has_uvs() || m->triangle_count() == 0)
+			return false;
+		hit_record probe;
+		m->surface_point(0, 1.0 / 3, 1.0 / 3, probe);
+		if (!diffuse(probe))
+			return false;
+
+		double area = 0;
+		for (uint32_t tri = 0; tri < m->triangle_count(); tri++) {
+			hit_record p0, p1, p2;
+			m->surface_point(tri, 0, 0, p0);
+			m->surface_point(tri, 1, 0, p1);
+			m->surface_point(tri, 0, 1, p2);
+			area += cross(p1.p - p0.p, p2.p - p0.p).length() / 2;
+		}
+		auto size = resolution(std::sqrt(area) * texels_per_unit);
+		return insert(m, lightmap(m.get(), size, size));
+	}
+
+	size_t add_all(const hittable_list& list, double texels_per_unit) {
+		// Adds the diffuse quads and meshes among the list's objects. Objects inside other
+		// objects, such as instanced boxes, are left out.
+		size_t added = 0;
+		for (const auto& object : list.objects) {
+			if (auto q = std::dynamic_pointer_cast<quad>(object))
+				added += add(q, texels_per_unit);
+			else if (auto m = std::dynamic_pointer_cast<triangle_mesh>(object))
+				added += add(m, texels_per_unit);
+		}
+		return added;
+	}
+
+	size_t size() const { return maps.size(); }
+	lightmap& operator[](size_t i) { return maps[i]; }
+
+	bool value(const hit_record& rec, color& reflected) const {
+		auto found = index.find(rec.object);
+		return found != index.end() && maps[found->second].value(rec, reflected);
+	}
+
+private:
+	std::vector<lightmap> maps;
+	std::vector<shared_ptr<hittable>> owners;  // Keep the baked primitives alive
+	std::unordered_map<const hittable*, size_t> index;
+
+	static int resolution(double texels) {
+		return std::clamp(static_cast<int>(std::ceil(texels)), 1, 4096);
+	}
+
+	static bool diffuse(const hit_record& rec) {
+		return rec.mat && rec.mat->scattering_pdf(ray(rec.p + rec.normal, -rec.normal, 0.0), rec, ray(rec.p, rec.normal, 0.0)) > 0;
+	}
+
+	bool insert(const shared_ptr<hittable>& object, lightmap map) {
+		if (index.count(object.get()))
+			return false;
+		index[object.get()] = maps.size();
+		maps.push_back(std::move(map));
+		owners.push_back(object);
+		return true;
+	}
+};
+
+#endif
@@ -7,12 +7,73 @@
 #include "material.h"
 #include <iostream>
 #include "bvh.h"
+#include "registry.h"
+#include "mesh.h"
+#include "sphere_set.h"
+#include "volume.h"
+#include "environment.h"
+#include "session.h"
 #include <windows.h>
 
 #include <string>
+#include <cstring>
+
+
+shard_config render_shard;     // Set from the command line when this process is one of several workers
+bool render_streaming = false; // Set from the command line to stream bands to disk
+int denoise_passes = -1;       // Set from the command line to override the scene's denoising
+std::vector<aov> output_aovs;  // Set from the command line to add channels to the output
+bool interactive = false;      // Set from the command line to take camera edits from stdin
+bool render_failed = false;    // Set when an output file could not be written
+integrator_mode render_integrator = integrator_mode::path_tracing;  // Set from the command line to pick the integrator
+bool restir_biased = false;    // Set from the command line to merge reservoirs without shadow rays
+int photon_paths = 0;          // Set from the command line to trace a caustic photon map
+double cache_cell_size = 0;    // Set from the command line to cache diffuse light in cells this wide
+double lightmap_texels = 0;    // Set from the command line to bake lightmaps with this many texels per unit
+int samples_override = 0;      // Set from the command line to override the scene's samples per pixel
+std::string output_name;       // Set from the command line to override the scene's output file
+
+void apply_command_line(camera& cam) {
+	cam.shard = render_shard;
+	cam.streaming = render_streaming;
+	if (denoise_passes >= 0)
+		cam.denoising.passes = denoise_passes;
+	cam.aovs.insert(cam.aovs.end(), output_aovs.begin(), output_aovs.end());
+	cam.integrator = render_integrator;
+	cam.restir.unbiased = !restir_biased;
+	cam.photons.paths = photon_paths;
+	if (cache_cell_size > 0)
+		cam.cache = make_shared<radiance_cache>(radiance_cache_settings{ cache_cell_size });
+	if (samples_override > 0)
+		cam.samples_per_pixel = samples_override;
+	if (!output_name.empty())
+		cam.file_name = output_name;
+}
 
+void render_scene(camera& cam, const hittable_list& world, const hittable_list& objects) {
+	// Renders once, or keeps the scene loaded and re-renders as commands on stdin edit the camera.
+	// Lightmaps are baked for the quads and meshes in `objects`, the scene's list before it was
+	// put into a BVH.
+	apply_command_line(cam);
+	if (lightmap_texels > 0) {
+		auto baked = make_shared<lightmap_set>();
+		if (baked->add_all(objects, lightmap_texels) > 0) {
+			cam.bake_lightmaps(world, *baked);
+			cam.lightmaps = baked;
+		}
+		else {
+			std::clog << "Nothing to bake: lightmaps need diffuse quads, or meshes with texture coordinates. "
+				"Rendering without them.\n";
+		}
+	}
+	bool written = interactive ? render_session(cam, world).run(std::cin) : cam.render(world);
+	if (!written)
+		render_failed = true;
+}
 
-
+void render_scene(camera& cam, const hittable_list& world) {
+	render_scene(cam, world, world);
+}
 
 void random_spheres() {
 
@@ -29,10 +90,14 @@ void random_spheres() {
 	// World
 
 	hittable_list world;
+	scene_registry registry;
+	std::vector<aabb> casters;  // Glass and metal spheres, which focus light into caustics
 
-	auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+	auto checker = registry.checker(0.32, color(.2, .3, .1), color(.9, .9, .9));
+	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, registry.lambertian(checker)));
 
+	// The small spheres share one SoA sphere set instead of ~480 individual objects.
+	sphere_set_data small_spheres;
 	for (int a = -11; a < 11; a++) {
 		for (int b = -11; b < 11; b++) {
 			auto choose_mat = random_double();
@@ -44,35 +109,44 @@ void random_spheres() {
 				if (choose_mat < 0.8) {
 					// diffuse
 					auto albedo = color::random() * color::random();
-					sphere_material = make_shared<lambertian>(albedo);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = registry.lambertian(albedo);
+					small_spheres.add(center, 0.2, sphere_material);
 				}
 				else if (choose_mat < 0.95) {
 					// metal
 					auto albedo = color::random(0.5, 1);
 					auto fuzz = random_double(0, 0.5);
-					sphere_material = make_shared<metal>(albedo, fuzz);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = registry.metal(albedo, fuzz);
+					small_spheres.add(center, 0.2, sphere_material);
+					casters.push_back(aabb(center - vec3(0.2, 0.2, 0.2), center + vec3(0.2, 0.2, 0.2)));
 				}
 				else {
 					// glass
-					sphere_material = make_shared<dielectric>(1.5);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+					sphere_material = registry.dielectric(1.5);
+					small_spheres.add(center, 0.2, sphere_material);
+					casters.push_back(aabb(center - vec3(0.2, 0.2, 0.2), center + vec3(0.2, 0.2, 0.2)));
 				}
 			}
 		}
 	}
 
-	auto material1 = make_shared<dielectric>(1.5);
+	world.add(make_shared<sphere_set>(small_spheres));
+
+	auto material1 = registry.dielectric(1.5);
 	world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+	casters.push_back(aabb(point3(-1, 0, -1), point3(1, 2, 1)));
 
-	auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
+	auto material2 = registry.lambertian(color(0.4, 0.2, 0.1));
 	world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
 
-	auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+	auto material3 = registry.metal(color(0.7, 0.6, 0.5), 0.0);
 	world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+	casters.push_back(aabb(point3(3, 0, -1), point3(5, 2, 1)));
 
 
+	registry.report(std::clog);
+
+	auto objects = world;
 	auto p = make_shared<bvh_node>(world);
 
 	world = hittable_list(p);
@@ -95,14 +169,17 @@ void random_spheres() {
 	cam.focus_dist = 10.0;
 	cam.file_name = "v2_random_spheres.ppm";
 
-	cam.render(world);
+	cam.caustic_casters = casters;
+
+	render_scene(cam, world, objects);
 
 
 }
 
 void earth() {
-	auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-	auto earth_surface = make_shared<lambertian>(earth_texture);
+	scene_registry registry;
+	auto earth_texture = registry.image("earthmap.jpg");
+	auto earth_surface = registry.lambertian(earth_texture);
 	auto globe = make_shared<sphere>(point3(0, 0, 0), 2, earth_surface);
 
 	camera cam;
@@ -120,10 +197,43 @@ void earth() {
 	cam.defocus_angle = 0;
 	cam.file_name = "earth.ppm";
 
-	cam.render(hittable_list(globe));
+	render_scene(cam, hittable_list(globe));
 }
 
 
+void draw_mesh(const char* filename) {
+	hittable_list world;
+	scene_registry registry;
+
+	auto mesh = load_triangle_mesh(filename, registry.lambertian(color(0.73, 0.73, 0.73)));
+	if (!mesh) return;
+	world.add(mesh);
+	world.add(make_shared<sphere>(point3(0, -1000, 0), 999, registry.lambertian(color(0.4, 0.4, 0.4))));
+	auto objects = world;
+	world = hittable_list(make_shared<bvh_node>(world));
+
+	// Frame the mesh from its bounding box.
+	auto bounds = mesh->bounding_box();
+	auto center = point3((bounds.x.min + bounds.x.max) / 2, (bounds.y.min + bounds.y.max) / 2, (bounds.z.min + bounds.z.max) / 2);
+	auto radius = vec3(bounds.x.size(), bounds.y.size(), bounds.z.size()).length() / 2;
+
+	camera cam;
+
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 400;
+	cam.samples_per_pixel = 100;
+	cam.max_depth = 50;
+
+	cam.vfov = 30;
+	cam.lookat = center;
+	cam.lookfrom = center + vec3(0, 0.5, 1) * (2.5 * radius);
+	cam.vup = vec3(0, 1, 0);
+
+	cam.defocus_angle = 0;
+	cam.file_name = "mesh.ppm";
+	render_scene(cam, world, objects);
+}
+
 void draw_quad() {
 	hittable_list world;
 
@@ -155,16 +265,17 @@ void draw_quad() {
 
 	cam.defocus_angle = 0;
 	cam.file_name = "quad.ppm";
-	cam.render(world);
+	render_scene(cam, world);
 }
 
 void draw_cornell_box() {
 	hittable_list world;
+	scene_registry registry;
 
-	auto red = make_shared<lambertian>(color(.65, .05, .05));
-	auto white = make_shared<lambertian>(color(.73, .73, .73));
-	auto green = make_shared<lambertian>(color(.12, .45, .15));
-	auto light = make_shared<diffuse_light>(color(15, 15, 15));
+	auto red = registry.lambertian(color(.65, .05, .05));
+	auto white = registry.lambertian(color(.73, .73, .73));
+	auto green = registry.lambertian(color(.12, .45, .15));
+	auto light = registry.diffuse_light(color(15, 15, 15));
 
 	world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
 	world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
@@ -173,15 +284,8 @@ void draw_cornell_box() {
 	world.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
 	world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
 
-	shared_ptr<hittable> box1 = box(point3(0, 0, 0), point3(165, 330, 165), white);
-	box1 = make_shared<rotate_y>(box1, 15);
-	box1 = make_shared<translate>(box1, vec3(265, 0, 295));
-	world.add(box1);
-
-	shared_ptr<hittable> box2 = box(point3(0, 0, 0), point3(165, 165, 165), white);
-	box2 = make_shared<rotate_y>(box2, -18);
-	box2 = make_shared<translate>(box2, vec3(130, 0, 65));
-	world.add(box2);
+	world.add(box(point3(0, 0, 0), point3(165, 330, 165), white, 15, vec3(265, 0, 295)));
+	world.add(box(point3(0, 0, 0), point3(165, 165, 165), white, -18, vec3(130, 0, 65)));
 	camera cam;
 
 	cam.aspect_ratio = 1.0;
@@ -197,20 +301,269 @@ void draw_cornell_box() {
 
 	cam.defocus_angle = 0;
 	cam.file_name = "cornell_box.ppm";
-	cam.render(world);
+	cam.lights = make_shared<light_bvh>(world);
+	render_scene(cam, world);
+}
+
+void draw_cornell_smoke() {
+	hittable_list world;
+	scene_registry registry;
+
+	auto red = registry.lambertian(color(.65, .05, .05));
+	auto white = registry.lambertian(color(.73, .73, .73));
+	auto green = registry.lambertian(color(.12, .45, .15));
+	auto light = registry.diffuse_light(color(7, 7, 7));
+
+	world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+	world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+	world.add(make_shared<quad>(point3(113, 554, 127), vec3(330, 0, 0), vec3(0, 0, 305), light));
+	world.add(make_shared<quad>(point3(0, 555, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+	world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+	world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+
+	auto box1 = box(point3(0, 0, 0), point3(165, 330, 165), white, 15, vec3(265, 0, 295));
+	world.add(make_shared<constant_medium>(box1, 0.01, color(0, 0, 0)));
+
+	// A lumpy cloud in a 128^3 sparse grid; only blocks touched by the lumps are allocated.
+	auto cloud = make_shared<sparse_density_grid>(128, 128, 128);
+	const point3 lumps[] = { point3(40, 50, 60), point3(70, 60, 55), point3(55, 80, 70), point3(85, 45, 80) };
+	for (int z = 0; z < 128; z++) {
+		for (int y = 0; y < 128; y++) {
+			for (int x = 0; x < 128; x++) {
+				float density = 0;
+				for (const auto& c : lumps) {
+					auto falloff = 1 - (point3(x, y, z) - c).length() / 28;
+					density = std::max(density, static_cast<float>(falloff));
+				}
+				if (density > 0)
+					cloud->set(x, y, z, density);
+			}
+		}
+	}
+	std::clog << "Cloud grid: " << cloud->allocated_blocks() << " blocks, " << cloud->memory_bytes() / 1024 << " KB\n";
+	world.add(make_shared<heterogeneous_medium>(cloud, point3(20, 0, 20), point3(340, 320, 340), 0.05, color(1, 1, 1)));
+
+	auto lights = make_shared<light_bvh>(world);
+	auto objects = world;
+	world = hittable_list(make_shared<bvh_node>(world));
+
+	camera cam;
+
+	cam.aspect_ratio = 1.0;
+	cam.image_width = 600;
+	cam.samples_per_pixel = 200;
+	cam.max_depth = 50;
+	cam.background = color(0, 0, 0);
+
+	cam.vfov = 40;
+	cam.lookfrom = point3(278, 278, -800);
+	cam.lookat = point3(278, 278, 0);
+	cam.vup = vec3(0, 1, 0);
+
+	cam.defocus_angle = 0;
+	cam.file_name = "cornell_smoke.ppm";
+	cam.lights = lights;
+	render_scene(cam, world, objects);
 }
 
-int main() {
+void many_lights() {
+	// A night scene lit only by a few thousand small lamps of varying color and strength, where
+	// the light hierarchy picks the lamps near each shading point.
+	hittable_list world;
+	scene_registry registry;
+
+	auto ground = registry.lambertian(color(0.5, 0.5, 0.5));
+	world.add(make_shared<quad>(point3(-60, 0, -60), vec3(120, 0, 0), vec3(0, 0, 120), ground));
+
+	for (int a = -8; a < 8; a++) {
+		for (int b = -8; b < 8; b++) {
+			auto albedo = color::random(0.2, 0.9);
+			auto height = random_double(1, 6);
+			world.add(box(point3(0, 0, 0), point3(1.5, height, 1.5), registry.lambertian(albedo),
+				random_double(0, 90), vec3(a * 4 + 1, 0, b * 4 + 1)));
+		}
+	}
+
+	for (int a = -32; a < 32; a++) {
+		for (int b = -32; b < 32; b++) {
+			auto center = point3(a + 0.5 * random_double(), random_double(0.1, 8), b + 0.5 * random_double());
+			auto strength = random_double(2, 20);
+			world.add(make_shared<sphere>(center, 0.05, registry.diffuse_light(strength * color::random(0.3, 1))));
+		}
+	}
+
+	auto lights = make_shared<light_bvh>(world);
+	std::clog << "Lights: " << lights->size() << "\n";
+	auto objects = world;
+	world = hittable_list(make_shared<bvh_node>(world));
+
+	camera cam;
+
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 800;
+	cam.samples_per_pixel = 64;
+	cam.max_depth = 8;
+	cam.background = color(0, 0, 0);
+
+	cam.vfov = 40;
+	cam.lookfrom = point3(30, 18, 30);
+	cam.lookat = point3(0, 0, 0);
+	cam.vup = vec3(0, 1, 0);
+
+	cam.defocus_angle = 0;
+	cam.file_name = "many_lights.ppm";
+	cam.lights = lights;
+	render_scene(cam, world, objects);
+}
+
+void outdoor(const char* sky) {
+	// Objects lit by a lat-long HDR sky, e.g. one of the CC0 maps from Poly Haven.
+	hittable_list world;
+	scene_registry registry;
+
+	auto checker = registry.checker(0.5, color(.2, .3, .1), color(.9, .9, .9));
+	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, registry.lambertian(checker)));
+	world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, registry.lambertian(color(0.4, 0.2, 0.1))));
+	world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, registry.dielectric(1.5)));
+	world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, registry.metal(color(0.8, 0.8, 0.8), 0.2)));
+
+	camera cam;
+
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 800;
+	cam.samples_per_pixel = 64;
+	cam.max_depth = 20;
+	cam.environment = make_shared<environment_map>(sky);
+
+	cam.vfov = 25;
+	cam.lookfrom = point3(13, 2.5, 3);
+	cam.lookat = point3(0, 0.8, 0);
+	cam.vup = vec3(0, 1, 0);
+
+	cam.defocus_angle = 0;
+	cam.file_name = "outdoor.hdr";
+	render_scene(cam, world);
+}
+
+int main(int argc, char* argv[]) {
+	// Usage: v2 [--scene <name>] [--mesh <file>] [--sky <file>] [--output <file>] [--spp <samples>]
+	//          [--integrator path_tracing|restir|path_guiding|bidirectional] [--restir-biased]
+	//          [--photons <paths>] [--radiance-cache <cell size>] [--lightmaps <texels per unit>]
+	//          [--worker <index> <count>] [--shard tiles|samples] [--stream] [--texture-cache <MB>]
+	//          [--denoise <passes>] [--aovs <channel>,<channel>,...] [--session]
+	// Scenes are random_spheres, earth, quad, cornell_box (the default), cornell_smoke and
+	// many_lights; --mesh renders an .obj, .ply or .rtwmesh written by v2_meshconv, and --sky
+	// objects lit by a lat-long HDR sky. Channels are beauty, albedo, normal, depth, emission,
+	// direct, indirect, sample_count, variance and primitive_id; an .exr output holds them as
+	// layers. --session reads camera edits from stdin and re-renders progressively; see
+	// session.h for the commands. Workers write <output>.part<index>; combine them with v2_merge.
+	std::string scene = "cornell_box", scene_file;
+	for (int arg = 1; arg < argc; arg++) {
+		if (!strcmp(argv[arg], "--worker") && arg + 2 < argc) {
+			render_shard.index = atoi(argv[++arg]);
+			render_shard.count = atoi(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "--shard") && arg + 1 < argc) {
+			render_shard.mode = strcmp(argv[++arg], "samples") ? shard_mode::tiles : shard_mode::samples;
+		}
+		else if (!strcmp(argv[arg], "--stream")) {
+			render_streaming = true;
+		}
+		else if (!strcmp(argv[arg], "--texture-cache") && arg + 1 < argc) {
+			texture_cache::global().enable(static_cast<size_t>(atof(argv[++arg]) * 1024 * 1024));
+		}
+		else if (!strcmp(argv[arg], "--denoise") && arg + 1 < argc) {
+			denoise_passes = atoi(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "--scene") && arg + 1 < argc) {
+			scene = argv[++arg];
+		}
+		else if (!strcmp(argv[arg], "--mesh") && arg + 1 < argc) {
+			scene = "mesh";
+			scene_file = argv[++arg];
+		}
+		else if (!strcmp(argv[arg], "--sky") && arg + 1 < argc) {
+			scene = "sky";
+			scene_file = argv[++arg];
+		}
+		else if (!strcmp(argv[arg], "--output") && arg + 1 < argc) {
+			output_name = argv[++arg];
+		}
+		else if (!strcmp(argv[arg], "--spp") && arg + 1 < argc) {
+			samples_override = atoi(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "--integrator") && arg + 1 < argc) {
+			std::string name = argv[++arg];
+			if (name == "path_tracing") render_integrator = integrator_mode::path_tracing;
+			else if (name == "restir") render_integrator = integrator_mode::restir;
+			else if (name == "path_guiding") render_integrator = integrator_mode::path_guiding;
+			else if (name == "bidirectional") render_integrator = integrator_mode::bidirectional;
+			else {
+				std::cerr << "Unknown integrator '" << name << "'.\n";
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[arg], "--restir-biased")) {
+			restir_biased = true;
+		}
+		else if (!strcmp(argv[arg], "--photons") && arg + 1 < argc) {
+			photon_paths = atoi(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "--radiance-cache") && arg + 1 < argc) {
+			cache_cell_size = atof(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "--lightmaps") && arg + 1 < argc) {
+			lightmap_texels = atof(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "--session")) {
+			interactive = true;
+		}
+		else if (!strcmp(argv[arg], "--aovs") && arg + 1 < argc) {
+			std::string list = argv[++arg];
+			for (size_t begin = 0; begin <= list.size();) {
+				auto end = std::min(list.find(',', begin), list.size());
+				aov channel;
+				if (!aov_from_name(list.substr(begin, end - begin), channel)) {
+					std::cerr << "Unknown channel '" << list.substr(begin, end - begin) << "'.\n";
+					return 1;
+				}
+				output_aovs.push_back(channel);
+				begin = end + 1;
+			}
+		}
+		else {
+			std::cerr << "Unknown argument '" << argv[arg] << "'.\n";
+			return 1;
+		}
+	}
+	if (render_shard.count < 1 || render_shard.index < 0 || render_shard.index >= render_shard.count) {
+		std::cerr << "Worker index must be in [0, count).\n";
+		return 1;
+	}
 
 	__int64 begin = GetTickCount();
 
-	//random_spheres();
-	//earth();
-	//draw_quad();
-	draw_cornell_box();
+	if (scene == "random_spheres") random_spheres();
+	else if (scene == "earth") earth();
+	else if (scene == "quad") draw_quad();
+	else if (scene == "mesh" && !scene_file.empty()) draw_mesh(scene_file.c_str());
+	else if (scene == "cornell_box") draw_cornell_box();
+	else if (scene == "cornell_smoke") draw_cornell_smoke();
+	else if (scene == "many_lights") many_lights();
+	else if (scene == "sky" && !scene_file.empty()) outdoor(scene_file.c_str());
+	else {
+		std::cerr << "Unknown scene '" << scene << "'.\n";
+		return 1;
+	}
 
 	auto end = GetTickCount() - begin;
 	std::clog << "\rDone.      " + std::to_string(end / 1000.0) + "           \n";
+	texture_cache::global().report(std::clog);
+
+	if (render_failed)
+		return 1;
+	if (render_shard.is_distributed() || interactive)
+		return 0;
 
 	int a;
 	std::cin >> a;
@@ -0,0 +1,99 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class mapped_file {
+	// Read-only memory mapping of a whole file. Pages are faulted in on first touch and come
+	// from the OS file cache, so every process mapping the same file shares one physical copy.
+public:
+	mapped_file() {}
+	~mapped_file() { close(); }
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool open(const std::string& filename) {
+		close();
+#ifdef _WIN32
+		file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+			close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping) bytes = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!bytes) {
+			close();
+			return false;
+		}
+		length = static_cast<size_t>(file_size.QuadPart);
+#else
+		descriptor = ::open(filename.c_str(), O_RDONLY);
+		if (descriptor < 0) return false;
+
+		struct stat info;
+		if (fstat(descriptor, &info) != 0 || info.st_size == 0) {
+			close();
+			return false;
+		}
+		auto mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, descriptor, 0);
+		if (mapped == MAP_FAILED) {
+			close();
+			return false;
+		}
+		bytes = mapped;
+		length = static_cast<size_t>(info.st_size);
+#endif
+		return true;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (bytes) UnmapViewOfFile(bytes);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (bytes) munmap(bytes, length);
+		if (descriptor >= 0) ::close(descriptor);
+		descriptor = -1;
+#endif
+		bytes = nullptr;
+		length = 0;
+	}
+
+	bool is_open() const { return bytes != nullptr; }
+	const unsigned char* data() const { return static_cast<const unsigned char*>(bytes); }
+	size_t size() const { return length; }
+
+private:
+	void* bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int descriptor = -1;
+#endif
+};
+
+#endif
@@ -13,6 +13,23 @@ public:
 	virtual color emitted(double u, double v, const point3& p) const {
 		return color(0, 0, 0);
 	}
+
+	// Density of scatter() choosing the direction of `scattered`. Materials that sample by a
+	// density have attenuation * scattering_pdf equal to the BSDF times the cosine, which lets
+	// light sampling evaluate them in other directions. Specular materials return zero.
+	virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+		return 0;
+	}
+
+	// Half angle of the cone a glossy reflection spreads around the mirror direction, or zero.
+	virtual double reflection_spread() const {
+		return 0;
+	}
+
+	// Fraction of the light the surface reflects at the hit, for the denoiser's albedo buffer.
+	virtual color base_color(const hit_record& rec) const {
+		return color(1, 1, 1);
+	}
 };
 
 
@@ -30,6 +47,10 @@ public:
 		return emit->value(u, v, p);
 	}
 
+	color base_color(const hit_record& rec) const override {
+		return color(0, 0, 0);
+	}
+
 private:
 	shared_ptr<texture> emit;
 };
@@ -48,10 +69,19 @@ public:
 			scatter_direction = rec.normal;
 
 		scattered = ray(rec.p, scatter_direction, r_in.time());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+		attenuation = albedo->lookup(rec);
 		return true;
 	}
 
+	double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+		auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+		return cos_theta < 0 ? 0 : cos_theta / pi;
+	}
+
+	color base_color(const hit_record& rec) const override {
+		return albedo->lookup(rec);
+	}
+
 private:
 	shared_ptr<texture> albedo;
 };
@@ -69,6 +99,14 @@ public:
 		return (dot(scattered.direction(), rec.normal) > 0);
 	}
 
+	double reflection_spread() const override {
+		return asin(fuzz);
+	}
+
+	color base_color(const hit_record& rec) const override {
+		return albedo;
+	}
+
 private:
 	color albedo;
 	double fuzz;
@@ -111,4 +149,30 @@ private:
 	}
 	double ir; // Index of Refraction
 };
+
+
+class isotropic : public material {
+	// Phase function of participating media: scatters uniformly in all directions.
+public:
+	isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
+	isotropic(shared_ptr<texture> a) : albedo(a) {}
+
+	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
+		const override {
+		scattered = ray(rec.p, random_unit_vector(), r_in.time());
+		attenuation = albedo->lookup(rec);
+		return true;
+	}
+
+	double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+		return 1 / (4 * pi);
+	}
+
+	color base_color(const hit_record& rec) const override {
+		return albedo->lookup(rec);
+	}
+
+private:
+	shared_ptr<texture> albedo;
+};
 #endif
\ No newline at end of file
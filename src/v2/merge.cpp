@@ -0,0 +1,28 @@
+
+#include "vec3.h"
+#include "tiles.h"
+#include "image_writer.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Combines the partial framebuffers written by `v2 --worker <index> <count>` into the final image.
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		std::cerr << "Usage: v2_merge <output image> <part file> [<part file> ...]\n";
+		return 1;
+	}
+
+	std::vector<std::string> parts(argv + 2, argv + argc);
+	std::vector<float> sums;
+	int image_width, image_height, samples_per_pixel;
+
+	if (!merge_partials(parts, sums, image_width, image_height, samples_per_pixel))
+		return 1;
+
+	if (!write_image(argv[1], sums, image_width, image_height, samples_per_pixel))
+		return 1;
+
+	std::clog << "Merged " << parts.size() << " partial renders into '" << argv[1] << "'.\n";
+	return 0;
+}
@@ -0,0 +1,679 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "hittable.h"
+#include "bvh.h"
+#include "mapped_file.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Indexed triangle mesh storage: vertex attributes are shared between triangles, and each
+// triangle is three 32-bit vertex indices.
+struct mesh_data {
+	std::vector<float> positions;   // xyz per vertex
+	std::vector<float> normals;     // xyz per vertex, or empty
+	std::vector<float> uvs;         // uv per vertex, or empty
+	std::vector<uint32_t> indices;  // Three vertex indices per triangle
+
+	size_t vertex_count() const { return positions.size() / 3; }
+	size_t triangle_count() const { return indices.size() / 3; }
+};
+
+std::vector<flat_bvh_node> build_mesh_bvh(mesh_data& mesh, int max_leaf_size = 4) {
+	// Builds the flat BVH over the mesh triangles and reorders the triangles to match its leaves.
+	std::vector<flat_bvh_bounds> bounds(mesh.triangle_count());
+	for (size_t tri = 0; tri < bounds.size(); tri++)
+		for (int k = 0; k < 3; k++)
+			bounds[tri].grow(&mesh.positions[3 * static_cast<size_t>(mesh.indices[3 * tri + k])]);
+
+	std::vector<uint32_t> order;
+	auto nodes = flat_bvh_builder::build(bounds, max_leaf_size, order);
+
+	std::vector<uint32_t> sorted(mesh.indices.size());
+	for (size_t i = 0; i < order.size(); i++)
+		std::copy_n(&mesh.indices[3 * static_cast<size_t>(order[i])], 3, &sorted[3 * i]);
+	mesh.indices.swap(sorted);
+	return nodes;
+}
+
+class triangle_mesh : public hittable {
+	// A whole mesh as one hittable. Triangles are reordered to match an internal flat BVH, so a
+	// triangle costs its 12 bytes of indices plus its share of BVH nodes and vertices, with no
+	// per-triangle objects. The mesh itself plugs into bvh_node like any other primitive.
+public:
+	triangle_mesh(mesh_data data, shared_ptr<material> m, int max_leaf_size = 4)
+		: storage(std::move(data)), mat(m)
+	{
+		node_storage = build_mesh_bvh(storage, max_leaf_size);
+		bind(storage.positions.data(), storage.normals.empty() ? nullptr : storage.normals.data(),
+			storage.uvs.empty() ? nullptr : storage.uvs.data(), storage.indices.data(), storage.triangle_count(),
+			node_storage.data(), node_storage.size());
+	}
+
+	triangle_mesh(const triangle_mesh&) = delete;
+	triangle_mesh& operator=(const triangle_mesh&) = delete;
+
+	size_t triangle_count() const { return triangles; }
+	bool has_uvs() const { return uvs != nullptr; }
+
+	void triangle_uvs(uint32_t tri, double uv[3][2]) const {
+		for (int k = 0; k < 3; k++) {
+			auto i = indices[3 * tri + k];
+			uv[k][0] = uvs ? uvs[2 * i] : (k == 1);
+			uv[k][1] = uvs ? uvs[2 * i + 1] : (k == 2);
+		}
+	}
+
+	void surface_point(uint32_t tri, double b1, double b2, hit_record& rec) const {
+		// The point with barycentric coordinates (b1, b2) on a triangle, as seen from the side
+		// its geometric normal faces.
+		auto p0 = vertex(indices[3 * tri]), p1 = vertex(indices[3 * tri + 1]), p2 = vertex(indices[3 * tri + 2]);
+		auto geometric_normal = unit_vector(cross(p1 - p0, p2 - p0));
+		fill_hit_record(ray(p0 + geometric_normal, -geometric_normal, 0.0), 0, tri, b1, b2, rec);
+	}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+		uint32_t hit_triangle = 0;
+		double hit_b1 = 0, hit_b2 = 0;
+
+		bool hit_anything = traverse_flat_bvh(nodes, node_count, r, ray_t, [&](uint32_t first, uint32_t count, interval& t_range) {
+			bool hit_leaf = false;
+			for (uint32_t tri = first; tri < first + count; tri++) {
+				double t, b1, b2;
+				if (intersect_triangle(r, tri, t_range, t, b1, b2)) {
+					t_range.max = t;
+					hit_triangle = tri;
+					hit_b1 = b1;
+					hit_b2 = b2;
+					hit_leaf = true;
+				}
+			}
+			return hit_leaf;
+			});
+
+		if (!hit_anything)
+			return false;
+
+		fill_hit_record(r, ray_t.max, hit_triangle, hit_b1, hit_b2, rec);
+		return true;
+	}
+
+protected:
+	triangle_mesh(shared_ptr<material> m) : mat(m) {}
+
+	void bind(const float* _positions, const float* _normals, const float* _uvs, const uint32_t* _indices,
+		size_t _triangles, const flat_bvh_node* _nodes, size_t _node_count) {
+		// Points the mesh at its attribute, index and node arrays, wherever they live.
+		positions = _positions;
+		normals = _normals;
+		uvs = _uvs;
+		indices = _indices;
+		triangles = _triangles;
+		nodes = _nodes;
+		node_count = _node_count;
+
+		if (node_count > 0) {
+			const auto& root = nodes[0];
+			bbox = aabb(point3(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+				point3(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2])).pad();
+		}
+	}
+
+	mesh_data storage;
+	std::vector<flat_bvh_node> node_storage;
+
+private:
+	shared_ptr<material> mat;
+
+	const float* positions = nullptr;
+	const float* normals = nullptr;
+	const float* uvs = nullptr;
+	const uint32_t* indices = nullptr;
+	size_t triangles = 0;
+	const flat_bvh_node* nodes = nullptr;
+	size_t node_count = 0;
+
+	point3 vertex(uint32_t v) const {
+		return point3(positions[3 * v], positions[3 * v + 1], positions[3 * v + 2]);
+	}
+
+	bool intersect_triangle(const ray& r, uint32_t tri, const interval& ray_t, double& t, double& b1, double& b2) const {
+		// Watertight ray/triangle test (Woop, Benthin and Wald 2013): vertices are moved into a
+		// ray-aligned frame where the ray is the +z axis, and the edge functions are evaluated
+		// there, so rays through shared edges and vertices can never slip between triangles.
+		auto dir = r.direction();
+		int kz = 0;
+		for (int a = 1; a < 3; a++)
+			if (fabs(dir[a]) > fabs(dir[kz])) kz = a;
+		int kx = (kz + 1) % 3;
+		int ky = (kx + 1) % 3;
+
+		auto sz = 1.0 / dir[kz];
+		auto sx = -dir[kx] * sz;
+		auto sy = -dir[ky] * sz;
+
+		auto p0 = vertex(indices[3 * tri]) - r.origin();
+		auto p1 = vertex(indices[3 * tri + 1]) - r.origin();
+		auto p2 = vertex(indices[3 * tri + 2]) - r.origin();
+
+		auto p0x = p0[kx] + sx * p0[kz], p0y = p0[ky] + sy * p0[kz];
+		auto p1x = p1[kx] + sx * p1[kz], p1y = p1[ky] + sy * p1[kz];
+		auto p2x = p2[kx] + sx * p2[kz], p2y = p2[ky] + sy * p2[kz];
+
+		auto e0 = p1x * p2y - p1y * p2x;
+		auto e1 = p2x * p0y - p2y * p0x;
+		auto e2 = p0x * p1y - p0y * p1x;
+
+		if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+			return false;
+		auto det = e0 + e1 + e2;
+		if (det == 0)
+			return false;
+
+		auto t_scaled = e0 * p0[kz] * sz + e1 * p1[kz] * sz + e2 * p2[kz] * sz;
+		t = t_scaled / det;
+		if (!ray_t.surrounds(t))
+			return false;
+
+		b1 = e1 / det;
+		b2 = e2 / det;
+		return true;
+	}
+
+	void fill_hit_record(const ray& r, double t, uint32_t tri, double b1, double b2, hit_record& rec) const {
+		auto i0 = indices[3 * tri], i1 = indices[3 * tri + 1], i2 = indices[3 * tri + 2];
+		auto b0 = 1 - b1 - b2;
+		auto p0 = vertex(i0), p1 = vertex(i1), p2 = vertex(i2);
+
+		rec.t = t;
+		rec.p = b0 * p0 + b1 * p1 + b2 * p2;
+		rec.mat = mat;
+		rec.object = this;
+
+		// Face orientation comes from the geometric normal; interpolated normals only shade.
+		auto geometric_normal = unit_vector(cross(p1 - p0, p2 - p0));
+		rec.set_face_normal(r, geometric_normal);
+		if (normals) {
+			auto n = b0 * vec3(normals[3 * i0], normals[3 * i0 + 1], normals[3 * i0 + 2])
+				+ b1 * vec3(normals[3 * i1], normals[3 * i1 + 1], normals[3 * i1 + 2])
+				+ b2 * vec3(normals[3 * i2], normals[3 * i2 + 1], normals[3 * i2 + 2]);
+			if (n.length_squared() > 0) {
+				n = unit_vector(n);
+				rec.normal = (dot(n, rec.normal) < 0) ? -n : n;
+			}
+		}
+
+		double uv0[2] = { 0, 0 }, uv1[2] = { 1, 0 }, uv2[2] = { 0, 1 };
+		if (uvs) {
+			for (int k = 0; k < 2; k++) {
+				uv0[k] = uvs[2 * i0 + k];
+				uv1[k] = uvs[2 * i1 + k];
+				uv2[k] = uvs[2 * i2 + k];
+			}
+		}
+		rec.u = b0 * uv0[0] + b1 * uv1[0] + b2 * uv2[0];
+		rec.v = b0 * uv0[1] + b1 * uv1[1] + b2 * uv2[1];
+
+		// Surface derivatives from the uv parameterization, falling back to the edges when the
+		// uv mapping is degenerate.
+		auto du02 = uv0[0] - uv2[0], du12 = uv1[0] - uv2[0];
+		auto dv02 = uv0[1] - uv2[1], dv12 = uv1[1] - uv2[1];
+		auto dp02 = p0 - p2, dp12 = p1 - p2;
+		auto determinant = du02 * dv12 - dv02 * du12;
+		if (fabs(determinant) < 1e-12) {
+			rec.dpdu = p1 - p0;
+			rec.dpdv = p2 - p0;
+		}
+		else {
+			auto inv = 1 / determinant;
+			rec.dpdu = (dv12 * dp02 - dv02 * dp12) * inv;
+			rec.dpdv = (du02 * dp12 - du12 * dp02) * inv;
+		}
+	}
+};
+
+// Mesh loading. Both loaders read the file incrementally rather than slurping it, and emit
+// shared vertices so the index arrays stay compact.
+
+bool load_obj(const std::string& filename, mesh_data& mesh) {
+	// Reads positions, texture coordinates, normals and polygonal faces (fan triangulated).
+	// Vertices with the same position/uv/normal triple are shared. Returns false for malformed
+	// or out of range face indices.
+	std::ifstream in(filename);
+	if (!in) return false;
+
+	// Resolved indices: the position's from 0, the uv's and normal's from 1 with 0 for none.
+	struct vertex_key {
+		long vi, ti, ni;
+		bool operator==(const vertex_key&) const = default;
+	};
+	struct vertex_key_hash {
+		size_t operator()(const vertex_key& k) const {
+			return std::hash<long>()(k.vi) ^ (std::hash<long>()(k.ti) * 0x9e3779b97f4a7c15ULL) ^ (std::hash<long>()(k.ni) << 1);
+		}
+	};
+
+	std::vector<float> v, vt, vn;
+	std::unordered_map<vertex_key, uint32_t, vertex_key_hash> vertex_ids;
+	bool has_uvs = false, has_normals = false;
+
+	auto resolve = [](const std::string& text, size_t count, long& idx) {
+		// OBJ indices are 1-based; negative indices count back from the latest element. False
+		// unless the text is a whole nonzero integer.
+		auto end = text.data() + text.size();
+		auto [last, error] = std::from_chars(text.data(), end, idx);
+		if (error != std::errc() || last != end || idx == 0)
+			return false;
+		idx = (idx < 0) ? static_cast<long>(count) + idx : idx - 1;
+		return true;
+	};
+
+	std::string line, token;
+	std::vector<uint32_t> face;
+	while (std::getline(in, line)) {
+		if (line.size() < 2) continue;
+		std::istringstream ls(line);
+		ls >> token;
+
+		if (token == "v") {
+			float x = 0, y = 0, z = 0;
+			ls >> x >> y >> z;
+			v.insert(v.end(), { x, y, z });
+		}
+		else if (token == "vt") {
+			float s = 0, t = 0;
+			ls >> s >> t;
+			vt.insert(vt.end(), { s, t });
+		}
+		else if (token == "vn") {
+			float x = 0, y = 0, z = 0;
+			ls >> x >> y >> z;
+			vn.insert(vn.end(), { x, y, z });
+		}
+		else if (token == "f") {
+			face.clear();
+			while (ls >> token) {
+				long vi = 0, ti = 0, ni = 0;
+				auto first = token.find('/');
+				if (!resolve(token.substr(0, first), v.size() / 3, vi)) return false;
+				if (first != std::string::npos) {
+					auto second = token.find('/', first + 1);
+					auto uv_part = token.substr(first + 1, second == std::string::npos ? std::string::npos : second - first - 1);
+					if (!uv_part.empty()) {
+						if (!resolve(uv_part, vt.size() / 2, ti)) return false;
+						ti++;
+					}
+					if (second != std::string::npos && second + 1 < token.size()) {
+						if (!resolve(token.substr(second + 1), vn.size() / 3, ni)) return false;
+						ni++;
+					}
+				}
+				if (vi < 0 || 3 * static_cast<size_t>(vi) >= v.size()) return false;
+
+				vertex_key key{ vi, ti, ni };
+				auto found = vertex_ids.find(key);
+				if (found != vertex_ids.end()) {
+					face.push_back(found->second);
+					continue;
+				}
+
+				auto id = static_cast<uint32_t>(mesh.vertex_count());
+				mesh.positions.insert(mesh.positions.end(), { v[3 * vi], v[3 * vi + 1], v[3 * vi + 2] });
+				if (ti > 0 && 2 * static_cast<size_t>(ti) <= vt.size()) {
+					mesh.uvs.resize(2 * static_cast<size_t>(id));
+					mesh.uvs.insert(mesh.uvs.end(), { vt[2 * (ti - 1)], vt[2 * (ti - 1) + 1] });
+					has_uvs = true;
+				}
+				if (ni > 0 && 3 * static_cast<size_t>(ni) <= vn.size()) {
+					mesh.normals.resize(3 * static_cast<size_t>(id));
+					mesh.normals.insert(mesh.normals.end(), { vn[3 * (ni - 1)], vn[3 * (ni - 1) + 1], vn[3 * (ni - 1) + 2] });
+					has_normals = true;
+				}
+				vertex_ids.emplace(key, id);
+				face.push_back(id);
+			}
+			for (size_t k = 2; k < face.size(); k++)
+				mesh.indices.insert(mesh.indices.end(), { face[0], face[k - 1], face[k] });
+		}
+	}
+
+	// Attributes are all-or-nothing per mesh; pad any vertices that lacked them.
+	if (has_uvs) mesh.uvs.resize(2 * mesh.vertex_count(), 0.0f); else mesh.uvs.clear();
+	if (has_normals) mesh.normals.resize(3 * mesh.vertex_count(), 0.0f); else mesh.normals.clear();
+	return true;
+}
+
+bool load_ply(const std::string& filename, mesh_data& mesh) {
+	// Reads ASCII and binary PLY files with a vertex element (x y z, optional nx ny nz and
+	// u v / s t) and a face element holding a vertex index list.
+	std::ifstream in(filename, std::ios::in | std::ios::binary);
+	if (!in) return false;
+
+	struct property {
+		std::string name, type, count_type;  // count_type is set for list properties
+	};
+	struct element {
+		std::string name;
+		size_t count = 0;
+		std::vector<property> properties;
+	};
+
+	std::string line, token, format;
+	std::vector<element> elements;
+	std::getline(in, line);
+	if (line.rfind("ply", 0) != 0) return false;
+
+	while (std::getline(in, line)) {
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		std::istringstream ls(line);
+		ls >> token;
+		if (token == "format") ls >> format;
+		else if (token == "element") {
+			elements.push_back({});
+			ls >> elements.back().name >> elements.back().count;
+		}
+		else if (token == "property" && !elements.empty()) {
+			property p;
+			ls >> p.type;
+			if (p.type == "list") ls >> p.count_type >> p.type;
+			ls >> p.name;
+			elements.back().properties.push_back(p);
+		}
+		else if (token == "end_header") break;
+	}
+
+	bool ascii = (format == "ascii");
+	bool swap_bytes = (format == "binary_big_endian");
+	if (!ascii && !swap_bytes && format != "binary_little_endian") return false;
+
+	// Every element and list entry takes at least a byte, so no count can exceed the bytes left
+	// after the header; larger ones come from a damaged file.
+	auto body = in.tellg();
+	in.seekg(0, std::ios::end);
+	auto body_bytes = static_cast<double>(in.tellg() - body);
+	in.seekg(body);
+	for (const auto& e : elements)
+		if (static_cast<double>(e.count) > body_bytes) return false;
+
+	auto type_size = [](const std::string& t) -> int {
+		if (t == "char" || t == "uchar" || t == "int8" || t == "uint8") return 1;
+		if (t == "short" || t == "ushort" || t == "int16" || t == "uint16") return 2;
+		if (t == "double" || t == "float64") return 8;
+		return 4;
+	};
+
+	auto read_value = [&](const std::string& t) -> double {
+		if (ascii) {
+			double x = 0;
+			in >> x;
+			return x;
+		}
+		unsigned char bytes[8];
+		auto size = type_size(t);
+		in.read(reinterpret_cast<char*>(bytes), size);
+		if (swap_bytes) std::reverse(bytes, bytes + size);
+
+		if (t == "char" || t == "int8") return static_cast<int8_t>(bytes[0]);
+		if (t == "uchar" || t == "uint8") return bytes[0];
+		if (t == "short" || t == "int16") { int16_t x; std::memcpy(&x, bytes, 2); return x; }
+		if (t == "ushort" || t == "uint16") { uint16_t x; std::memcpy(&x, bytes, 2); return x; }
+		if (t == "int" || t == "int32") { int32_t x; std::memcpy(&x, bytes, 4); return x; }
+		if (t == "uint" || t == "uint32") { uint32_t x; std::memcpy(&x, bytes, 4); return x; }
+		if (t == "double" || t == "float64") { double x; std::memcpy(&x, bytes, 8); return x; }
+		float x;
+		std::memcpy(&x, bytes, 4);
+		return x;
+	};
+
+	auto read_count = [&](const std::string& t, size_t& count) {
+		auto x = read_value(t);
+		if (!in || !(x >= 0 && x <= body_bytes)) return false;
+		count = static_cast<size_t>(x);
+		return true;
+	};
+
+	std::vector<uint32_t> face;
+	for (const auto& e : elements) {
+		if (e.name == "vertex") {
+			bool has_normals = false, has_uvs = false;
+			for (const auto& p : e.properties) {
+				if (p.name == "nx") has_normals = true;
+				if (p.name == "u" || p.name == "s" || p.name == "texture_u") has_uvs = true;
+			}
+			mesh.positions.reserve(3 * e.count);
+			if (has_normals) mesh.normals.reserve(3 * e.count);
+			if (has_uvs) mesh.uvs.reserve(2 * e.count);
+
+			for (size_t i = 0; i < e.count && in; i++) {
+				float pos[3] = { 0, 0, 0 }, n[3] = { 0, 0, 0 }, uv[2] = { 0, 0 };
+				for (const auto& p : e.properties) {
+					if (!p.count_type.empty()) {
+						size_t count;
+						if (!read_count(p.count_type, count)) return false;
+						for (size_t k = 0; k < count; k++) read_value(p.type);
+						continue;
+					}
+					auto x = static_cast<float>(read_value(p.type));
+					if (p.name == "x") pos[0] = x;
+					else if (p.name == "y") pos[1] = x;
+					else if (p.name == "z") pos[2] = x;
+					else if (p.name == "nx") n[0] = x;
+					else if (p.name == "ny") n[1] = x;
+					else if (p.name == "nz") n[2] = x;
+					else if (p.name == "u" || p.name == "s" || p.name == "texture_u") uv[0] = x;
+					else if (p.name == "v" || p.name == "t" || p.name == "texture_v") uv[1] = x;
+				}
+				mesh.positions.insert(mesh.positions.end(), pos, pos + 3);
+				if (has_normals) mesh.normals.insert(mesh.normals.end(), n, n + 3);
+				if (has_uvs) mesh.uvs.insert(mesh.uvs.end(), uv, uv + 2);
+			}
+		}
+		else {
+			bool is_face = (e.name == "face");
+			for (size_t i = 0; i < e.count && in; i++) {
+				for (const auto& p : e.properties) {
+					if (p.count_type.empty()) {
+						read_value(p.type);
+						continue;
+					}
+					size_t count;
+					if (!read_count(p.count_type, count)) return false;
+					face.resize(count);
+					for (size_t k = 0; k < count; k++)
+						face[k] = static_cast<uint32_t>(read_value(p.type));
+					if (is_face && (p.name == "vertex_indices" || p.name == "vertex_index")) {
+						for (size_t k = 2; k < count; k++)
+							mesh.indices.insert(mesh.indices.end(), { face[0], face[k - 1], face[k] });
+					}
+				}
+			}
+		}
+		if (!in) return false;
+	}
+
+	for (auto index : mesh.indices)
+		if (index >= mesh.vertex_count()) return false;
+	return true;
+}
+
+// Binary mesh container (.rtwmesh). A fixed header is followed by the position, normal, uv,
+// index and BVH node arrays, each starting on a 64-byte boundary, in exactly the layout
+// triangle_mesh traverses. Files are written in native byte order by v2_meshconv and mapped
+// read-only at load time, so the arrays are used in place without parsing or copying.
+
+static const uint32_t mesh_file_normals = 1;  // Header flags
+static const uint32_t mesh_file_uvs = 2;
+static const uint32_t mesh_file_version = 1;
+static const uint64_t mesh_file_alignment = 64;
+
+struct mesh_file_header {
+	char magic[4];             // "RTWM"
+	uint32_t version;
+	uint32_t flags;            // mesh_file_normals | mesh_file_uvs
+	uint32_t reserved;
+	uint64_t vertex_count;
+	uint64_t triangle_count;
+	uint64_t node_count;       // Zero if the file has no prebuilt BVH
+	uint64_t positions_offset;
+	uint64_t normals_offset;
+	uint64_t uvs_offset;
+	uint64_t indices_offset;
+	uint64_t nodes_offset;
+	uint64_t file_size;
+};
+
+bool write_mesh_file(const std::string& filename, const mesh_data& mesh, const std::vector<flat_bvh_node>& nodes) {
+	// Writes the mesh and, if non-empty, the BVH built over it by build_mesh_bvh().
+	mesh_file_header header = {};
+	std::memcpy(header.magic, "RTWM", 4);
+	header.version = mesh_file_version;
+	header.flags = (mesh.normals.empty() ? 0u : mesh_file_normals) | (mesh.uvs.empty() ? 0u : mesh_file_uvs);
+	header.vertex_count = mesh.vertex_count();
+	header.triangle_count = mesh.triangle_count();
+	header.node_count = nodes.size();
+
+	uint64_t offset = sizeof(header);
+	auto place = [&](uint64_t bytes) {
+		offset = (offset + mesh_file_alignment - 1) / mesh_file_alignment * mesh_file_alignment;
+		auto start = offset;
+		offset += bytes;
+		return start;
+	};
+	header.positions_offset = place(mesh.positions.size() * sizeof(float));
+	header.normals_offset = place(mesh.normals.size() * sizeof(float));
+	header.uvs_offset = place(mesh.uvs.size() * sizeof(float));
+	header.indices_offset = place(mesh.indices.size() * sizeof(uint32_t));
+	header.nodes_offset = place(nodes.size() * sizeof(flat_bvh_node));
+	header.file_size = offset;
+
+	std::ofstream out(filename, std::ios::out | std::ios::binary);
+	if (!out) {
+		std::cerr << "ERROR: Could not create mesh file '" << filename << "'.\n";
+		return false;
+	}
+
+	uint64_t written = 0;
+	auto write_at = [&](uint64_t at, const void* data, uint64_t bytes) {
+		static const char padding[mesh_file_alignment] = {};
+		out.write(padding, static_cast<std::streamsize>(at - written));
+		out.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+		written = at + bytes;
+	};
+	write_at(0, &header, sizeof(header));
+	write_at(header.positions_offset, mesh.positions.data(), mesh.positions.size() * sizeof(float));
+	write_at(header.normals_offset, mesh.normals.data(), mesh.normals.size() * sizeof(float));
+	write_at(header.uvs_offset, mesh.uvs.data(), mesh.uvs.size() * sizeof(float));
+	write_at(header.indices_offset, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+	write_at(header.nodes_offset, nodes.data(), nodes.size() * sizeof(flat_bvh_node));
+
+	if (!out) {
+		std::cerr << "ERROR: Could not write mesh file '" << filename << "'.\n";
+		return false;
+	}
+	return true;
+}
+
+class mapped_mesh : public triangle_mesh {
+	// Triangle mesh whose arrays live in a mapped .rtwmesh file. Loading costs only the header
+	// checks; vertex, index and node pages are faulted in as rays first touch them, and render
+	// processes on one machine share them through the OS file cache.
+public:
+	mapped_mesh(std::unique_ptr<mapped_file> _file, const mesh_file_header& header, shared_ptr<material> m)
+		: triangle_mesh(m), file(std::move(_file))
+	{
+		auto base = file->data();
+		bind(reinterpret_cast<const float*>(base + header.positions_offset),
+			(header.flags & mesh_file_normals) ? reinterpret_cast<const float*>(base + header.normals_offset) : nullptr,
+			(header.flags & mesh_file_uvs) ? reinterpret_cast<const float*>(base + header.uvs_offset) : nullptr,
+			reinterpret_cast<const uint32_t*>(base + header.indices_offset), header.triangle_count,
+			reinterpret_cast<const flat_bvh_node*>(base + header.nodes_offset), header.node_count);
+	}
+
+private:
+	std::unique_ptr<mapped_file> file;
+};
+
+shared_ptr<triangle_mesh> load_mesh_file(const std::string& filename, shared_ptr<material> mat) {
+	// Maps a .rtwmesh file. With a prebuilt BVH only the header and array extents are
+	// validated; the contents are trusted, as checking every index would touch every page.
+	// Files without one are copied into memory, their indices checked on the way, and get a BVH
+	// built at load time.
+	auto file = std::make_unique<mapped_file>();
+	if (!file->open(filename)) {
+		std::cerr << "ERROR: Could not map mesh file '" << filename << "'.\n";
+		return nullptr;
+	}
+
+	mesh_file_header header;
+	auto fits = [&](uint64_t offset, uint64_t count, uint64_t element_size) {
+		return offset % 4 == 0 && offset <= file->size() && count <= (file->size() - offset) / element_size;
+	};
+	bool valid = file->size() >= sizeof(header);
+	if (valid) {
+		std::memcpy(&header, file->data(), sizeof(header));
+		valid = std::memcmp(header.magic, "RTWM", 4) == 0 && header.version == mesh_file_version
+			&& header.file_size == file->size() && header.triangle_count > 0 && header.triangle_count <= UINT32_MAX
+			&& fits(header.positions_offset, header.vertex_count, 3 * sizeof(float))
+			&& (!(header.flags & mesh_file_normals) || fits(header.normals_offset, header.vertex_count, 3 * sizeof(float)))
+			&& (!(header.flags & mesh_file_uvs) || fits(header.uvs_offset, header.vertex_count, 2 * sizeof(float)))
+			&& fits(header.indices_offset, header.triangle_count, 3 * sizeof(uint32_t))
+			&& fits(header.nodes_offset, header.node_count, sizeof(flat_bvh_node));
+	}
+	if (!valid) {
+		std::cerr << "ERROR: '" << filename << "' is not a valid mesh file.\n";
+		return nullptr;
+	}
+
+	if (header.node_count > 0)
+		return make_shared<mapped_mesh>(std::move(file), header, mat);
+
+	mesh_data mesh;
+	auto copy = [&](std::vector<float>& dst, uint64_t offset, uint64_t count) {
+		auto src = reinterpret_cast<const float*>(file->data() + offset);
+		dst.assign(src, src + count);
+	};
+	copy(mesh.positions, header.positions_offset, 3 * header.vertex_count);
+	if (header.flags & mesh_file_normals) copy(mesh.normals, header.normals_offset, 3 * header.vertex_count);
+	if (header.flags & mesh_file_uvs) copy(mesh.uvs, header.uvs_offset, 2 * header.vertex_count);
+	auto indices = reinterpret_cast<const uint32_t*>(file->data() + header.indices_offset);
+	mesh.indices.assign(indices, indices + 3 * header.triangle_count);
+	for (auto index : mesh.indices) {
+		if (index >= header.vertex_count) {
+			std::cerr << "ERROR: '" << filename << "' is not a valid mesh file.\n";
+			return nullptr;
+		}
+	}
+	return make_shared<triangle_mesh>(std::move(mesh), mat);
+}
+
+bool load_mesh_data(const std::string& filename, mesh_data& mesh) {
+	// Parses an .obj or .ply file, chosen by extension.
+	auto dot = filename.find_last_of('.');
+	auto ext = (dot == std::string::npos) ? std::string() : filename.substr(dot + 1);
+	bool ok = (ext == "ply" || ext == "PLY") ? load_ply(filename, mesh) : load_obj(filename, mesh);
+	return ok && !mesh.indices.empty();
+}
+
+shared_ptr<triangle_mesh> load_triangle_mesh(const std::string& filename, shared_ptr<material> mat) {
+	// Loads an .rtwmesh, .obj or .ply file into a triangle mesh. Returns null if the file cannot be read.
+	if (filename.size() > 8 && filename.compare(filename.size() - 8, 8, ".rtwmesh") == 0)
+		return load_mesh_file(filename, mat);
+
+	mesh_data mesh;
+	if (!load_mesh_data(filename, mesh)) {
+		std::cerr << "ERROR: Could not load mesh file '" << filename << "'.\n";
+		return nullptr;
+	}
+	return make_shared<triangle_mesh>(std::move(mesh), mat);
+}
+
+#endif
@@ -0,0 +1,47 @@
+
+#include "vec3.h"
+#include "mesh.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// Converts an .obj or .ply mesh into the binary .rtwmesh format that v2 maps at load time.
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		std::cerr << "Usage: v2_meshconv <input .obj|.ply> <output .rtwmesh> [--leaf-size <n>] [--no-bvh]\n";
+		return 1;
+	}
+
+	int max_leaf_size = 4;
+	bool prebuild_bvh = true;
+	for (int arg = 3; arg < argc; arg++) {
+		if (!strcmp(argv[arg], "--leaf-size") && arg + 1 < argc) {
+			max_leaf_size = atoi(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "--no-bvh")) {
+			prebuild_bvh = false;
+		}
+		else {
+			std::cerr << "Unknown argument '" << argv[arg] << "'.\n";
+			return 1;
+		}
+	}
+
+	mesh_data mesh;
+	if (!load_mesh_data(argv[1], mesh)) {
+		std::cerr << "ERROR: Could not load mesh file '" << argv[1] << "'.\n";
+		return 1;
+	}
+
+	std::vector<flat_bvh_node> nodes;
+	if (prebuild_bvh)
+		nodes = build_mesh_bvh(mesh, max_leaf_size);
+
+	if (!write_mesh_file(argv[2], mesh, nodes))
+		return 1;
+
+	std::clog << "Wrote '" << argv[2] << "': " << mesh.vertex_count() << " vertices, "
+		<< mesh.triangle_count() << " triangles, " << nodes.size() << " BVH nodes.\n";
+	return 0;
+}
@@ -0,0 +1,219 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include "rtw_image.h"
+#include "texel_format.h"
+#include "vec3.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+enum class texture_filter {
+	nearest,     // Single texel from the full resolution image
+	trilinear,   // Bilinear lookups in the two mip levels bracketing the footprint width
+	anisotropic  // Several trilinear probes along the major axis of the footprint
+};
+
+// Filtering over any texel source that provides levels(), width(level), height(level) and a
+// clamping fetch(level, x, y, float rgb[3]) returning linear RGB. Shared by resident mip pyramids
+// and cache-backed tiled textures. s,t are image coordinates in [0,1], with t running down the image.
+
+template <typename source, texel_format format>
+struct typed_texels {
+	// Filters a pyramid or tiled texture through its fetch<format>, decoding without a format switch.
+	const source& src;
+
+	int levels() const { return src.levels(); }
+	int width(int lvl) const { return src.width(lvl); }
+	int height(int lvl) const { return src.height(lvl); }
+	void fetch(int lvl, int x, int y, float* rgb) const { src.template fetch<format>(lvl, x, y, rgb); }
+};
+
+template <typename source>
+color mip_nearest(const source& src, double s, double t) {
+	float rgb[3];
+	src.fetch(0, static_cast<int>(s * src.width(0)), static_cast<int>(t * src.height(0)), rgb);
+	return color(rgb[0], rgb[1], rgb[2]);
+}
+
+template <typename source>
+void mip_bilinear(const source& src, int lvl, double s, double t, float* rgb) {
+	// Gathers the 2x2 neighborhood into a small float array and blends it channel-wise, which
+	// keeps the weighting straight-line float math the compiler can vectorize.
+	auto x = static_cast<float>(s * src.width(lvl) - 0.5);
+	auto y = static_cast<float>(t * src.height(lvl) - 0.5);
+	auto x0 = static_cast<int>(std::floor(x));
+	auto y0 = static_cast<int>(std::floor(y));
+	auto fx = x - x0;
+	auto fy = y - y0;
+
+	float texels[4][3];
+	src.fetch(lvl, x0, y0, texels[0]);
+	src.fetch(lvl, x0 + 1, y0, texels[1]);
+	src.fetch(lvl, x0, y0 + 1, texels[2]);
+	src.fetch(lvl, x0 + 1, y0 + 1, texels[3]);
+
+	const float weights[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+	for (int c = 0; c < 3; c++)
+		rgb[c] = weights[0] * texels[0][c] + weights[1] * texels[1][c] + weights[2] * texels[2][c] + weights[3] * texels[3][c];
+}
+
+template <typename source>
+color mip_bilinear(const source& src, int lvl, double s, double t) {
+	float rgb[3];
+	mip_bilinear(src, lvl, s, t, rgb);
+	return color(rgb[0], rgb[1], rgb[2]);
+}
+
+template <typename source>
+color mip_trilinear(const source& src, double s, double t, double texel_width) {
+	// Blends the two levels whose texel size brackets `texel_width`, given in level 0 texels.
+	auto lod = std::log2(std::max(texel_width, 1e-8));
+	if (lod <= 0) return mip_bilinear(src, 0, s, t);
+	if (lod >= src.levels() - 1) return mip_bilinear(src, src.levels() - 1, s, t);
+
+	auto l0 = static_cast<int>(lod);
+	auto f = static_cast<float>(lod - l0);
+	float a[3], b[3];
+	mip_bilinear(src, l0, s, t, a);
+	mip_bilinear(src, l0 + 1, s, t, b);
+	return color((1 - f) * a[0] + f * b[0], (1 - f) * a[1] + f * b[1], (1 - f) * a[2] + f * b[2]);
+}
+
+template <typename source>
+color mip_filter(const source& src, texture_filter mode, double s, double t,
+	double dsdx, double dtdx, double dsdy, double dtdy, int max_anisotropy = 8) {
+	// Filters the footprint spanned by the screen-space derivatives of s and t.
+	if (mode == texture_filter::nearest)
+		return mip_nearest(src, s, t);
+
+	// Footprint axes measured in level 0 texels.
+	auto w0 = src.width(0), h0 = src.height(0);
+	auto len_x = std::hypot(dsdx * w0, dtdx * h0);
+	auto len_y = std::hypot(dsdy * w0, dtdy * h0);
+
+	if (mode == texture_filter::trilinear)
+		return mip_trilinear(src, s, t, std::max(len_x, len_y));
+
+	auto major = std::max(len_x, len_y);
+	auto minor = std::min(len_x, len_y);
+	if (minor * max_anisotropy < major)
+		minor = major / max_anisotropy;
+	if (minor <= 0)
+		return mip_bilinear(src, 0, s, t);
+
+	// Spread probes along the major axis, each filtered at the width of the minor axis.
+	auto probes = std::clamp(static_cast<int>(std::ceil(major / minor)), 1, max_anisotropy);
+	auto ds = (len_x >= len_y) ? dsdx : dsdy;
+	auto dt = (len_x >= len_y) ? dtdx : dtdy;
+
+	color sum(0, 0, 0);
+	for (int k = 0; k < probes; k++) {
+		auto offset = (k + 0.5) / probes - 0.5;
+		sum += mip_trilinear(src, s + offset * ds, t + offset * dt, minor);
+	}
+	return sum / probes;
+}
+
+class mipmap {
+	// Image pyramid built once at load time. Level 0 is the full resolution image; each further
+	// level halves both dimensions with a 2x2 box filter down to a single texel. Filtering is
+	// done in linear space, and each level is then stored in the texture's texel format.
+public:
+	mipmap() {}
+
+	mipmap(const rtw_image& image, texel_format _format = texel_format::srgb8) : format(_format) {
+		if (image.height() <= 0) return;
+
+		// Decode the 8-bit sRGB source to linear float once.
+		auto table = srgb_to_linear_table();
+		linear_level linear{ image.width(), image.height(), {} };
+		linear.rgb.resize(static_cast<size_t>(linear.width) * linear.height * 3);
+		for (int y = 0; y < linear.height; y++) {
+			auto row = image.pixel_data(0, y);
+			auto dst = &linear.rgb[static_cast<size_t>(y) * linear.width * 3];
+			for (int k = 0; k < linear.width * 3; k++)
+				dst[k] = table[row[k]];
+		}
+
+		pyramid.push_back(encode(linear));
+		while (linear.width > 1 || linear.height > 1) {
+			linear = downsample(linear);
+			pyramid.push_back(encode(linear));
+		}
+	}
+
+	bool empty() const { return pyramid.empty(); }
+	int levels() const { return static_cast<int>(pyramid.size()); }
+	int width(int level) const { return pyramid[level].width; }
+	int height(int level) const { return pyramid[level].height; }
+	texel_format storage_format() const { return format; }
+
+	template <texel_format stored>
+	void fetch(int lvl, int x, int y, float* rgb) const {
+		// Returns the linear texel at x,y of the given level, clamping coordinates to the image.
+		// `stored` must be the pyramid's format.
+		const level& l = pyramid[lvl];
+		x = std::clamp(x, 0, l.width - 1);
+		y = std::clamp(y, 0, l.height - 1);
+		decode_texel<stored>(&l.texels[(static_cast<size_t>(y) * l.width + x) * texel_bytes(stored)], rgb);
+	}
+
+	const unsigned char* texel_data(int lvl, int x, int y) const {
+		// Raw storage of the texel at x,y of the given level (no clamping).
+		const level& l = pyramid[lvl];
+		return &l.texels[(static_cast<size_t>(y) * l.width + x) * stride()];
+	}
+
+	color filter(texture_filter mode, double s, double t,
+		double dsdx, double dtdx, double dsdy, double dtdy) const {
+		return with_texel_format(format, [&](auto stored) {
+			return mip_filter(typed_texels<mipmap, stored>{ *this }, mode, s, t, dsdx, dtdx, dsdy, dtdy);
+			});
+	}
+
+private:
+	struct level {
+		int width, height;
+		std::vector<unsigned char> texels;  // Scanline order, texel_bytes(format) per texel
+	};
+	struct linear_level {
+		int width, height;
+		std::vector<float> rgb;
+	};
+
+	texel_format format = texel_format::srgb8;
+	std::vector<level> pyramid;
+
+	size_t stride() const { return texel_bytes(format); }
+
+	level encode(const linear_level& src) const {
+		level dst{ src.width, src.height, {} };
+		dst.texels.resize(static_cast<size_t>(src.width) * src.height * stride());
+		for (size_t k = 0; k < static_cast<size_t>(src.width) * src.height; k++)
+			encode_texel(format, &src.rgb[k * 3], &dst.texels[k * stride()]);
+		return dst;
+	}
+
+	static linear_level downsample(const linear_level& src) {
+		linear_level dst{ std::max(1, src.width / 2), std::max(1, src.height / 2), {} };
+		dst.rgb.resize(static_cast<size_t>(dst.width) * dst.height * 3);
+
+		for (int y = 0; y < dst.height; y++) {
+			for (int x = 0; x < dst.width; x++) {
+				for (int c = 0; c < 3; c++) {
+					float sum = 0;
+					for (int k = 0; k < 4; k++) {
+						auto sx = std::min(2 * x + (k & 1), src.width - 1);
+						auto sy = std::min(2 * y + (k >> 1), src.height - 1);
+						sum += src.rgb[(static_cast<size_t>(sy) * src.width + sx) * 3 + c];
+					}
+					dst.rgb[(static_cast<size_t>(y) * dst.width + x) * 3 + c] = sum * 0.25f;
+				}
+			}
+		}
+		return dst;
+	}
+};
+
+#endif
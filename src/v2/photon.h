@@ -0,0 +1,461 @@
+#ifndef PHOTON_H
+#define PHOTON_H
+
+#include "hittable.h"
+#include "material.h"
+#include "light_bvh.h"
+#include "environment.h"
+#include <ppl.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Caustic photon map (Jensen 1996). Photon paths leave the lights and the sky aimed at the
+// objects that can focus light, bounce through specular surfaces, and are stored where they
+// first land on a diffuse surface. Caustics are then read from the photons near a shading point
+// instead of being found by paths that happen to scatter onto a light through glass.
+
+struct photon_settings {
+	int    paths = 0;                // Photon paths emitted per render; zero disables the caustic map
+	size_t max_photons = 4u << 20;   // Cap on stored photons, 36 bytes each
+	double radius = 0.05;            // Gather radius, in scene units
+	int    max_depth = 16;           // Specular bounces before a photon is dropped
+};
+
+struct photon_target {
+	point3 center;
+	double radius;  // Photons were aimed at this sphere
+};
+
+struct photon {
+	float p[3];
+	float direction[3];  // Unit direction of travel
+	float power[3];
+};
+
+class photon_map {
+	// Photons sorted into a hashed uniform grid whose cells are one gather diameter wide, so a
+	// lookup visits eight cells, rarely more, and the photons of each cell lie next to each other in
+	// memory. The grid is built by a parallel counting sort over the hash buckets.
+public:
+	photon_map(std::vector<photon> unsorted, double _radius, size_t _paths, std::vector<photon_target> _targets)
+		: radius(_radius), cell_size(2 * _radius), emitted_paths(_paths), targets(std::move(_targets))
+	{
+		auto n = unsorted.size();
+		size_t buckets = 1;
+		while (buckets < n) buckets <<= 1;
+		mask = buckets - 1;
+
+		std::vector<uint32_t> keys(n);
+		std::vector<std::atomic<uint32_t>> cursor(buckets);
+		for (auto& c : cursor) c.store(0, std::memory_order_relaxed);
+		Concurrency::parallel_for(size_t(0), n, [&](size_t i) {
+			const auto& p = unsorted[i].p;
+			keys[i] = bucket(cell(p[0]), cell(p[1]), cell(p[2]));
+			cursor[keys[i]].fetch_add(1, std::memory_order_relaxed);
+			});
+
+		bucket_start.resize(buckets + 1);
+		bucket_start[0] = 0;
+		for (size_t b = 0; b < buckets; b++) {
+			bucket_start[b + 1] = bucket_start[b] + cursor[b].load(std::memory_order_relaxed);
+			cursor[b].store(bucket_start[b], std::memory_order_relaxed);
+		}
+
+		// Scatter photon indices into their buckets, then sort each bucket so the layout does
+		// not depend on thread timing.
+		std::vector<uint32_t> order(n);
+		Concurrency::parallel_for(size_t(0), n, [&](size_t i) {
+			order[cursor[keys[i]].fetch_add(1, std::memory_order_relaxed)] = static_cast<uint32_t>(i);
+			});
+		Concurrency::parallel_for(size_t(0), buckets, [&](size_t b) {
+			std::sort(order.begin() + bucket_start[b], order.begin() + bucket_start[b + 1]);
+			});
+
+		photons.resize(n);
+		Concurrency::parallel_for(size_t(0), n, [&](size_t i) { photons[i] = unsorted[order[i]]; });
+	}
+
+	size_t size() const { return photons.size(); }
+	size_t paths() const { return emitted_paths; }
+
+	size_t memory_bytes() const {
+		return photons.size() * sizeof(photon) + bucket_start.size() * sizeof(uint32_t);
+	}
+
+	bool covers(const point3& p) const {
+		// Whether photons were aimed at p, so that light a specular surface there passes on to
+		// a diffuse one is in the map.
+		for (const auto& t : targets)
+			if ((p - t.center).length_squared() <= t.radius * t.radius)
+				return true;
+		return false;
+	}
+
+	void note_uncovered() {
+		// Called by camera paths that reach a light through a specular surface the map does
+		// not cover, whose caustics are then path traced. Warns once.
+		if (!uncovered.load(std::memory_order_relaxed) && !uncovered.exchange(true))
+			std::clog << "Caustics: light reaches a diffuse surface through a specular object outside "
+				"caustic_casters; its caustics are path traced.\n";
+	}
+
+	color irradiance(const point3& p, const vec3& normal) const {
+		// Flux per unit area arriving at p on the side `normal` faces, from the photons within
+		// the gather radius, weighted by the kernel 2 (1 - d^2/r^2) / (pi r^2) whose integral
+		// over the disk is one.
+		if (photons.empty())
+			return color(0, 0, 0);
+
+		int64_t lo[3], hi[3];
+		for (int a = 0; a < 3; a++) {
+			lo[a] = cell(p[a] - radius);
+			hi[a] = cell(p[a] + radius);
+		}
+
+		// Distinct cells can share a bucket; each bucket is read once. The box spans two cells a
+		// side, or three when rounding puts both of its faces just past a cell boundary.
+		uint32_t visited[27];
+		int visited_count = 0;
+		auto r2 = radius * radius;
+		color sum(0, 0, 0);
+		for (auto z = lo[2]; z <= hi[2]; z++) {
+			for (auto y = lo[1]; y <= hi[1]; y++) {
+				for (auto x = lo[0]; x <= hi[0]; x++) {
+					auto b = bucket(x, y, z);
+					if (std::find(visited, visited + visited_count, b) != visited + visited_count)
+						continue;
+					visited[visited_count++] = b;
+
+					for (auto i = bucket_start[b]; i < bucket_start[b + 1]; i++) {
+						const auto& ph = photons[i];
+						auto offset = vec3(ph.p[0], ph.p[1], ph.p[2]) - p;
+						auto d2 = offset.length_squared();
+						if (d2 >= r2 || dot(vec3(ph.direction[0], ph.direction[1], ph.direction[2]), normal) >= 0)
+							continue;
+						sum += (1 - d2 / r2) * color(ph.power[0], ph.power[1], ph.power[2]);
+					}
+				}
+			}
+		}
+		return sum * (2 / (pi * r2));
+	}
+
+private:
+	double radius, cell_size;
+	size_t emitted_paths;
+	uint32_t mask = 0;
+	std::vector<photon> photons;          // Sorted by bucket
+	std::vector<uint32_t> bucket_start;   // First photon of each bucket, plus the end
+	std::vector<photon_target> targets;
+	std::atomic<bool> uncovered{ false };
+
+	int64_t cell(double v) const { return static_cast<int64_t>(std::floor(v / cell_size)); }
+
+	uint32_t bucket(int64_t x, int64_t y, int64_t z) const {
+		auto h = static_cast<uint64_t>(x) * 73856093u ^ static_cast<uint64_t>(y) * 19349663u ^ static_cast<uint64_t>(z) * 83492791u;
+		return static_cast<uint32_t>(h & mask);
+	}
+};
+
+class caustic_photon_tracer {
+	// Emits photons from the lights of a light hierarchy and from the sky (environment map or
+	// background color). Every photon is aimed at the bounding sphere of a caster, picked in
+	// proportion to its squared radius, and its power is divided by the combined density of all
+	// the casters that could have produced it, so overlapping casters are not counted twice.
+public:
+	caustic_photon_tracer(const hittable& _world, const light_bvh* lights, const environment_map* _environment,
+		const color& _background, const std::vector<aabb>& casters, const photon_settings& _settings)
+		: world(_world), environment(_environment), background(_background), settings(_settings)
+	{
+		auto scene = world.bounding_box();
+		scene_center = box_center(scene);
+		scene_radius = box_radius(scene);
+
+		double total_area = 0;
+		for (const auto& box : casters) {
+			targets.push_back({ box_center(box), std::max(box_radius(box), 1e-6), 0 });
+			total_area += targets.back().radius * targets.back().radius;
+		}
+		if (targets.empty()) {
+			targets.push_back({ scene_center, scene_radius, 0 });
+			total_area = scene_radius * scene_radius;
+		}
+		for (auto& t : targets)
+			t.probability = t.radius * t.radius / total_area;
+
+		// Sources in proportion to their power: pi * area * radiance for lights, and
+		// pi * radiance * surface area for the sky falling on the casters.
+		for (size_t i = 0; lights && i < lights->size(); i++) {
+			const auto& light = lights->light(i);
+			light_shape shape;
+			if (!light.get_light_shape(shape) || !shape.mat)
+				continue;
+			auto le = shape.mat->emitted(0.5, 0.5, shape.center);
+			auto sides = shape.two_sided ? 2 : 1;
+			sources.push_back({ &light, shape.area, sides, pi * shape.area * sides * luminance(le) });
+		}
+
+		auto sky = environment ? environment->average_luminance() : luminance(background);
+		if (sky > 0) {
+			double caster_area = 0;
+			for (const auto& t : targets)
+				caster_area += 4 * pi * t.radius * t.radius;
+			sources.push_back({ nullptr, 0, 0, pi * sky * caster_area });
+		}
+
+		double total_power = 0;
+		for (const auto& s : sources)
+			total_power += s.power;
+		for (auto& s : sources)
+			s.probability = s.power / total_power;
+	}
+
+	shared_ptr<photon_map> trace() const {
+		// Traces the paths in chunks with fixed seeds, in waves of chunks spread over the thread
+		// pool, and stops before the photon cap would be exceeded. Only whole chunks are kept,
+		// so the kept photons are an unbiased sample of the paths they came from.
+		std::vector<photon> stored;
+		size_t kept_paths = 0;
+		std::vector<photon_target> aimed;
+		for (const auto& t : targets)
+			aimed.push_back({ t.center, t.radius });
+		if (sources.empty() || settings.paths <= 0)
+			return make_shared<photon_map>(std::move(stored), settings.radius, kept_paths, std::move(aimed));
+
+		const int chunk_paths = 4096;
+		const int wave = 64;
+		int chunks = (settings.paths + chunk_paths - 1) / chunk_paths;
+		bool full = false;
+		for (int first = 0; first < chunks && !full; first += wave) {
+			int count = std::min(wave, chunks - first);
+			std::vector<std::vector<photon>> results(count);
+			Concurrency::parallel_for(0, count, [&](int k) {
+				auto chunk = first + k;
+				seed_random(hash_seed(static_cast<uint64_t>(chunk), 0x70686f746f6eULL));
+				auto end = std::min(settings.paths, (chunk + 1) * chunk_paths);
+				for (int i = chunk * chunk_paths; i < end; i++)
+					trace_path(results[k]);
+				});
+
+			for (int k = 0; k < count; k++) {
+				if (stored.size() + results[k].size() > settings.max_photons) {
+					full = true;
+					break;
+				}
+				stored.insert(stored.end(), results[k].begin(), results[k].end());
+				kept_paths += std::min(settings.paths, (first + k + 1) * chunk_paths) - (first + k) * chunk_paths;
+			}
+		}
+
+		// Photon powers were computed for a single path.
+		if (kept_paths > 0) {
+			auto scale = 1.0f / kept_paths;
+			for (auto& ph : stored)
+				for (auto& c : ph.power) c *= scale;
+		}
+		return make_shared<photon_map>(std::move(stored), settings.radius, kept_paths, std::move(aimed));
+	}
+
+private:
+	struct target {
+		point3 center;
+		double radius;
+		double probability;
+	};
+
+	struct source {
+		const hittable* light;  // Null for the sky
+		double area;
+		int sides;
+		double power;
+		double probability = 0;
+	};
+
+	const hittable& world;
+	const environment_map* environment;
+	color background;
+	photon_settings settings;
+	point3 scene_center;
+	double scene_radius;
+	std::vector<target> targets;
+	std::vector<source> sources;
+
+	static double luminance(const color& c) {
+		return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+	}
+
+	static point3 box_center(const aabb& box) {
+		return point3((box.x.min + box.x.max) / 2, (box.y.min + box.y.max) / 2, (box.z.min + box.z.max) / 2);
+	}
+
+	static double box_radius(const aabb& box) {
+		return vec3(box.x.size(), box.y.size(), box.z.size()).length() / 2;
+	}
+
+	static void basis(const vec3& w, vec3& u, vec3& v) {
+		auto a = (std::fabs(w.x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+		v = unit_vector(cross(w, a));
+		u = cross(w, v);
+	}
+
+	size_t pick_target() const {
+		auto u = random_double();
+		for (size_t t = 0; t + 1 < targets.size(); t++) {
+			if (u < targets[t].probability)
+				return t;
+			u -= targets[t].probability;
+		}
+		return targets.size() - 1;
+	}
+
+	static double one_minus_cos_max(double radius, double distance_squared) {
+		// 1 - cos of the half angle of a sphere's cone, accurate for small spheres.
+		auto s2 = radius * radius / distance_squared;
+		return s2 / (1 + std::sqrt(1 - s2));
+	}
+
+	vec3 sample_towards(const point3& p, const target& t) const {
+		// Uniform direction in the cone of the target's sphere, or on the whole sphere of
+		// directions from inside it.
+		auto to_center = t.center - p;
+		auto d2 = to_center.length_squared();
+		if (d2 <= t.radius * t.radius)
+			return random_unit_vector();
+
+		vec3 u, v;
+		auto w = unit_vector(to_center);
+		basis(w, u, v);
+		auto z = 1 - random_double() * one_minus_cos_max(t.radius, d2);
+		auto phi = 2 * pi * random_double();
+		auto sin_theta = std::sqrt(std::max(0.0, 1 - z * z));
+		return std::cos(phi) * sin_theta * u + std::sin(phi) * sin_theta * v + z * w;
+	}
+
+	double direction_pdf(const point3& p, const vec3& direction) const {
+		// Solid angle density of sample_towards() over all targets.
+		double pdf = 0;
+		for (const auto& t : targets) {
+			auto to_center = t.center - p;
+			auto d2 = to_center.length_squared();
+			if (d2 <= t.radius * t.radius) {
+				pdf += t.probability / (4 * pi);
+				continue;
+			}
+			auto spread = one_minus_cos_max(t.radius, d2);
+			if (dot(direction, to_center) / std::sqrt(d2) >= 1 - spread)
+				pdf += t.probability / (2 * pi * spread);
+		}
+		return pdf;
+	}
+
+	double line_density(const point3& origin, const vec3& direction) const {
+		// Density over the plane across `direction` of a sky photon's line, over all targets'
+		// disks it passes through.
+		double density = 0;
+		for (const auto& t : targets) {
+			auto offset = t.center - origin;
+			auto across = offset - dot(offset, direction) * direction;
+			if (across.length_squared() < t.radius * t.radius)
+				density += t.probability / (pi * t.radius * t.radius);
+		}
+		return density;
+	}
+
+	bool emit_from_light(const source& s, ray& r, color& power) const {
+		hit_record rec;
+		if (!s.light->sample_surface(rec))
+			return false;
+		auto normal = (s.sides == 2 && random_double() < 0.5) ? -rec.normal : rec.normal;
+
+		auto direction = sample_towards(rec.p, targets[pick_target()]);
+		auto cos_theta = dot(direction, normal);
+		auto pdf = direction_pdf(rec.p, direction);
+		if (cos_theta <= 0 || pdf <= 0)
+			return false;
+
+		// Radiance * cos / (area density * side choice * direction density).
+		power = rec.mat->emitted(rec.u, rec.v, rec.p) * (cos_theta * s.area * s.sides / pdf);
+		r = ray(rec.p, direction, random_double());
+		return true;
+	}
+
+	bool emit_from_sky(ray& r, color& power) const {
+		vec3 to_sky;
+		double direction_pdf;
+		if (environment) {
+			if (!environment->sample(random_double(), random_double(), to_sky, direction_pdf))
+				return false;
+		}
+		else {
+			to_sky = random_unit_vector();
+			direction_pdf = 1 / (4 * pi);
+		}
+		auto direction = -unit_vector(to_sky);
+
+		// A point on the target's disk across the direction, moved back outside the scene.
+		const auto& t = targets[pick_target()];
+		vec3 u, v;
+		basis(direction, u, v);
+		auto radius = t.radius * std::sqrt(random_double());
+		auto phi = 2 * pi * random_double();
+		auto on_disk = t.center + radius * (std::cos(phi) * u + std::sin(phi) * v);
+		auto origin = on_disk - direction * (2 * scene_radius + (on_disk - scene_center).length());
+
+		auto density = line_density(origin, direction);
+		if (density <= 0)
+			return false;
+
+		auto radiance = environment ? environment->value(to_sky) : background;
+		power = radiance / (direction_pdf * density);
+		r = ray(origin, direction, random_double());
+		return true;
+	}
+
+	void trace_path(std::vector<photon>& out) const {
+		// Picks a source, then follows the photon through specular bounces. It is stored at the
+		// first diffuse surface if it bounced at least once, and dropped otherwise.
+		auto u = random_double();
+		size_t index = 0;
+		while (index + 1 < sources.size() && u >= sources[index].probability)
+			u -= sources[index++].probability;
+		const auto& s = sources[index];
+
+		ray r;
+		color power;
+		if (!(s.light ? emit_from_light(s, r, power) : emit_from_sky(r, power)))
+			return;
+		power = power / s.probability;
+
+		bool specular = false;
+		for (int depth = 0; depth < settings.max_depth; depth++) {
+			hit_record rec;
+			if (!world.hit(r, interval(0.001, infinity), rec))
+				return;
+
+			ray scattered;
+			color attenuation;
+			if (!rec.mat->scatter(r, rec, attenuation, scattered))
+				return;
+
+			if (rec.mat->scattering_pdf(r, rec, scattered) > 0) {
+				if (specular && rec.normal.length_squared() > 0) {
+					auto d = unit_vector(r.direction());
+					out.push_back({ { float(rec.p.x()), float(rec.p.y()), float(rec.p.z()) },
+						{ float(d.x()), float(d.y()), float(d.z()) },
+						{ float(power.x()), float(power.y()), float(power.z()) } });
+				}
+				return;
+			}
+
+			specular = true;
+			power = power * attenuation;
+			r = scattered;
+		}
+	}
+};
+
+#endif
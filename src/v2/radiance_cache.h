@@ -0,0 +1,197 @@
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+
+#include "vec3.h"
+#include "aabb.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// World-space cache of the light reflected by diffuse surfaces, for static scenes. Records sit
+// in a hashed grid keyed by cell and by the axis the surface normal faces most, and average the
+// reflected light per unit albedo that paths find there. Paths past their first diffuse bounce
+// read a record once its mean is known well enough and stop there, and otherwise trace on and
+// add what they find. Records are filled while rendering, from any thread, and survive across
+// renders, so later frames of a walkthrough start from what earlier ones learned.
+
+struct radiance_cache_settings {
+	double cell_size = 1;        // Edge of a grid cell, in scene units
+	double max_error = 0.05;     // Relative standard error of a record's mean at which it is used
+	int    min_samples = 32;     // Samples a record needs before its error is trusted
+	int    max_samples = 1024;   // Samples after which a record is used whatever its error
+	size_t capacity = 1u << 20;  // Records; spots beyond it are traced every time
+};
+
+class radiance_cache {
+	// An open addressing table with linear probing. Keys are claimed with a compare-and-swap and
+	// never move, and statistics are added with relaxed atomics, so threads never wait for each
+	// other. Which samples a record keeps depends on the order threads reach it, so renders
+	// with a cache are not reproducible bit for bit.
+public:
+	struct record {
+		std::atomic<uint64_t> key;  // Zero while free
+		std::atomic<float> sum[3];
+		std::atomic<float> sum_squares;  // Of the luminance
+		std::atomic<uint32_t> count;
+	};
+
+	radiance_cache(const radiance_cache_settings& _settings = radiance_cache_settings())
+		: settings(_settings)
+	{
+		size_t size = 1;
+		while (size < settings.capacity) size <<= 1;
+		mask = size - 1;
+		records = std::vector<record>(size);
+		clear();
+	}
+
+	const radiance_cache_settings& config() const { return settings; }
+
+	record* find(const point3& p, const vec3& normal) {
+		// The record of p's cell and normal bin, claimed if new. Null when the table is too full
+		// around its slot.
+		auto key = make_key(p, normal);
+		auto slot = hash(key);
+		for (int probe = 0; probe < max_probes; probe++, slot = (slot + 1) & mask) {
+			auto& r = records[slot];
+			auto current = r.key.load(std::memory_order_acquire);
+			if (current == key)
+				return &r;
+			if (current == 0) {
+				if (r.key.compare_exchange_strong(current, key, std::memory_order_acq_rel) || current == key)
+					return &r;
+			}
+		}
+		return nullptr;
+	}
+
+	bool lookup(const record& r, color& reflected) const {
+		// The record's mean, if it has converged.
+		auto n = r.count.load(std::memory_order_relaxed);
+		if (n < static_cast<uint32_t>(settings.min_samples))
+			return false;
+
+		color mean(r.sum[0].load(std::memory_order_relaxed) / n, r.sum[1].load(std::memory_order_relaxed) / n,
+			r.sum[2].load(std::memory_order_relaxed) / n);
+		if (n < static_cast<uint32_t>(settings.max_samples)) {
+			auto l = luminance(mean);
+			auto variance = r.sum_squares.load(std::memory_order_relaxed) / n - l * l;
+			if (l <= 0 || variance > settings.max_error * settings.max_error * l * l * n)
+				return false;
+		}
+		reflected = mean;
+		return true;
+	}
+
+	void add(record& r, const color& reflected) {
+		auto l = luminance(reflected);
+		if (!std::isfinite(l))
+			return;
+		for (int c = 0; c < 3; c++)
+			add_float(r.sum[c], static_cast<float>(reflected[c]));
+		add_float(r.sum_squares, static_cast<float>(l * l));
+		r.count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void clear() {
+		for (auto& r : records) {
+			r.key.store(0, std::memory_order_relaxed);
+			reset(r);
+		}
+	}
+
+	void invalidate(const aabb& region) {
+		// Restarts the records of the cells that touch `region`, after something in it changed.
+		// Not safe during a render.
+		auto lo = cell(point3(region.x.min, region.y.min, region.z.min));
+		auto hi = cell(point3(region.x.max, region.y.max, region.z.max));
+		for (auto& r : records) {
+			auto key = r.key.load(std::memory_order_relaxed);
+			if (key == 0)
+				continue;
+			bool inside = true;
+			for (int a = 0; a < 3; a++) {
+				auto c = static_cast<int64_t>((key >> (1 + 20 * a)) & cell_mask) - cell_bias;
+				inside = inside && c >= lo[a] && c <= hi[a];
+			}
+			if (inside)
+				reset(r);
+		}
+	}
+
+	void statistics(size_t& used, size_t& converged) const {
+		used = converged = 0;
+		color unused;
+		for (const auto& r : records) {
+			if (r.key.load(std::memory_order_relaxed) == 0)
+				continue;
+			used++;
+			if (lookup(r, unused))
+				converged++;
+		}
+	}
+
+private:
+	static const int max_probes = 16;
+	static const uint64_t cell_mask = (1u << 20) - 1;
+	static const int64_t cell_bias = 1 << 19;
+
+	radiance_cache_settings settings;
+	std::vector<record> records;
+	size_t mask = 0;
+
+	static double luminance(const color& c) {
+		return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+	}
+
+	static void add_float(std::atomic<float>& target, float value) {
+		auto current = target.load(std::memory_order_relaxed);
+		while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+	}
+
+	static void reset(record& r) {
+		for (auto& s : r.sum) s.store(0, std::memory_order_relaxed);
+		r.sum_squares.store(0, std::memory_order_relaxed);
+		r.count.store(0, std::memory_order_relaxed);
+	}
+
+	struct cell_index {
+		int64_t c[3];
+		int64_t operator[](int a) const { return c[a]; }
+	};
+
+	cell_index cell(const point3& p) const {
+		cell_index result;
+		for (int a = 0; a < 3; a++) {
+			auto c = static_cast<int64_t>(std::floor(p[a] / settings.cell_size));
+			result.c[a] = std::max(-cell_bias, std::min(cell_bias - 1, c));
+		}
+		return result;
+	}
+
+	uint64_t make_key(const point3& p, const vec3& normal) const {
+		// Cell coordinates in 20 bits each and the normal's dominant axis and sign in 3 bits,
+		// above a set low bit that keeps every key non-zero.
+		auto c = cell(p);
+		int axis = 0;
+		for (int a = 1; a < 3; a++)
+			if (std::fabs(normal[a]) > std::fabs(normal[axis])) axis = a;
+		uint64_t bin = 2 * axis + (normal[axis] < 0);
+
+		uint64_t key = 1;
+		for (int a = 0; a < 3; a++)
+			key |= static_cast<uint64_t>(c[a] + cell_bias) << (1 + 20 * a);
+		return key | (bin << 61);
+	}
+
+	size_t hash(uint64_t key) const {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return static_cast<size_t>(key) & mask;
+	}
+};
+
+#endif
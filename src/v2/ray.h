@@ -22,6 +22,20 @@ public:
         return orig + t * dir;
     }
 
+    void set_differentials(const point3& rx_o, const vec3& rx_d, const point3& ry_o, const vec3& ry_d) {
+        // Attaches the rays through the neighboring pixels in x and y, used to estimate the
+        // texture footprint of this ray at its hit point.
+        rx_origin = rx_o;
+        rx_direction = rx_d;
+        ry_origin = ry_o;
+        ry_direction = ry_d;
+        has_differentials = true;
+    }
+
+    bool has_differentials = false;
+    point3 rx_origin, ry_origin;
+    vec3 rx_direction, ry_direction;
+
 private:
     point3 orig;
     vec3 dir;
@@ -0,0 +1,129 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "material.h"
+#include "texture.h"
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <tuple>
+
+class scene_registry {
+	// Interns textures and materials while a scene is built. Requests with identical parameters
+	// return the same shared object, and each image file is decoded once, so scenes with many
+	// repeated materials end up with a small material table. Not thread-safe: build scenes on
+	// one thread.
+public:
+	shared_ptr<texture> solid(const color& c) {
+		request_scope scope(*this);
+		auto key = std::make_tuple(c.x(), c.y(), c.z());
+		return intern(solid_textures, key, [&] { return make_shared<solid_color>(c); });
+	}
+
+	shared_ptr<texture> image(const std::string& filename, texture_filter filter = texture_filter::trilinear,
+		texel_format format = texel_format::srgb8) {
+		request_scope scope(*this);
+		auto key = std::make_tuple(filename, static_cast<int>(filter), static_cast<int>(format));
+		return intern(image_textures, key, [&]() -> shared_ptr<texture> {
+			// The tiled cache already shares one copy per file; otherwise share the resident pyramid.
+			if (texture_cache::global().enabled()) {
+				if (auto tiled = texture_cache::global().open(filename, format))
+					return make_shared<image_texture>(tiled, filter);
+			}
+			auto mips = intern(image_data, std::make_tuple(filename, static_cast<int>(format)),
+				[&] { return make_shared<const mipmap>(rtw_image(filename.c_str()), format); });
+			return make_shared<image_texture>(mips, filter);
+			});
+	}
+
+	shared_ptr<texture> checker(double scale, const color& even, const color& odd) {
+		request_scope scope(*this);
+		return checker(scale, solid(even), solid(odd));
+	}
+
+	shared_ptr<texture> checker(double scale, shared_ptr<texture> even, shared_ptr<texture> odd) {
+		request_scope scope(*this);
+		auto key = std::make_tuple(scale, even.get(), odd.get());
+		return intern(checker_textures, key, [&] { return make_shared<checker_texture>(scale, even, odd); });
+	}
+
+	shared_ptr<material> lambertian(const color& albedo) {
+		request_scope scope(*this);
+		return lambertian(solid(albedo));
+	}
+
+	shared_ptr<material> lambertian(shared_ptr<texture> albedo) {
+		request_scope scope(*this);
+		return material_for(kind::lambertian, albedo.get(), 0, [&] { return make_shared<::lambertian>(albedo); });
+	}
+
+	shared_ptr<material> metal(const color& albedo, double fuzz) {
+		request_scope scope(*this);
+		auto key = std::make_tuple(static_cast<int>(kind::metal), albedo.x(), albedo.y(), albedo.z(), fuzz,
+			static_cast<const texture*>(nullptr));
+		return intern(materials, key, [&] { return make_shared<::metal>(albedo, fuzz); });
+	}
+
+	shared_ptr<material> dielectric(double index_of_refraction) {
+		request_scope scope(*this);
+		return material_for(kind::dielectric, nullptr, index_of_refraction,
+			[&] { return make_shared<::dielectric>(index_of_refraction); });
+	}
+
+	shared_ptr<material> diffuse_light(const color& emit) {
+		request_scope scope(*this);
+		return diffuse_light(solid(emit));
+	}
+
+	shared_ptr<material> diffuse_light(shared_ptr<texture> emit) {
+		request_scope scope(*this);
+		return material_for(kind::diffuse_light, emit.get(), 0, [&] { return make_shared<::diffuse_light>(emit); });
+	}
+
+	void report(std::ostream& out) const {
+		out << "Scene registry: " << materials.size() << " materials, "
+			<< solid_textures.size() + image_textures.size() + checker_textures.size() << " textures, "
+			<< image_data.size() << " image files for " << requests << " requests\n";
+	}
+
+private:
+	enum class kind { lambertian, metal, dielectric, diffuse_light };
+
+	// Materials are keyed by kind, up to four numeric parameters and the texture they reference.
+	using material_key = std::tuple<int, double, double, double, double, const texture*>;
+
+	std::map<std::tuple<double, double, double>, shared_ptr<texture>> solid_textures;
+	std::map<std::tuple<std::string, int, int>, shared_ptr<texture>> image_textures;
+	std::map<std::tuple<double, const texture*, const texture*>, shared_ptr<texture>> checker_textures;
+	std::map<std::tuple<std::string, int>, shared_ptr<const mipmap>> image_data;
+	std::map<material_key, shared_ptr<material>> materials;
+	size_t requests = 0;  // Calls from outside, not counting the calls they make to each other
+	int depth = 0;
+
+	struct request_scope {
+		scene_registry& registry;
+		explicit request_scope(scene_registry& _registry) : registry(_registry) {
+			if (registry.depth++ == 0)
+				registry.requests++;
+		}
+		~request_scope() { registry.depth--; }
+	};
+
+	template <typename table, typename key_type, typename factory>
+	typename table::mapped_type intern(table& t, const key_type& key, factory make) {
+		auto found = t.find(key);
+		if (found != t.end())
+			return found->second;
+		auto created = make();
+		t.emplace(key, created);
+		return created;
+	}
+
+	template <typename factory>
+	shared_ptr<material> material_for(kind k, const texture* tex, double param, factory make) {
+		return intern(materials, material_key(static_cast<int>(k), param, 0, 0, 0, tex), make);
+	}
+};
+
+#endif
@@ -11,19 +11,23 @@
 #include "external/stb_image.h"
 
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
 
 class rtw_image {
 public:
     rtw_image() : data(nullptr) {}
 
-    rtw_image(const char* image_filename) {
+    rtw_image(const char* image_filename, bool as_float = false) : float_pixels(as_float) {
         // Loads image data from the specified file. If the RTW_IMAGES environment variable is
         // defined, looks only in that directory for the image file. If the image was not found,
         // searches for the specified image file first from the current directory, then in the
         // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
         // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
+        // width() and height() will return 0. With `as_float` the pixels are kept as linear
+        // floats (HDR files keep their full range; 8-bit files are linearized by stb) and are
+        // read with float_pixel_data().
 
         auto filename = std::string(image_filename);
         auto imagedir = getenv("RTW_IMAGES");
@@ -42,18 +46,40 @@ public:
         std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
     }
 
-    ~rtw_image() { STBI_FREE(data); }
+    ~rtw_image() { STBI_FREE(data); STBI_FREE(fdata); }
+
+    static std::string locate(const char* image_filename) {
+        // Returns the path the constructor would load the image from, searching the same
+        // places in the same order, or an empty string if no such file exists.
+        auto filename = std::string(image_filename);
+        auto imagedir = getenv("RTW_IMAGES");
+        if (imagedir) {
+            auto path = std::string(imagedir) + "/" + filename;
+            if (std::ifstream(path)) return path;
+        }
+
+        std::string prefix = "images/";
+        if (std::ifstream(filename)) return filename;
+        for (int up = 0; up <= 6; up++, prefix = "../" + prefix)
+            if (std::ifstream(prefix + filename)) return prefix + filename;
+        return "";
+    }
 
     bool load(const std::string filename) {
         // Loads image data from the given file name. Returns true if the load succeeded.
         auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
+        if (float_pixels) {
+            fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+            bytes_per_scanline = image_width * bytes_per_pixel;
+            return fdata != nullptr;
+        }
         data = stbi_load(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
         bytes_per_scanline = image_width * bytes_per_pixel;
         return data != nullptr;
     }
 
-    int width()  const { return (data == nullptr) ? 0 : image_width; }
-    int height() const { return (data == nullptr) ? 0 : image_height; }
+    int width()  const { return (data == nullptr && fdata == nullptr) ? 0 : image_width; }
+    int height() const { return (data == nullptr && fdata == nullptr) ? 0 : image_height; }
 
     const unsigned char* pixel_data(int x, int y) const {
         // Return the address of the three bytes of the pixel at x,y (or magenta if no data).
@@ -66,9 +92,23 @@ public:
         return data + y * bytes_per_scanline + x * bytes_per_pixel;
     }
 
+    const float* float_pixel_data(int x, int y) const {
+        // Return the address of the three linear floats of the pixel at x,y of an image loaded
+        // as floats (or magenta if no data).
+        static float magenta[] = { 1, 0, 1 };
+        if (fdata == nullptr) return magenta;
+
+        x = clamp(x, 0, image_width);
+        y = clamp(y, 0, image_height);
+
+        return fdata + y * bytes_per_scanline + x * bytes_per_pixel;
+    }
+
 private:
     const int bytes_per_pixel = 3;
-    unsigned char* data;
+    unsigned char* data = nullptr;
+    float* fdata = nullptr;
+    bool float_pixels = false;
     int image_width, image_height;
     int bytes_per_scanline;
 
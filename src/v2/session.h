@@ -0,0 +1,178 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "camera.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+// A long-lived render of one scene whose camera is edited from a stream of commands, normally
+// stdin. The world, its BVH and its textures stay loaded, so an edit costs a render rather than
+// a restart. Renders are progressive: passes of 1, 1, 2, 4, ... samples per pixel are added to
+// the framebuffer and the image is written after each, up to samples_per_pixel. An edit cancels
+// the tiles in flight and starts over from the first pass.
+//
+// Commands, one per line:
+//   lookfrom <x> <y> <z>    lookat <x> <y> <z>    vup <x> <y> <z>
+//   vfov <degrees>          defocus_angle <degrees>  focus_dist <distance>
+//   spp <samples>           width <pixels>        max_depth <bounces>
+//   denoise <passes>        output <file name>
+//   render                  starts over without changes
+//   quit                    cancels the render in flight and ends the session
+// At the end of the stream the session ends once the current render has finished. run() returns
+// false if any image could not be written.
+
+class render_session {
+public:
+	render_session(const camera& _settings, const hittable& _world) : settings(_settings), world(_world) {}
+
+	bool run(std::istream& in) {
+		if (settings.integrator != integrator_mode::path_tracing)
+			std::clog << "Sessions render with path tracing.\n";
+
+		// The photon map does not depend on the camera, so it is traced once here and every
+		// render's copy of the settings shares it.
+		settings.prepare(world);
+
+		std::thread renderer([this] { render_loop(); });
+		std::string line;
+		while (std::getline(in, line)) {
+			std::istringstream words(line);
+			std::string command;
+			if (!(words >> command))
+				continue;
+			if (command == "quit") {
+				std::lock_guard<std::mutex> lock(mutex);
+				quit = true;
+				cancel = true;
+				break;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (apply(command, words)) {
+				changed = true;
+				cancel = true;
+				wake.notify_one();
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
+		}
+		wake.notify_one();
+		renderer.join();
+		return !write_failed;
+	}
+
+private:
+	camera settings;  // Edited under the mutex; each render works on a copy
+	const hittable& world;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool changed = true;  // Settings changed since the current render started
+	bool done = false;    // No more commands; exit once the settings are rendered
+	bool quit = false;    // Exit without finishing the current render
+	std::atomic<bool> cancel{ false };
+	bool write_failed = false;  // Set by the render thread, read after it has been joined
+
+	bool apply(const std::string& command, std::istringstream& words) {
+		// Applies one command to the settings; false if it is unknown or malformed, which leaves
+		// the settings as they were.
+		auto read_double = [&](double& value) {
+			double x;
+			if (!(words >> x))
+				return false;
+			value = x;
+			return true;
+		};
+		auto read_vec = [&](vec3& v) {
+			double x, y, z;
+			if (!(words >> x >> y >> z))
+				return false;
+			v = vec3(x, y, z);
+			return true;
+		};
+		auto read_int = [&](int& value, int min) {
+			int n;
+			if (!(words >> n) || n < min)
+				return false;
+			value = n;
+			return true;
+		};
+
+		bool ok = false;
+		if (command == "lookfrom") ok = read_vec(settings.lookfrom);
+		else if (command == "lookat") ok = read_vec(settings.lookat);
+		else if (command == "vup") ok = read_vec(settings.vup);
+		else if (command == "vfov") ok = read_double(settings.vfov);
+		else if (command == "defocus_angle") ok = read_double(settings.defocus_angle);
+		else if (command == "focus_dist") ok = read_double(settings.focus_dist);
+		else if (command == "spp") ok = read_int(settings.samples_per_pixel, 1);
+		else if (command == "width") ok = read_int(settings.image_width, 1);
+		else if (command == "max_depth") ok = read_int(settings.max_depth, 1);
+		else if (command == "denoise") ok = read_int(settings.denoising.passes, 0);
+		else if (command == "output") {
+			std::string name;
+			ok = static_cast<bool>(words >> name);
+			if (ok) settings.file_name = name;
+		}
+		else if (command == "render") ok = true;
+		else {
+			std::cerr << "ERROR: Unknown session command '" << command << "'.\n";
+			return false;
+		}
+
+		if (!ok)
+			std::cerr << "ERROR: Could not read the arguments of '" << command << "'.\n";
+		return ok;
+	}
+
+	void render_loop() {
+		while (true) {
+			camera view;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return changed || done; });
+				if (quit || !changed)
+					return;
+				changed = false;
+				cancel = false;
+				view = settings;
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			view.prepare(world);
+			auto frame = view.make_framebuffer();
+			int samples = 0, count = 1;
+			bool written = true;
+			while (samples < view.samples_per_pixel) {
+				// Each pass after the first doubles the samples so far.
+				count = std::min(count, view.samples_per_pixel - samples);
+				if (!view.render_samples(world, frame, samples, count, cancel))
+					break;
+				samples += count;
+				count = samples;
+				if (!view.write_frame(frame)) {
+					// Further passes could not be written either; an output command can name another file.
+					write_failed = true;
+					written = false;
+					break;
+				}
+
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				std::clog << "\r" << samples << " of " << view.samples_per_pixel << " samples per pixel, "
+					<< elapsed.count() << " s" << std::flush;
+			}
+			if (written)
+				std::clog << (samples < view.samples_per_pixel ? " (cancelled)\n" : "\n");
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef TEXEL_FORMAT_H
+#define TEXEL_FORMAT_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Internal storage formats for texture texels. Textures are decoded once at load time, so the
+// lookup path only has to widen stored values to linear float.
+enum class texel_format : int32_t {
+	srgb8,   // 8-bit sRGB-encoded RGB, decoded through a 256-entry table (3 bytes per texel)
+	half,    // 16-bit float linear RGB (6 bytes per texel)
+	float32  // 32-bit float linear RGB (12 bytes per texel)
+};
+
+constexpr int texel_bytes(texel_format format) {
+	switch (format) {
+	case texel_format::half:    return 6;
+	case texel_format::float32: return 12;
+	default:                    return 3;
+	}
+}
+
+inline const char* texel_format_name(texel_format format) {
+	switch (format) {
+	case texel_format::half:    return "half";
+	case texel_format::float32: return "float";
+	default:                    return "srgb8";
+	}
+}
+
+inline const float* srgb_to_linear_table() {
+	static const auto table = [] {
+		std::array<float, 256> t;
+		for (int i = 0; i < 256; i++) {
+			auto c = i / 255.0;
+			t[i] = static_cast<float>((c <= 0.04045) ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+		}
+		return t;
+	}();
+	return table.data();
+}
+
+inline unsigned char linear_to_srgb8(float linear) {
+	auto c = std::fmin(std::fmax(linear, 0.0f), 1.0f);
+	auto s = (c <= 0.0031308f) ? 12.92f * c : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+	return static_cast<unsigned char>(s * 255.0f + 0.5f);
+}
+
+inline float half_to_float(uint16_t h) {
+	// Branch-light IEEE half to float conversion, handling denormals, infinities and NaNs.
+	const uint32_t shifted_exp = 0x7c00u << 13;
+	uint32_t bits = (h & 0x7fffu) << 13;
+	uint32_t exp = shifted_exp & bits;
+	bits += (127 - 15) << 23;
+
+	float f;
+	if (exp == shifted_exp) {
+		bits += (128 - 16) << 23;
+	}
+	else if (exp == 0) {
+		const uint32_t magic_bits = 113u << 23;
+		float magic;
+		std::memcpy(&magic, &magic_bits, 4);
+		bits += 1 << 23;
+		std::memcpy(&f, &bits, 4);
+		f -= magic;
+		std::memcpy(&bits, &f, 4);
+	}
+	bits |= static_cast<uint32_t>(h & 0x8000u) << 16;
+	std::memcpy(&f, &bits, 4);
+	return f;
+}
+
+inline uint16_t float_to_half(float value) {
+	// Float to IEEE half with round-to-nearest-even; out-of-range values become infinity.
+	const uint32_t f32_infinity = 255u << 23;
+	const uint32_t f16_max = (127u + 16) << 23;
+	const uint32_t denorm_magic_bits = ((127u - 15) + (23 - 10) + 1) << 23;
+
+	uint32_t bits;
+	std::memcpy(&bits, &value, 4);
+	uint32_t sign = bits & 0x80000000u;
+	bits ^= sign;
+
+	uint16_t h;
+	if (bits >= f16_max) {
+		h = (bits > f32_infinity) ? 0x7e00 : 0x7c00;
+	}
+	else if (bits < (113u << 23)) {
+		float f, denorm_magic;
+		std::memcpy(&f, &bits, 4);
+		std::memcpy(&denorm_magic, &denorm_magic_bits, 4);
+		f += denorm_magic;
+		std::memcpy(&bits, &f, 4);
+		h = static_cast<uint16_t>(bits - denorm_magic_bits);
+	}
+	else {
+		uint32_t mant_odd = (bits >> 13) & 1;
+		bits += (static_cast<uint32_t>(15 - 127) << 23) + 0xfff;
+		bits += mant_odd;
+		h = static_cast<uint16_t>(bits >> 13);
+	}
+	return static_cast<uint16_t>(h | (sign >> 16));
+}
+
+template <typename function>
+auto with_texel_format(texel_format format, function&& f) {
+	// Calls f with the format as a compile-time constant, so per-texel code is instantiated once
+	// per format instead of switching on it for every texel.
+	switch (format) {
+	case texel_format::half:    return f(std::integral_constant<texel_format, texel_format::half>());
+	case texel_format::float32: return f(std::integral_constant<texel_format, texel_format::float32>());
+	default:                    return f(std::integral_constant<texel_format, texel_format::srgb8>());
+	}
+}
+
+template <texel_format format>
+inline void decode_texel(const unsigned char* p, float* rgb) {
+	// Widens one stored texel to linear float RGB.
+	if constexpr (format == texel_format::srgb8) {
+		auto table = srgb_to_linear_table();
+		rgb[0] = table[p[0]];
+		rgb[1] = table[p[1]];
+		rgb[2] = table[p[2]];
+	}
+	else if constexpr (format == texel_format::half) {
+		uint16_t h[3];
+		std::memcpy(h, p, sizeof(h));
+		for (int c = 0; c < 3; c++)
+			rgb[c] = half_to_float(h[c]);
+	}
+	else {
+		std::memcpy(rgb, p, 3 * sizeof(float));
+	}
+}
+
+inline void encode_texel(texel_format format, const float* rgb, unsigned char* p) {
+	// Stores one linear float RGB texel in the given format.
+	switch (format) {
+	case texel_format::srgb8:
+		for (int c = 0; c < 3; c++)
+			p[c] = linear_to_srgb8(rgb[c]);
+		break;
+	case texel_format::half: {
+		uint16_t h[3] = { float_to_half(rgb[0]), float_to_half(rgb[1]), float_to_half(rgb[2]) };
+		std::memcpy(p, h, sizeof(h));
+		break;
+	}
+	case texel_format::float32:
+		std::memcpy(p, rgb, 3 * sizeof(float));
+		break;
+	}
+}
+
+#endif
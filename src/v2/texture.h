@@ -1,6 +1,9 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 #include "rtw_image.h"
+#include "mipmap.h"
+#include "texture_cache.h"
+#include "hittable.h"
 #include "vec3.h"
 
 class texture {
@@ -8,6 +11,12 @@ public:
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    // Looks up the texture for a surface hit. Textures that filter over the hit's footprint
+    // (from its texture coordinate derivatives) override this; the rest ignore the footprint.
+    virtual color lookup(const hit_record& rec) const {
+        return value(rec.u, rec.v, rec.p);
+    }
 };
 
 class solid_color : public texture {
@@ -45,6 +54,16 @@ public:
         return isEven ? even->value(u, v, p) : odd->value(u, v, p);
     }
 
+    color lookup(const hit_record& rec) const override {
+        auto xInteger = static_cast<int>(std::floor(inv_scale * rec.p.x()));
+        auto yInteger = static_cast<int>(std::floor(inv_scale * rec.p.y()));
+        auto zInteger = static_cast<int>(std::floor(inv_scale * rec.p.z()));
+
+        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+
+        return isEven ? even->lookup(rec) : odd->lookup(rec);
+    }
+
 private:
     double inv_scale;
     shared_ptr<texture> even;
@@ -54,26 +73,50 @@ private:
 
 class image_texture : public texture {
 public:
-    image_texture(const char* filename) : image(filename) {}
+    image_texture(const char* filename, texture_filter _filter = texture_filter::trilinear,
+        texel_format format = texel_format::srgb8) : filter(_filter) {
+        // Texels are decoded to linear once and stored in `format`: srgb8 is smallest, half and
+        // float keep more precision in dark regions and mips at two and four times the memory.
+        // With the texture cache enabled, tiles are paged in on demand and shared with every
+        // other texture of the same file; otherwise the whole pyramid is kept resident.
+        if (texture_cache::global().enabled())
+            tiled = texture_cache::global().open(filename, format);
+        if (!tiled)
+            image = make_shared<const mipmap>(rtw_image(filename), format);
+    }
+
+    image_texture(shared_ptr<const mipmap> _image, texture_filter _filter = texture_filter::trilinear)
+        : image(_image), filter(_filter) {}
+
+    image_texture(shared_ptr<tiled_texture> _tiled, texture_filter _filter = texture_filter::trilinear)
+        : tiled(_tiled), filter(_filter) {}
 
     color value(double u, double v, const point3& p) const override {
+        // Without a footprint, sample the full resolution level.
+        return lookup(u, v, 0, 0, 0, 0);
+    }
+
+    color lookup(const hit_record& rec) const override {
+        return lookup(rec.u, rec.v, rec.dudx, rec.dvdx, rec.dudy, rec.dvdy);
+    }
+
+private:
+    shared_ptr<const mipmap> image;  // Resident pyramid, possibly shared with other textures
+    shared_ptr<tiled_texture> tiled;
+    texture_filter filter;
+
+    color lookup(double u, double v, double dudx, double dvdx, double dudy, double dvdy) const {
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0) return color(0, 1, 1);
+        if (!tiled && (!image || image->empty())) return color(0, 1, 1);
 
         // Clamp input texture coordinates to [0,1] x [1,0]
         u = interval(0, 1).clamp(u);
         v = 1.0 - interval(0, 1).clamp(v);  // Flip V to image coordinates
 
-        auto i = static_cast<int>(u * image.width());
-        auto j = static_cast<int>(v * image.height());
-        auto pixel = image.pixel_data(i, j);
-
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+        if (tiled)
+            return tiled->filter(filter, u, v, dudx, -dvdx, dudy, -dvdy);
+        return image->filter(filter, u, v, dudx, -dvdx, dudy, -dvdy);
     }
-
-private:
-    rtw_image image;
 };
 
 #endif
\ No newline at end of file
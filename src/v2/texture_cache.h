@@ -0,0 +1,404 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "mipmap.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Textures are converted once into a tiled mip pyramid on disk (.rtwtex) and paged in tile by
+// tile on demand. A tiled file records the size and modification time of its source image and
+// is converted again when they change. Resident tiles are shared by every texture that
+// references the same file and evicted least-recently-used first once the memory budget is
+// exceeded. The budget covers every tile in memory, including evicted ones that a thread's
+// recent-tile table still holds.
+
+class texture_cache;
+
+struct texture_tile {
+	std::vector<unsigned char> texels;  // tile_size * tile_size texels in the texture's format, edge tiles padded
+};
+
+class tiled_texture {
+public:
+	int levels() const { return static_cast<int>(level_table.size()); }
+	int width(int lvl) const { return level_table[lvl].width; }
+	int height(int lvl) const { return level_table[lvl].height; }
+
+	texel_format storage_format() const { return format; }
+
+	template <texel_format stored>
+	void fetch(int lvl, int x, int y, float* rgb) const;
+
+	color filter(texture_filter mode, double s, double t,
+		double dsdx, double dtdx, double dsdy, double dtdy) const {
+		return with_texel_format(format, [&](auto stored) {
+			return mip_filter(typed_texels<tiled_texture, stored>{ *this }, mode, s, t, dsdx, dtdx, dsdy, dtdy);
+			});
+	}
+
+private:
+	friend class texture_cache;
+
+	struct level_info {
+		int32_t width, height;
+		int32_t tiles_x, tiles_y;
+		int64_t offset;  // File offset of the level's first tile
+	};
+
+	uint32_t id = 0;
+	int tile_size = 0;
+	texel_format format = texel_format::srgb8;
+	std::vector<level_info> level_table;
+	texture_cache* cache = nullptr;
+
+	mutable std::mutex file_mutex;
+	mutable std::ifstream file;
+
+	size_t tile_bytes() const { return static_cast<size_t>(tile_size) * tile_size * texel_bytes(format); }
+
+	bool read_tile(int lvl, int tx, int ty, std::vector<unsigned char>& texels) const {
+		const level_info& l = level_table[lvl];
+		auto offset = l.offset + static_cast<int64_t>(ty * l.tiles_x + tx) * tile_bytes();
+		texels.resize(tile_bytes());
+
+		std::lock_guard<std::mutex> lock(file_mutex);
+		file.seekg(offset);
+		return static_cast<bool>(file.read(reinterpret_cast<char*>(texels.data()), texels.size()));
+	}
+};
+
+class texture_cache {
+public:
+	struct statistics {
+		uint64_t hits = 0;       // Tile requests served from memory
+		uint64_t misses = 0;     // Tile requests that read from disk
+		uint64_t evictions = 0;  // Tiles dropped to stay within the budget
+		size_t resident_bytes = 0;  // Tiles in the table
+		size_t peak_bytes = 0;      // Tiles in memory at most, held by the table or by threads
+	};
+
+	static texture_cache& global() {
+		static texture_cache cache;
+		return cache;
+	}
+
+	void enable(size_t budget_bytes, const std::string& directory = "texcache") {
+		// Routes image textures through the cache. Tiled files are written to `directory`.
+		std::lock_guard<std::mutex> lock(mutex);
+		budget = budget_bytes;
+		cache_directory = directory;
+		is_enabled = true;
+	}
+
+	bool enabled() const { return is_enabled; }
+
+	std::shared_ptr<tiled_texture> open(const std::string& filename, texel_format format = texel_format::srgb8, int tile_size = 64) {
+		// Returns the shared tiled texture for an image file in the given texel format, converting
+		// it on first use. Returns null if the image cannot be loaded.
+		std::lock_guard<std::mutex> lock(open_mutex);
+		auto name = filename + "." + texel_format_name(format);
+		auto found = textures.find(name);
+		if (found != textures.end())
+			return found->second;
+
+		auto path = tiled_path(name);
+		auto source = source_stamp(filename);
+		auto tex = load_tiled(path, source);
+		if (!tex && convert(filename, format, path, tile_size, source))
+			tex = load_tiled(path, source);
+		if (!tex)
+			return nullptr;
+
+		tex->id = static_cast<uint32_t>(textures.size() + 1);
+		tex->cache = this;
+		textures[name] = tex;
+
+		// The recent-tile tables of all threads may hold at most half the budget.
+		largest_tile = std::max(largest_tile, tex->tile_bytes());
+		size_t threads = std::max(1u, std::thread::hardware_concurrency());
+		uint32_t mask = 31;
+		while (mask > 0 && threads * (mask + 1) * largest_tile > budget / 2)
+			mask >>= 1;
+		recent_mask.store(mask, std::memory_order_relaxed);
+		return tex;
+	}
+
+	const texture_tile* fetch(const tiled_texture& tex, int lvl, int tx, int ty) {
+		// Returns the requested tile, loading it from disk on a miss. The pointer stays valid on
+		// this thread until its next fetch, because the thread's recent-tile table keeps a reference.
+		auto key = (static_cast<uint64_t>(tex.id) << 40) | (static_cast<uint64_t>(lvl) << 32)
+			| (static_cast<uint64_t>(ty) << 16) | static_cast<uint64_t>(tx);
+
+		// Lock-free fast path: a small direct-mapped table of the tiles this thread used last.
+		// Its hits go to a counter only this thread writes, so counting them costs no shared
+		// cache line.
+		struct recent { uint64_t key = 0; std::shared_ptr<const texture_tile> tile; };
+		thread_local recent recent_tiles[32];
+		thread_local hit_counter* recent_hits = add_hit_counter();
+
+		auto& slot = recent_tiles[(key ^ (key >> 29)) & recent_mask.load(std::memory_order_relaxed)];
+		if (slot.key == key) {
+			recent_hits->count.store(recent_hits->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return slot.tile.get();
+		}
+
+		slot.key = key;
+		slot.tile = acquire(tex, key, lvl, tx, ty);
+		return slot.tile.get();
+	}
+
+	statistics stats() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		statistics s;
+		s.hits = hits.load();
+		{
+			std::lock_guard<std::mutex> counters_lock(counters_mutex);
+			for (const auto& counter : hit_counters)
+				s.hits += counter.count.load(std::memory_order_relaxed);
+		}
+		s.misses = misses.load();
+		s.evictions = evictions;
+		s.resident_bytes = resident_bytes;
+		s.peak_bytes = peak_bytes;
+		return s;
+	}
+
+	void report(std::ostream& out) const {
+		if (!is_enabled || textures.empty()) return;
+		auto s = stats();
+		auto requests = s.hits + s.misses;
+		out << "Texture cache: " << textures.size() << " textures, "
+			<< s.hits << " hits, " << s.misses << " misses ("
+			<< (requests ? 100.0 * s.hits / requests : 0.0) << "% hit rate), "
+			<< s.evictions << " evictions, peak " << s.peak_bytes / (1024.0 * 1024.0) << " MB of "
+			<< budget / (1024.0 * 1024.0) << " MB budget\n";
+	}
+
+private:
+	struct entry {
+		std::shared_ptr<const texture_tile> tile;
+		std::list<uint64_t>::iterator lru_position;
+	};
+
+	bool is_enabled = false;
+	size_t budget = 0;
+	std::string cache_directory;
+
+	std::mutex open_mutex;  // Serializes conversion and opening of texture files
+	std::unordered_map<std::string, std::shared_ptr<tiled_texture>> textures;
+	size_t largest_tile = 0;
+	std::atomic<uint32_t> recent_mask{ 31 };  // Slots of the recent-tile tables in use, minus one
+
+	mutable std::mutex mutex;  // Guards the resident tile table and LRU list
+	std::unordered_map<uint64_t, entry> resident;
+	std::list<uint64_t> lru;   // Most recently used at the front
+	size_t resident_bytes = 0;
+	size_t peak_bytes = 0;
+	uint64_t evictions = 0;
+
+	// Bytes of all tiles in memory, counted down by each tile's deleter. Shared with the
+	// deleters, since threads can release tiles after the cache is gone.
+	std::shared_ptr<std::atomic<size_t>> live_bytes = std::make_shared<std::atomic<size_t>>(0);
+
+	std::atomic<uint64_t> hits{ 0 };
+	std::atomic<uint64_t> misses{ 0 };
+
+	struct alignas(64) hit_counter {
+		std::atomic<uint64_t> count{ 0 };
+	};
+	mutable std::mutex counters_mutex;
+	std::list<hit_counter> hit_counters;  // One per thread that fetched, kept after it exits
+
+	hit_counter* add_hit_counter() {
+		std::lock_guard<std::mutex> lock(counters_mutex);
+		return &hit_counters.emplace_back();
+	}
+
+	std::shared_ptr<const texture_tile> acquire(const tiled_texture& tex, uint64_t key, int lvl, int tx, int ty) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto found = resident.find(key);
+			if (found != resident.end()) {
+				lru.splice(lru.begin(), lru, found->second.lru_position);
+				hits.fetch_add(1, std::memory_order_relaxed);
+				return found->second.tile;
+			}
+		}
+
+		// Read outside the table lock so other threads keep shading while this one waits on disk.
+		misses.fetch_add(1, std::memory_order_relaxed);
+		auto bytes = tex.tile_bytes();
+		live_bytes->fetch_add(bytes);
+		std::shared_ptr<texture_tile> tile(new texture_tile, [live = live_bytes, bytes](texture_tile* t) {
+			live->fetch_sub(bytes);
+			delete t;
+			});
+		if (!tex.read_tile(lvl, tx, ty, tile->texels))
+			tile->texels.assign(bytes, 0);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = resident.find(key);
+		if (found != resident.end())  // Another thread loaded it meanwhile
+			return found->second.tile;
+
+		lru.push_front(key);
+		resident[key] = { tile, lru.begin() };
+		resident_bytes += tile->texels.size();
+
+		// Evicted tiles that threads still hold stay in memory, so more are evicted to make up.
+		peak_bytes = std::max(peak_bytes, live_bytes->load());
+		while (live_bytes->load() > budget && lru.size() > 1) {
+			auto victim = resident.find(lru.back());
+			resident_bytes -= victim->second.tile->texels.size();
+			resident.erase(victim);
+			lru.pop_back();
+			evictions++;
+		}
+		return tile;
+	}
+
+	std::string tiled_path(const std::string& filename) const {
+		auto name = filename;
+		for (auto& c : name)
+			if (c == '/' || c == '\\' || c == ':') c = '_';
+		return cache_directory + "/" + name + ".rtwtex";
+	}
+
+	struct source_info {
+		int64_t size = 0;   // Of the source image in bytes
+		int64_t mtime = 0;  // Last write time of the source image, in file clock ticks
+		bool operator==(const source_info&) const = default;
+	};
+
+	struct file_header {
+		char    magic[4] = { 'R', 'T', 'W', 'T' };
+		int32_t version = 3;
+		int32_t tile_size = 0;
+		int32_t level_count = 0;
+		texel_format format = texel_format::srgb8;
+		source_info source;
+	};
+
+	static source_info source_stamp(const std::string& filename) {
+		// Zero when the source image cannot be found, in which case any tiled file is used.
+		source_info stamp;
+		auto path = rtw_image::locate(filename.c_str());
+		std::error_code size_error, time_error;
+		auto size = std::filesystem::file_size(path, size_error);
+		auto time = std::filesystem::last_write_time(path, time_error);
+		if (path.empty() || size_error || time_error)
+			return stamp;
+		stamp.size = static_cast<int64_t>(size);
+		stamp.mtime = static_cast<int64_t>(time.time_since_epoch().count());
+		return stamp;
+	}
+
+	std::shared_ptr<tiled_texture> load_tiled(const std::string& path, const source_info& source) const {
+		// Returns null if there is no valid tiled file, or it was made from another version of
+		// the source image.
+		auto tex = std::make_shared<tiled_texture>();
+		tex->file.open(path, std::ios::in | std::ios::binary);
+
+		file_header header;
+		if (!tex->file.read(reinterpret_cast<char*>(&header), sizeof(header))
+			|| std::memcmp(header.magic, "RTWT", 4) != 0 || header.version != 3 || header.level_count < 1)
+			return nullptr;
+		if (source.size != 0 && !(header.source == source)) {
+			std::clog << "Tiled texture '" << path << "' was made from another version of its source image; converting again.\n";
+			return nullptr;
+		}
+
+		tex->tile_size = header.tile_size;
+		tex->format = header.format;
+		tex->level_table.resize(header.level_count);
+		if (!tex->file.read(reinterpret_cast<char*>(tex->level_table.data()), sizeof(tiled_texture::level_info) * header.level_count))
+			return nullptr;
+		return tex;
+	}
+
+	bool convert(const std::string& filename, texel_format format, const std::string& path, int tile_size,
+		const source_info& source) const {
+		// Decodes the image, builds its mip pyramid and writes every level as fixed-size tiles.
+		rtw_image image(filename.c_str());
+		if (image.height() <= 0) return false;
+		mipmap pyramid(image, format);
+
+		std::error_code ec;
+		std::filesystem::create_directories(cache_directory, ec);
+		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!out) {
+			std::cerr << "ERROR: Could not write tiled texture '" << path << "'.\n";
+			return false;
+		}
+
+		file_header header;
+		header.tile_size = tile_size;
+		header.level_count = pyramid.levels();
+		header.format = format;
+		header.source = source;
+
+		std::vector<tiled_texture::level_info> table(pyramid.levels());
+		auto stride = texel_bytes(format);
+		auto tile_bytes = static_cast<int64_t>(tile_size) * tile_size * stride;
+		int64_t offset = sizeof(header) + sizeof(tiled_texture::level_info) * table.size();
+		for (int lvl = 0; lvl < pyramid.levels(); lvl++) {
+			auto& l = table[lvl];
+			l.width = pyramid.width(lvl);
+			l.height = pyramid.height(lvl);
+			l.tiles_x = (l.width + tile_size - 1) / tile_size;
+			l.tiles_y = (l.height + tile_size - 1) / tile_size;
+			l.offset = offset;
+			offset += tile_bytes * l.tiles_x * l.tiles_y;
+		}
+
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(table.data()), sizeof(tiled_texture::level_info) * table.size());
+
+		std::vector<unsigned char> tile(tile_bytes);
+		for (int lvl = 0; lvl < pyramid.levels(); lvl++) {
+			auto& l = table[lvl];
+			for (int ty = 0; ty < l.tiles_y; ty++) {
+				for (int tx = 0; tx < l.tiles_x; tx++) {
+					// Pad edge tiles by clamping, so tiles are uniform and filtering needs no special case.
+					for (int y = 0; y < tile_size; y++) {
+						for (int x = 0; x < tile_size; x++) {
+							auto sx = std::min(tx * tile_size + x, l.width - 1);
+							auto sy = std::min(ty * tile_size + y, l.height - 1);
+							std::copy_n(pyramid.texel_data(lvl, sx, sy), stride, &tile[(static_cast<size_t>(y) * tile_size + x) * stride]);
+						}
+					}
+					out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+				}
+			}
+		}
+
+		std::clog << "Converted '" << filename << "' to tiled texture '" << path << "'.\n";
+		return static_cast<bool>(out);
+	}
+};
+
+template <texel_format stored>
+inline void tiled_texture::fetch(int lvl, int x, int y, float* rgb) const {
+	// Returns the linear texel at x,y of the given level, clamping coordinates to the image.
+	// `stored` must be the texture's format.
+	const level_info& l = level_table[lvl];
+	x = std::clamp(x, 0, l.width - 1);
+	y = std::clamp(y, 0, l.height - 1);
+
+	auto tile = cache->fetch(*this, lvl, x / tile_size, y / tile_size);
+	auto p = &tile->texels[(static_cast<size_t>(y % tile_size) * tile_size + x % tile_size) * texel_bytes(stored)];
+	decode_texel<stored>(p, rgb);
+}
+
+#endif
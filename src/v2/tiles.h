@@ -0,0 +1,202 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// A rectangular block of pixels, the unit of work handed to render threads and worker processes.
+struct tile {
+	int x0, y0;         // Upper-left pixel of the tile
+	int width, height;  // Tile extent in pixels (edge tiles may be smaller than tile_size)
+};
+
+std::vector<tile> make_tiles(int image_width, int image_height, int tile_size) {
+	// Splits the image into tiles in scanline order.
+	std::vector<tile> tiles;
+	for (int y = 0; y < image_height; y += tile_size) {
+		for (int x = 0; x < image_width; x += tile_size) {
+			tiles.push_back({ x, y, std::min(tile_size, image_width - x), std::min(tile_size, image_height - y) });
+		}
+	}
+	return tiles;
+}
+
+enum class shard_mode {
+	tiles,    // Each worker renders every sample of a subset of the tiles
+	samples   // Each worker renders a subset of the samples of every tile
+};
+
+struct shard_config {
+	// Describes which part of a frame one worker process is responsible for.
+	int index = 0;  // This worker's index in [0, count)
+	int count = 1;  // Number of workers sharing the frame
+	shard_mode mode = shard_mode::tiles;
+
+	bool is_distributed() const { return count > 1; }
+
+	bool owns_tile(size_t tile_index) const {
+		return mode == shard_mode::samples || static_cast<int>(tile_index % count) == index;
+	}
+
+	void sample_range(int samples_per_pixel, int& begin, int& end) const {
+		// Returns the half-open range of sample indices this worker traces for every pixel.
+		if (mode == shard_mode::tiles) {
+			begin = 0;
+			end = samples_per_pixel;
+			return;
+		}
+		begin = static_cast<int>(static_cast<int64_t>(samples_per_pixel) * index / count);
+		end = static_cast<int>(static_cast<int64_t>(samples_per_pixel) * (index + 1) / count);
+	}
+
+	std::string part_file(const std::string& file_name) const {
+		return file_name + ".part" + std::to_string(index);
+	}
+};
+
+// Partial framebuffer files hold the unnormalized float sample sums of the tiles one worker
+// rendered. Because tiles never overlap and sample ranges are disjoint, merging is a plain sum.
+// Tile shards merge to exactly the single-process image. Sample shards match it only within
+// float rounding: each shard rounds its own partial sum, where one process rounds a running sum.
+struct partial_header {
+	char    magic[4] = { 'R', 'T', 'W', 'P' };
+	int32_t version = 1;
+	int32_t image_width = 0;
+	int32_t image_height = 0;
+	int32_t samples_per_pixel = 0;  // Samples per pixel of the complete frame
+	int32_t shard_index = 0;
+	int32_t shard_count = 1;
+	int32_t tile_count = 0;         // Number of tile records following the header
+};
+
+struct partial_tile_header {
+	int32_t x0, y0, width, height;
+};
+
+class partial_writer {
+	// Appends the tiles owned by one shard to its partial file as they complete.
+public:
+	partial_writer(const std::string& file_name, const shard_config& shard, int image_width, int image_height,
+		int samples_per_pixel, const std::vector<tile>& tiles)
+		: out(file_name, std::ios::out | std::ios::binary | std::ios::trunc)
+	{
+		if (!out) {
+			std::cerr << "ERROR: Could not open partial file '" << file_name << "'.\n";
+			return;
+		}
+
+		partial_header header;
+		header.image_width = image_width;
+		header.image_height = image_height;
+		header.samples_per_pixel = samples_per_pixel;
+		header.shard_index = shard.index;
+		header.shard_count = shard.count;
+		for (size_t n = 0; n < tiles.size(); n++)
+			if (shard.owns_tile(n)) header.tile_count++;
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	}
+
+	bool write_tile(const tile& t, const float* sums, int buffer_width, int buffer_y0) {
+		// Writes tile `t` from an RGB sum buffer `buffer_width` pixels wide whose first row is image row `buffer_y0`.
+		partial_tile_header th = { t.x0, t.y0, t.width, t.height };
+		out.write(reinterpret_cast<const char*>(&th), sizeof(th));
+		for (int y = t.y0; y < t.y0 + t.height; y++) {
+			auto row = &sums[(static_cast<size_t>(y - buffer_y0) * buffer_width + t.x0) * 3];
+			out.write(reinterpret_cast<const char*>(row), sizeof(float) * 3 * t.width);
+		}
+		return static_cast<bool>(out);
+	}
+
+	bool close() {
+		// False if the file could not be opened or any write failed.
+		if (out.is_open())
+			out.close();
+		return !out.fail();
+	}
+
+private:
+	std::ofstream out;
+};
+
+bool merge_partials(const std::vector<std::string>& part_files, std::vector<float>& sums,
+	int& image_width, int& image_height, int& samples_per_pixel) {
+	// Sums a complete set of partial files into `sums`. Returns false if the files are unreadable,
+	// disagree on the frame setup, or do not cover every shard exactly once. Shards are added in
+	// index order in double precision, so the result does not depend on the order of the files.
+	std::vector<std::ifstream> shards;
+
+	for (const auto& file_name : part_files) {
+		std::ifstream in(file_name, std::ios::in | std::ios::binary);
+		partial_header header;
+		if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, "RTWP", 4) != 0
+			|| header.shard_count < 1 || header.image_width < 1 || header.image_height < 1) {
+			std::cerr << "ERROR: '" << file_name << "' is not a partial render file.\n";
+			return false;
+		}
+
+		if (shards.empty()) {
+			image_width = header.image_width;
+			image_height = header.image_height;
+			samples_per_pixel = header.samples_per_pixel;
+			shards.resize(header.shard_count);
+		}
+		else if (header.image_width != image_width || header.image_height != image_height
+			|| header.samples_per_pixel != samples_per_pixel || header.shard_count != static_cast<int>(shards.size())) {
+			std::cerr << "ERROR: '" << file_name << "' belongs to a different render.\n";
+			return false;
+		}
+
+		if (header.shard_index < 0 || header.shard_index >= header.shard_count || shards[header.shard_index].is_open()) {
+			std::cerr << "ERROR: '" << file_name << "' duplicates shard " << header.shard_index << ".\n";
+			return false;
+		}
+		shards[header.shard_index] = std::move(in);
+	}
+
+	for (size_t i = 0; i < shards.size(); i++) {
+		if (!shards[i].is_open()) {
+			std::cerr << "ERROR: missing partial file for shard " << i << ".\n";
+			return false;
+		}
+	}
+	if (shards.empty())
+		return false;
+
+	std::vector<double> total(static_cast<size_t>(image_width) * image_height * 3, 0.0);
+	std::vector<float> row;
+	for (size_t i = 0; i < shards.size(); i++) {
+		auto& in = shards[i];
+		partial_header header;
+		in.seekg(0);
+		in.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+		for (int n = 0; n < header.tile_count; n++) {
+			partial_tile_header th;
+			if (!in.read(reinterpret_cast<char*>(&th), sizeof(th))
+				|| th.x0 < 0 || th.y0 < 0 || th.x0 + th.width > image_width || th.y0 + th.height > image_height) {
+				std::cerr << "ERROR: the partial file for shard " << i << " is truncated or corrupt.\n";
+				return false;
+			}
+			row.resize(static_cast<size_t>(th.width) * 3);
+			for (int y = th.y0; y < th.y0 + th.height; y++) {
+				if (!in.read(reinterpret_cast<char*>(row.data()), sizeof(float) * row.size())) {
+					std::cerr << "ERROR: the partial file for shard " << i << " is truncated.\n";
+					return false;
+				}
+				auto dst = &total[(static_cast<size_t>(y) * image_width + th.x0) * 3];
+				for (size_t k = 0; k < row.size(); k++)
+					dst[k] += row[k];
+			}
+		}
+	}
+
+	sums.assign(total.begin(), total.end());
+	return true;
+}
+
+#endif
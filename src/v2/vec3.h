@@ -5,6 +5,7 @@
 #include <iostream>
 #include <limits>
 #include <random>
+#include <cstdint>
 
 
 using std::sqrt;
@@ -20,10 +21,55 @@ inline double degrees_to_radians(double degrees) {
 	return degrees * pi / 180.0;
 }
 
+class pcg32 {
+	// Small, fast PCG generator. Cheap enough to reseed for every pixel sample, which makes
+	// renders deterministic no matter which thread or process traces a given pixel.
+public:
+	pcg32(uint64_t seed = 0x853c49e6748fea9bULL) { seed_with(seed); }
+
+	void seed_with(uint64_t seed) {
+		state = 0;
+		next();
+		state += seed;
+		next();
+	}
+
+	uint32_t next() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+		uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = static_cast<uint32_t>(old >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+
+private:
+	uint64_t state;
+};
+
+inline pcg32& random_generator() {
+	// Each thread owns its generator, so parallel tiles never race on the random state.
+	thread_local pcg32 generator;
+	return generator;
+}
+
+inline uint64_t hash_seed(uint64_t a, uint64_t b = 0) {
+	// Mixes two integers (e.g. pixel index and sample index) into a well distributed seed.
+	uint64_t h = a * 0x9e3779b97f4a7c15ULL ^ (b + 0x632be59bd9b4e019ULL + (a << 6) + (a >> 2));
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+inline void seed_random(uint64_t seed) {
+	random_generator().seed_with(seed);
+}
+
 inline double random_double() {
-	static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-	static std::mt19937 generator;
-	return distribution(generator);
+	// Returns a random real in [0,1).
+	return random_generator().next() * (1.0 / 4294967296.0);
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,285 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "hittable.h"
+#include "material.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Participating media. A medium is a hittable whose "hit" is a sampled scattering event inside
+// its volume, with an isotropic phase function as its material, so media go into hittable_list
+// and bvh_node like surfaces. Free-flight distances are sampled by delta tracking: tentative
+// collisions are drawn against a majorant density and accepted with probability
+// density / majorant, which is unbiased and costs time in proportion to the optical depth.
+
+class constant_medium : public hittable {
+	// Homogeneous medium filling a closed boundary object. With a constant density the majorant
+	// is exact, so delta tracking reduces to a single exponential free-flight sample.
+public:
+	constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
+		: boundary(b), neg_inv_density(-1 / d), phase_function(make_shared<isotropic>(a))
+	{
+		bbox = boundary->bounding_box();
+	}
+
+	constant_medium(shared_ptr<hittable> b, double d, color c)
+		: boundary(b), neg_inv_density(-1 / d), phase_function(make_shared<isotropic>(c))
+	{
+		bbox = boundary->bounding_box();
+	}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+		hit_record rec1, rec2;
+
+		if (!boundary->hit(r, interval(-infinity, infinity), rec1))
+			return false;
+
+		if (!boundary->hit(r, interval(rec1.t + 0.0001, infinity), rec2))
+			return false;
+
+		if (rec1.t < ray_t.min) rec1.t = ray_t.min;
+		if (rec2.t > ray_t.max) rec2.t = ray_t.max;
+
+		if (rec1.t >= rec2.t)
+			return false;
+
+		if (rec1.t < 0)
+			rec1.t = 0;
+
+		auto ray_length = r.direction().length();
+		auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+		auto hit_distance = neg_inv_density * log(random_double());
+
+		if (hit_distance > distance_inside_boundary)
+			return false;
+
+		rec.t = rec1.t + hit_distance / ray_length;
+		rec.p = r.at(rec.t);
+
+		rec.normal = vec3(0, 0, 0);  // No surface, so light selection drops its cosine term
+		rec.front_face = true;       // arbitrary
+		rec.u = rec.v = 0;
+		rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+		rec.mat = phase_function;
+		rec.object = this;
+
+		return true;
+	}
+
+private:
+	shared_ptr<hittable> boundary;
+	double neg_inv_density;
+	shared_ptr<material> phase_function;
+};
+
+
+class sparse_density_grid {
+	// Block-sparse voxel grid of densities, in the spirit of NanoVDB leaf nodes: voxels live in
+	// 8x8x8 blocks that are only allocated when a non-zero density is written, and a dense
+	// table of one 32-bit slot per block maps block coordinates to allocated blocks. Empty space
+	// costs 4 bytes per 512 voxels. Every block also records its maximum density, which serves as
+	// the local majorant for delta tracking.
+public:
+	static const int block_size = 8;
+
+	sparse_density_grid(int _nx, int _ny, int _nz)
+		: nx(_nx), ny(_ny), nz(_nz),
+		bx((_nx + block_size - 1) / block_size), by((_ny + block_size - 1) / block_size), bz((_nz + block_size - 1) / block_size),
+		block_slots(static_cast<size_t>(bx) * by * bz, empty_block),
+		block_max(static_cast<size_t>(bx) * by * bz, 0.0f)
+	{}
+
+	int width() const { return nx; }
+	int height() const { return ny; }
+	int depth() const { return nz; }
+	int blocks_x() const { return bx; }
+	int blocks_y() const { return by; }
+	int blocks_z() const { return bz; }
+
+	void set(int x, int y, int z, float density) {
+		if (x < 0 || y < 0 || z < 0 || x >= nx || y >= ny || z >= nz)
+			return;
+		auto b = block_id(x / block_size, y / block_size, z / block_size);
+		if (block_slots[b] == empty_block) {
+			if (density == 0)
+				return;
+			block_slots[b] = static_cast<uint32_t>(blocks.size());
+			blocks.emplace_back();
+		}
+		blocks[block_slots[b]].density[voxel_id(x, y, z)] = density;
+		block_max[b] = std::max(block_max[b], density);
+	}
+
+	float density(int x, int y, int z) const {
+		// Density of the voxel, or zero outside the grid and in unallocated blocks.
+		if (x < 0 || y < 0 || z < 0 || x >= nx || y >= ny || z >= nz)
+			return 0;
+		auto slot = block_slots[block_id(x / block_size, y / block_size, z / block_size)];
+		return (slot == empty_block) ? 0 : blocks[slot].density[voxel_id(x, y, z)];
+	}
+
+	float majorant(int block_x, int block_y, int block_z) const {
+		// Maximum density within a block; zero for empty blocks.
+		return block_max[block_id(block_x, block_y, block_z)];
+	}
+
+	size_t allocated_blocks() const { return blocks.size(); }
+
+	size_t memory_bytes() const {
+		return blocks.size() * sizeof(block) + block_slots.size() * (sizeof(uint32_t) + sizeof(float));
+	}
+
+private:
+	static const uint32_t empty_block = 0xffffffff;
+
+	struct block {
+		float density[block_size * block_size * block_size] = {};
+	};
+
+	int nx, ny, nz;  // Grid size in voxels
+	int bx, by, bz;  // Grid size in blocks
+	std::vector<uint32_t> block_slots;  // Index into blocks, or empty_block
+	std::vector<float> block_max;
+	std::vector<block> blocks;
+
+	size_t block_id(int x, int y, int z) const {
+		return (static_cast<size_t>(z) * by + y) * bx + x;
+	}
+
+	static int voxel_id(int x, int y, int z) {
+		return ((z % block_size) * block_size + (y % block_size)) * block_size + (x % block_size);
+	}
+};
+
+
+class heterogeneous_medium : public hittable {
+	// Medium whose density comes from a sparse voxel grid stretched over an axis-aligned box.
+	// Delta tracking walks the ray through the grid's blocks with a 3D DDA and samples each
+	// block segment against that block's own majorant, so empty blocks are skipped outright and
+	// thin regions are crossed in few steps. Voxels are piecewise constant, which keeps each
+	// block's majorant exact.
+public:
+	heterogeneous_medium(shared_ptr<const sparse_density_grid> g, const point3& a, const point3& b,
+		double _density_scale, shared_ptr<texture> albedo)
+		: grid(g), density_scale(_density_scale), phase_function(make_shared<isotropic>(albedo))
+	{
+		bbox = aabb(a, b);
+		for (int i = 0; i < 3; i++) {
+			corner[i] = bbox.axis(i).min;
+			voxels_per_unit[i] = voxel_count(i) / bbox.axis(i).size();
+		}
+	}
+
+	heterogeneous_medium(shared_ptr<const sparse_density_grid> g, const point3& a, const point3& b,
+		double _density_scale, color c)
+		: heterogeneous_medium(g, a, b, _density_scale, make_shared<solid_color>(c))
+	{}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+		// Work in voxel coordinates, where the grid spans [0, n] on each axis.
+		double origin[3], dir[3];
+		auto t_enter = ray_t.min, t_exit = ray_t.max;
+		for (int i = 0; i < 3; i++) {
+			origin[i] = (r.origin()[i] - corner[i]) * voxels_per_unit[i];
+			dir[i] = r.direction()[i] * voxels_per_unit[i];
+
+			auto inv = 1 / dir[i];
+			auto t0 = -origin[i] * inv;
+			auto t1 = (voxel_count(i) - origin[i]) * inv;
+			if (inv < 0) std::swap(t0, t1);
+			t_enter = t0 > t_enter ? t0 : t_enter;
+			t_exit = t1 < t_exit ? t1 : t_exit;
+			if (t_exit <= t_enter) return false;
+		}
+
+		// Set up the block DDA at the entry point.
+		const double block_size = sparse_density_grid::block_size;
+		const int blocks[3] = { grid->blocks_x(), grid->blocks_y(), grid->blocks_z() };
+		int cell[3], step[3];
+		double t_next[3], t_delta[3];
+		for (int i = 0; i < 3; i++) {
+			auto p = origin[i] + t_enter * dir[i];
+			cell[i] = std::clamp(static_cast<int>(std::floor(p / block_size)), 0, blocks[i] - 1);
+			if (dir[i] > 0) {
+				step[i] = 1;
+				t_next[i] = t_enter + ((cell[i] + 1) * block_size - p) / dir[i];
+				t_delta[i] = block_size / dir[i];
+			}
+			else if (dir[i] < 0) {
+				step[i] = -1;
+				t_next[i] = t_enter + (cell[i] * block_size - p) / dir[i];
+				t_delta[i] = -block_size / dir[i];
+			}
+			else {
+				step[i] = 0;
+				t_next[i] = infinity;
+				t_delta[i] = infinity;
+			}
+		}
+
+		// The world space length of the ray direction converts densities (per world unit) to
+		// collision rates per unit of t.
+		auto ray_length = r.direction().length();
+		auto t = t_enter;
+		while (t < t_exit) {
+			auto axis = (t_next[0] < t_next[1]) ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+			auto t_block_end = std::min(t_next[axis], t_exit);
+
+			auto sigma_max = grid->majorant(cell[0], cell[1], cell[2]) * density_scale * ray_length;
+			if (sigma_max > 0) {
+				while (true) {
+					t -= std::log(1 - random_double()) / sigma_max;
+					if (t >= t_block_end)
+						break;
+
+					auto sigma = density_at(origin, dir, t) * density_scale * ray_length;
+					if (random_double() * sigma_max < sigma)
+						return scatter_at(r, t, rec);
+				}
+			}
+
+			// Continue from the block boundary: restarting the exponential there is valid
+			// because free-flight sampling is memoryless.
+			t = t_block_end;
+			cell[axis] += step[axis];
+			if (cell[axis] < 0 || cell[axis] >= blocks[axis])
+				break;
+			t_next[axis] += t_delta[axis];
+		}
+		return false;
+	}
+
+private:
+	shared_ptr<const sparse_density_grid> grid;
+	double density_scale;
+	shared_ptr<material> phase_function;
+	double corner[3];
+	double voxels_per_unit[3];
+
+	int voxel_count(int axis) const {
+		return (axis == 0) ? grid->width() : (axis == 1) ? grid->height() : grid->depth();
+	}
+
+	double density_at(const double* origin, const double* dir, double t) const {
+		int v[3];
+		for (int i = 0; i < 3; i++)
+			v[i] = static_cast<int>(std::floor(origin[i] + t * dir[i]));
+		return grid->density(v[0], v[1], v[2]);
+	}
+
+	bool scatter_at(const ray& r, double t, hit_record& rec) const {
+		rec.t = t;
+		rec.p = r.at(t);
+		rec.normal = vec3(0, 0, 0);  // No surface, so light selection drops its cosine term
+		rec.front_face = true;       // arbitrary
+		rec.u = rec.v = 0;
+		rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+		rec.mat = phase_function;
+		rec.object = this;
+		return true;
+	}
+};
+
+#endif